@@ -0,0 +1,40 @@
+#ifndef FUJI_CAM_WIFI_TOOL_ASYNC_COMMANDS_HPP
+#define FUJI_CAM_WIFI_TOOL_ASYNC_COMMANDS_HPP
+
+#include <stdint.h>
+#include <future>
+#include <memory>
+
+#include "commands.hpp"
+#include "control_channel.hpp"
+
+namespace fcwt {
+
+// Counterparts of the blocking functions in commands.hpp. The requests are
+// written to a control_channel right away and the futures are completed by
+// its reader, typically an io_reactor serving the channels of several
+// cameras, so a few threads can keep many requests outstanding. Nothing
+// waits for the camera until get() is called.
+
+// ready once the thumbnail was received, false if the shot or the transfer
+// failed
+std::future<bool> shutter_async(shutter_pipeline& pipeline,
+                                std::shared_ptr<data_sink> thumbnail = nullptr);
+
+// the id to pass to stop_record, 0 on failure
+std::future<uint32_t> start_record_async(control_channel& channel);
+std::future<bool> stop_record_async(control_channel& channel, uint32_t start_id);
+
+// settings must stay valid until the future is ready
+std::future<bool> current_settings_async(control_channel& channel, current_properties& settings);
+
+std::future<bool> update_setting_async(control_channel& channel, property_codes code, uint32_t value);
+std::future<bool> update_setting_async(control_channel& channel, auto_focus_point point);
+std::future<bool> update_setting_async(control_channel& channel, fnumber_update_direction dir);
+std::future<bool> update_setting_async(control_channel& channel, ss_update_direction dir);
+std::future<bool> update_setting_async(control_channel& channel, exp_update_direction dir);
+std::future<bool> unlock_focus_async(control_channel& channel);
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_ASYNC_COMMANDS_HPP
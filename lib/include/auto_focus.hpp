@@ -0,0 +1,63 @@
+#ifndef FUJI_CAM_WIFI_TOOL_AUTO_FOCUS_HPP
+#define FUJI_CAM_WIFI_TOOL_AUTO_FOCUS_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <vector>
+
+#include "focus_peaking.hpp"
+#include "settings.hpp"
+
+namespace fcwt {
+
+// Sharpness of the areas of the camera's AF points in live view images.
+// The points don't reach the image border: the image is divided into
+// columns + 2 by rows + 2 cells and point x, y (1 based like the camera)
+// covers cell x, y, as the stream_cv window draws them.
+class focus_grid_scorer {
+  int const columns;
+  int const rows;
+  std::vector<std::unique_ptr<focus_peaker>> peakers;  // one per thread
+  sharpness_map cells;
+
+ public:
+  // threads 0 for every core
+  focus_grid_scorer(int columns, int rows, unsigned threads = 0);
+
+  // Scores the point areas of a luma image, split across the threads by
+  // rows of points. The cell of point x, y in points is x - 1, y - 1.
+  void score(uint8_t const* luma, size_t luma_stride, int width, int height, sharpness_map& points);
+
+  size_t threads() const { return peakers.size(); }
+};
+
+enum class focus_rule {
+  sharpest,  // the point with the highest score
+  // of the points scoring at least contrast times the highest score, the
+  // one closest to the reference point: stays on a subject near where the
+  // focus already is instead of jumping to the most textured area
+  nearest,
+};
+
+auto_focus_point choose_focus_point(sharpness_map const& points, focus_rule rule,
+                                    auto_focus_point reference, float contrast = 0.5f);
+
+// Scores of the chosen point before and after the camera focused on it.
+// The choice is confirmed if the rule, with the point as the reference,
+// still picks it from the scores after.
+struct auto_focus_report {
+  auto_focus_point point = 0;
+  float before = 0;
+  float after = 0;
+  bool confirmed = false;
+};
+
+auto_focus_report confirm_focus_point(sharpness_map const& before, sharpness_map const& after,
+                                      auto_focus_point point, focus_rule rule, float contrast = 0.5f);
+
+void print(auto_focus_report const& report);
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_AUTO_FOCUS_HPP
@@ -0,0 +1,58 @@
+#ifndef FUJI_CAM_WIFI_TOOL_BRACKETING_HPP
+#define FUJI_CAM_WIFI_TOOL_BRACKETING_HPP
+
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "settings.hpp"
+
+namespace fcwt {
+
+class control_channel;
+class shutter_pipeline;
+
+// one relative exposure_correction step of the camera
+const int exposure_steps_per_ev = 3;
+
+struct bracket_shot {
+  int exposure_steps = 0;  // relative to the exposure compensation at start
+  bool set_focus_point = false;
+  auto_focus_point focus_point = 0;
+};
+
+struct bracket_plan {
+  std::vector<bracket_shot> shots;
+  bool restore = true;  // return to the starting exposure/focus point
+  // printf pattern taking the shot number, empty: thumbnails are discarded
+  std::string thumbnail_pattern;
+};
+
+// e.g. exposure_bracket(2.0, 1.0 / 3) shoots -2 EV to +2 EV in 1/3 EV steps,
+// in ascending order so the camera only ever moves by one shot spacing
+bracket_plan exposure_bracket(double range_ev, double step_ev);
+bracket_plan focus_sweep(std::vector<auto_focus_point> const& points);
+// all points of the AF grid, 1 based like the camera, row by row
+bracket_plan focus_grid_sweep(uint8_t columns, uint8_t rows);
+
+struct bracket_report {
+  unsigned shots = 0;
+  unsigned failed = 0;
+  std::chrono::microseconds duration = std::chrono::microseconds(0);
+  uint32_t exposure_before = 0;
+  uint32_t exposure_after = 0;
+};
+
+// Runs the plan as one sequence: the setting changes for a shot are sent
+// without waiting for each ack, and while the previous shot's thumbnail is
+// still being transferred. The camera state is only queried before the first
+// shot and, when restoring, after the last one.
+bool run_bracket(control_channel& channel, shutter_pipeline& pipeline,
+                 bracket_plan const& plan, bracket_report* report);
+
+void print(bracket_report const& report);
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_BRACKETING_HPP
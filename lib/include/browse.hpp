@@ -0,0 +1,140 @@
+#ifndef FUJI_CAM_WIFI_TOOL_BROWSE_HPP
+#define FUJI_CAM_WIFI_TOOL_BROWSE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "comm.hpp"
+#include "mapped_file.hpp"
+
+namespace fcwt {
+
+struct image_date {
+  uint16_t year = 0;
+  uint8_t month = 0;
+  uint8_t day = 0;
+  uint8_t hour = 0;
+  uint8_t minute = 0;
+  uint8_t second = 0;
+};
+
+// decoded response of image_info_by_index (PTP ObjectInfo layout)
+struct image_info {
+  uint32_t index = 0;
+  uint32_t storage_id = 0;
+  uint16_t format = 0;
+  uint32_t size = 0;
+  uint32_t thumbnail_size = 0;
+  uint32_t thumbnail_width = 0;
+  uint32_t thumbnail_height = 0;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  std::string filename;  // UTF-8
+  image_date date;
+};
+
+bool parse_image_info(void const* data, size_t size, image_info& info);
+
+// Only work after init_control_connection in connection_mode_browse.
+// Indices start at 1.
+bool image_info_by_index(native_socket sockfd, uint32_t index, image_info& info);
+bool thumbnail_by_index(native_socket sockfd, uint32_t index, std::vector<uint8_t>& jpeg);
+
+class thumbnail_cache;
+
+struct browse_options {
+  uint32_t first_index = 1;
+  uint32_t max_images = 0;       // 0: until the camera reports no more images
+  unsigned pipeline_depth = 8;   // images requested before waiting for a reply
+  bool thumbnails = true;
+  // with a cache thumbnails are only requested for images not in the cache,
+  // camera is the camera_key() of the connected camera
+  thumbnail_cache* cache = nullptr;
+  uint64_t camera = 0;
+};
+
+// thumbnail is null when thumbnails are disabled or the transfer failed
+typedef std::function<void(image_info const& info, uint8_t const* thumbnail,
+                           size_t thumbnail_size)> browse_callback;
+
+// Walks the card sending image_info_by_index and thumbnail_by_index requests
+// for up to pipeline_depth images ahead, the camera answers them in order.
+// Without a cache both requests for an image are sent together, with a cache
+// the thumbnail is requested once the image info missed the cache.
+// Returns the number of images reported through callback.
+size_t browse_card(native_socket sockfd, browse_options const& options,
+                   browse_callback const& callback);
+
+const uint32_t card_index_version = 1;
+
+struct card_index_header {
+  char magic[8];  // "FCWTIDX\0"
+  uint32_t version;
+  uint32_t entry_bytes;
+  uint64_t entries_offset;
+  uint64_t count;
+};
+
+struct card_index_entry {
+  uint64_t thumbnail_offset;  // from the start of the index file
+  uint32_t index;
+  uint32_t size;
+  uint32_t width;
+  uint32_t height;
+  uint32_t thumbnail_width;
+  uint32_t thumbnail_height;
+  uint32_t thumbnail_size;
+  uint16_t format;
+  uint16_t year;
+  uint8_t month;
+  uint8_t day;
+  uint8_t hour;
+  uint8_t minute;
+  uint8_t second;
+  uint8_t reserved[3];
+  char filename[80];  // UTF-8, zero terminated
+};
+
+static_assert(sizeof(card_index_header) == 32, "card index layout");
+static_assert(sizeof(card_index_entry) == 128, "card index layout");
+
+// Card index file: header, thumbnails as they were received, entry table.
+// The header is rewritten by finish() once the table has been appended.
+class card_index_writer {
+  FILE* file = nullptr;
+  uint64_t offset = 0;
+  std::vector<card_index_entry> entries;
+
+ public:
+  card_index_writer() = default;
+  ~card_index_writer();
+  card_index_writer(card_index_writer const&) = delete;
+  card_index_writer& operator=(card_index_writer const&) = delete;
+
+  bool open(char const* path);
+  bool add(image_info const& info, uint8_t const* thumbnail, size_t thumbnail_size);
+  bool finish();
+};
+
+// read-only view of a card index file, memory mapped
+class card_index {
+  mapped_file file;
+  card_index_entry const* entries = nullptr;
+  size_t count = 0;
+
+ public:
+  bool open(char const* path);
+
+  size_t size() const { return count; }
+  card_index_entry const& operator[](size_t i) const { return entries[i]; }
+  // null if the entry has no thumbnail
+  uint8_t const* thumbnail(size_t i) const;
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_BROWSE_HPP
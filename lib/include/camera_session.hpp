@@ -0,0 +1,254 @@
+#ifndef FUJI_CAM_WIFI_TOOL_CAMERA_SESSION_HPP
+#define FUJI_CAM_WIFI_TOOL_CAMERA_SESSION_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "bracketing.hpp"
+#include "comm.hpp"
+#include "commands.hpp"
+#include "io_reactor.hpp"
+#include "settings.hpp"
+
+namespace fcwt {
+
+class capability_cache;
+class camera_session;
+class control_channel;
+
+// where to reach a camera: bodies on separate interfaces all answer on the
+// default address, device selects the interface
+struct camera_endpoint {
+  std::string address = default_camera_address;
+  std::string device;
+};
+
+// Order in which queued commands run, a running command is never
+// interrupted. Within a priority the commands run in the order they were
+// posted.
+enum class command_priority : uint8_t {
+  shutter,  // releases
+  focus,    // focus point changes
+  normal,   // settings and everything else
+  poll,     // status requests, only run when nothing else is queued
+};
+
+const size_t command_priorities = 4;
+
+struct command_queue_stats {
+  struct level {
+    uint64_t tasks = 0;      // run
+    uint64_t coalesced = 0;  // merged into a command that was already queued
+    std::chrono::microseconds total_wait = std::chrono::microseconds(0);  // queued until run
+    std::chrono::microseconds max_wait = std::chrono::microseconds(0);
+  };
+  std::array<level, command_priorities> levels;
+};
+
+void print(command_queue_stats const& stats);
+
+// What a task running on the session strand may use. The sockets are only
+// used by the strand, so the blocking functions of commands.hpp can be
+// called on them directly.
+class camera_io {
+  friend class camera_session;
+  camera_session& session;
+
+  explicit camera_io(camera_session& session) : session(session) {}
+
+ public:
+  native_socket control = 0;
+  native_socket async = 0;
+  // working copy of the camera settings, refresh_settings publishes it
+  current_properties settings;
+
+  bool refresh_settings();
+  // pipelined channel on the control socket for the rest of the task, read
+  // by the session's io_reactor if it has one
+  std::unique_ptr<control_channel> open_channel();
+};
+
+// One connection to a camera: owns the control, async and live view
+// sockets, the capabilities and a snapshot of the settings. All control
+// traffic runs on an internal strand (one worker thread executing tasks by
+// priority, then in the order they were posted), so any thread can post
+// commands without waiting for a lock held by another user; a posted task is
+// never dropped. A status poll or relative setting step that is posted while
+// an equal one is still queued is merged into it.
+class camera_session {
+  friend class camera_io;
+
+  camera_endpoint const endpoint_;
+  io_reactor* const reactor;
+  sock control;
+  sock async;
+  mutable std::mutex stream_mutex;  // guards stream
+  sock stream;
+  camera_io io;
+
+  mutable std::mutex state_mutex;  // guards the members below
+  connect_profile profile_;
+  std::vector<capability> caps_;
+  current_properties settings_;
+  connection_mode mode_ = connection_mode_remote;
+  bool connected = false;
+
+  struct queued_task {
+    std::function<void()> run;
+    std::chrono::steady_clock::time_point queued;
+  };
+  struct queued_step {
+    int steps;
+    std::shared_future<bool> result;
+  };
+
+  mutable std::mutex queue_mutex;  // guards the members below
+  std::condition_variable queue_cv;
+  std::array<std::deque<queued_task>, command_priorities> queues;
+  bool poll_queued = false;
+  std::shared_future<bool> queued_poll;
+  // steps posted since the last other normal priority command
+  std::map<property_codes, std::shared_ptr<queued_step>> queued_steps;
+  command_queue_stats stats;
+  bool stopping = false;
+  std::thread worker;
+
+ public:
+  // reactor, if given, reads the control channels of the session's tasks
+  // and has to outlive the session
+  explicit camera_session(camera_endpoint endpoint = camera_endpoint(),
+                          io_reactor* reactor = nullptr);
+  ~camera_session();  // runs the tasks still queued, then disconnects
+  camera_session(camera_session const&) = delete;
+  camera_session& operator=(camera_session const&) = delete;
+
+  // Runs f(camera_io&) on the strand, the future gets its result. Tasks
+  // posted from the strand itself are queued like any other.
+  template <typename F>
+  auto post(F f, command_priority priority = command_priority::normal)
+      -> std::future<decltype(f(std::declval<camera_io&>()))> {
+    typedef decltype(f(std::declval<camera_io&>())) result_type;
+    auto const task = std::make_shared<std::packaged_task<result_type(camera_io&)>>(std::move(f));
+    std::future<result_type> result = task->get_future();
+    enqueue([this, task]() { (*task)(io); }, priority);
+    return result;
+  }
+
+  // post and wait; called from the strand f runs right away
+  template <typename F>
+  auto execute(F f, command_priority priority = command_priority::normal)
+      -> decltype(f(std::declval<camera_io&>())) {
+    if (on_strand()) return f(io);
+    return post(std::move(f), priority).get();
+  }
+
+  bool on_strand() const { return std::this_thread::get_id() == worker.get_id(); }
+
+  // blocking, caps and settings are read in remote mode
+  bool connect(char const* deviceName, capability_cache* cache = nullptr,
+               connection_mode mode = connection_mode_remote, bool pipeline = true);
+  void disconnect();
+  bool is_connected() const;
+
+  // live view socket, read by one consumer outside the strand: open_stream
+  // fails while it is open, the consumer closes it when done
+  bool open_stream();
+  native_socket stream_socket() const;
+  void close_stream();
+
+  // queued commands, the settings snapshot is refreshed afterwards
+  std::future<bool> shutter(std::string const& thumbnail);
+  std::future<bool> update(property_codes code, uint32_t value);
+  std::future<bool> focus(auto_focus_point point);
+  // Steps aperture, shutter speed or exposure compensation, negative is
+  // down. Steps of one property posted back to back (no other normal
+  // priority command in between) are summed while queued.
+  std::shared_future<bool> step(property_codes code, int steps);
+  // status poll, posted again while queued it shares the queued one
+  std::shared_future<bool> refresh_settings();
+
+  command_queue_stats queue_stats() const;
+  // tasks waiting for the strand, the running one not included
+  size_t queued() const;
+
+  camera_endpoint const& endpoint() const { return endpoint_; }
+  connection_mode mode() const;
+  connect_profile profile() const;
+  std::vector<capability> caps() const;
+  // e.g. the fresh capabilities the change handler of capability_cache gets
+  void set_caps(std::vector<capability> caps);
+  current_properties settings() const;
+  uint32_t setting(property_codes code) const;  // 0 if unknown
+
+ private:
+  void enqueue(std::function<void()> task, command_priority priority);
+  void push(std::function<void()> task, command_priority priority);  // queue_mutex held
+  void run();
+  void close_connection();
+};
+
+struct camera_trigger {
+  size_t camera = 0;  // index in the manager
+  bool parked = false;  // its strand was free in time, nothing was sent otherwise
+  bool acked = false;
+  std::chrono::microseconds send_offset = std::chrono::microseconds(0);  // after the first send
+  std::chrono::microseconds ack_latency = std::chrono::microseconds(0);
+  size_t thumbnail_bytes = 0;
+};
+
+struct sync_shutter_report {
+  std::vector<camera_trigger> cameras;
+  std::chrono::microseconds skew = std::chrono::microseconds(0);  // first to last send
+  std::chrono::microseconds ack_min = std::chrono::microseconds(0);
+  std::chrono::microseconds ack_max = std::chrono::microseconds(0);
+  std::chrono::microseconds ack_mean = std::chrono::microseconds(0);
+};
+
+void print(sync_shutter_report const& report);
+
+// Drives several camera sessions: connects them concurrently and releases
+// all shutters together. One io_reactor reads the control channels of all
+// sessions, so many cameras need no reader thread each.
+class camera_manager {
+  io_reactor reactor;  // outlives the sessions
+  std::vector<std::unique_ptr<camera_session>> sessions;
+
+ public:
+  camera_session& add(camera_endpoint endpoint);
+  size_t size() const { return sessions.size(); }
+  camera_session& operator[](size_t index) { return *sessions[index]; }
+
+  // returns the number of connected sessions
+  size_t connect_all(char const* deviceName, capability_cache* cache = nullptr);
+  void disconnect_all();
+
+  // Parks every connected session's strand, then sends the releases back to
+  // back from one thread (so the host side skew is only the cost of the
+  // sends); each strand reads its ack and the capture. A session whose strand
+  // is still busy after park_timeout is left out. thumbnail_pattern gets the
+  // camera index (%u), empty to discard. Returns true if every camera acked.
+  bool shutter(std::string const& thumbnail_pattern, sync_shutter_report* report = nullptr,
+               std::chrono::milliseconds park_timeout = std::chrono::seconds(5));
+
+  // Runs the plan on every connected camera at once, each on its strand;
+  // the thumbnails of camera n get the file name prefix cameraNN_. Returns
+  // true if every camera succeeded, reports gets one per connected camera.
+  bool bracket(bracket_plan const& plan, std::vector<bracket_report>* reports = nullptr);
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_CAMERA_SESSION_HPP
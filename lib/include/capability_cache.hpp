@@ -0,0 +1,82 @@
+#ifndef FUJI_CAM_WIFI_TOOL_CAPABILITY_CACHE_HPP
+#define FUJI_CAM_WIFI_TOOL_CAPABILITY_CACHE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "capabilities.hpp"
+
+namespace fcwt {
+
+bool operator==(capability const& a, capability const& b);
+bool operator!=(capability const& a, capability const& b);
+
+// Compact binary form of parsed capabilities: a header followed by one record
+// per capability holding only the values actually used. Current values are
+// not part of it, they are 0 when read back. The hash of the records (also
+// returned by write_capabilities) tells whether two sets differ.
+uint64_t write_capabilities(std::vector<capability> const& caps, std::vector<uint8_t>& out);
+bool read_capabilities(uint8_t const* data, size_t size, std::vector<capability>& caps,
+                       uint64_t* hash = nullptr);
+
+// Persistent per camera capability cache, one file per camera in the
+// directory. Known cameras get their capabilities without parsing (the
+// current values are read from the live reply), the reply fetched during the
+// handshake is parsed on a background thread and replaces the cached entry
+// if the camera reports different capabilities.
+class capability_cache {
+ public:
+  // called on the background thread when the cached capabilities of a known
+  // camera were replaced by different ones; caps has the current values
+  typedef std::function<void(std::string const& camera,
+                             std::vector<capability> const& caps)> change_handler;
+
+ private:
+  struct entry {
+    uint64_t hash;
+    std::vector<capability> caps;
+  };
+
+  std::string directory;
+  change_handler on_change;
+  mutable std::mutex mutex;
+  std::unordered_map<std::string, entry> entries;
+  std::mutex worker_mutex;  // refresh may be called from several sessions
+  std::thread worker;
+
+ public:
+  capability_cache() = default;
+  ~capability_cache();
+  capability_cache(capability_cache const&) = delete;
+  capability_cache& operator=(capability_cache const&) = delete;
+
+  // uses the (existing) directory for the cache files
+  void open(char const* directory, change_handler handler = change_handler());
+
+  bool find(std::string const& camera, std::vector<capability>& caps);
+
+  // parses the raw camera_capabilities reply (without message header) on the
+  // background thread, unknown or changed capabilities are stored
+  void refresh(std::string const& camera, std::vector<uint8_t> data);
+
+  // drops the entry and its file
+  void invalidate(std::string const& camera);
+
+  // waits for a running refresh
+  void wait();
+
+ private:
+  bool load(std::string const& camera);
+  void update(std::string const& camera, std::vector<uint8_t> const& data);
+  std::string path(std::string const& camera) const;
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_CAPABILITY_CACHE_HPP
@@ -0,0 +1,60 @@
+#ifndef FUJI_CAM_WIFI_TOOL_COLOR_CONVERT_HPP
+#define FUJI_CAM_WIFI_TOOL_COLOR_CONVERT_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace fcwt {
+
+// Conversion of decoded live view images (BGR24) to the YUV layouts webcam
+// consumers want, and to luma alone for image analysis; BT.601 limited
+// range in fixed point. Chroma is the average of the 2 (YUYV) or 2x2 (NV12)
+// pixels it covers. Width and height must be even; strides are in bytes.
+
+enum class simd_level {
+  scalar,
+  sse41,
+  avx2,
+  neon,
+};
+
+char const* to_string(simd_level level);
+
+typedef void (*bgr_to_yuyv_function)(uint8_t const* bgr, size_t bgr_stride, int width, int height,
+                                     uint8_t* yuyv, size_t yuyv_stride);
+typedef void (*bgr_to_nv12_function)(uint8_t const* bgr, size_t bgr_stride, int width, int height,
+                                     uint8_t* y, size_t y_stride, uint8_t* uv, size_t uv_stride);
+typedef void (*bgr_to_gray_function)(uint8_t const* bgr, size_t bgr_stride, int width, int height,
+                                     uint8_t* gray, size_t gray_stride);
+
+struct color_kernels {
+  simd_level level;
+  bgr_to_yuyv_function bgr_to_yuyv;
+  bgr_to_nv12_function bgr_to_nv12;
+  bgr_to_gray_function bgr_to_gray;  // the Y plane of bgr_to_nv12, any width
+};
+
+// the fastest kernels this CPU runs, chosen once
+color_kernels const& best_color_kernels();
+// kernels of one level, null if they are not built in or the CPU lacks the
+// instructions; all levels give the same result
+color_kernels const* color_kernels_for(simd_level level);
+
+inline void bgr_to_yuyv(uint8_t const* bgr, size_t bgr_stride, int width, int height,
+                        uint8_t* yuyv, size_t yuyv_stride) {
+  best_color_kernels().bgr_to_yuyv(bgr, bgr_stride, width, height, yuyv, yuyv_stride);
+}
+
+inline void bgr_to_nv12(uint8_t const* bgr, size_t bgr_stride, int width, int height, uint8_t* y,
+                        size_t y_stride, uint8_t* uv, size_t uv_stride) {
+  best_color_kernels().bgr_to_nv12(bgr, bgr_stride, width, height, y, y_stride, uv, uv_stride);
+}
+
+inline void bgr_to_gray(uint8_t const* bgr, size_t bgr_stride, int width, int height, uint8_t* gray,
+                        size_t gray_stride) {
+  best_color_kernels().bgr_to_gray(bgr, bgr_stride, width, height, gray, gray_stride);
+}
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_COLOR_CONVERT_HPP
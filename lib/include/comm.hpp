@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <string.h>
 #include <memory>
+#include <vector>
 
 namespace fcwt {
 
@@ -12,6 +13,8 @@ const int control_server_port = 55740;
 const int async_response_server_port = 55741;
 const int jpg_stream_server_port = 55742;
 
+char const* const default_camera_address = "192.168.0.1";
+
 #ifdef _WIN32
 #define FCWT_USE_WINSOCK 1
 #elif defined(__unix__) || defined(__MACH__) || defined(__linux__)
@@ -40,16 +43,36 @@ class sock {
   operator native_socket() const;
 };
 
-sock connect_to_camera(int port);
+// device optionally binds the connection to a network interface (Linux),
+// for several cameras that all use the default address
+sock connect_to_camera(int port, char const* address = default_camera_address,
+                       char const* device = nullptr);
+
+// sends small requests right away instead of coalescing them with
+// unacknowledged data (Nagle), for latency critical requests
+void set_no_delay(native_socket sockfd, bool no_delay);
 
 void send_data(native_socket sockfd, void const* data, size_t sizeBytes);
 void receive_data(native_socket sockfd, void* data, size_t sizeBytes);
+
+// for readers that must not block forever: returns false on timeout
+bool wait_readable(native_socket sockfd, int timeoutMs);
+// readable receives those of sockets that can be read, returns false on
+// timeout
+bool wait_readable(std::vector<native_socket> const& sockets, int timeoutMs,
+                   std::vector<native_socket>& readable);
+// reads what is available (up to sizeBytes), returns 0 once the connection
+// is closed and -1 on error
+long receive_available(native_socket sockfd, void* data, size_t sizeBytes);
 void fuji_send(native_socket sockfd, void const* data, size_t sizeBytes);
 
 // returns the total payload bytes, if this is more than sizeBytes the caller
 // needs to use receive_data to get the additional data
 size_t fuji_receive(native_socket sockfd, void* data, size_t sizeBytes);
 
+// receives one complete message, data is resized to the payload size
+size_t fuji_receive(native_socket sockfd, std::vector<uint8_t>& data);
+
 template <size_t N>
 void fuji_send(native_socket sockfd, uint8_t const(&data)[N]) {
   fuji_send(sockfd, data, N);
@@ -4,6 +4,9 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <assert.h>
+#include <array>
+#include <chrono>
+#include <string>
 #include <vector>
 
 #include "comm.hpp"
@@ -14,16 +17,74 @@
 
 namespace fcwt {
 
+// the mode the camera is switched to during the handshake, the values are
+// sent in the 0xdf24 messages
+enum connection_mode : uint8_t {
+  connection_mode_receive = 0x21,
+  connection_mode_browse = 0x22,
+  connection_mode_remote = 0x24,
+  connection_mode_geo = 0x31
+};
+
+// identity reported by the camera in its reply to the hello message
+struct camera_identity {
+  std::string name;
+  std::array<uint8_t, 16> guid = {{}};
+  // stable string identifying the camera body, empty if unknown
+  std::string key() const;
+};
+
+struct connect_step {
+  char const* name = "";
+  std::chrono::microseconds sent = std::chrono::microseconds(0);   // since start
+  std::chrono::microseconds done = std::chrono::microseconds(0);
+  bool success = false;
+};
+
+struct connect_profile {
+  camera_identity camera;
+  std::vector<connect_step> steps;
+  std::chrono::microseconds total = std::chrono::microseconds(0);
+};
+
+void print(connect_profile const& profile);
+
+class capability_cache;
+
+// caps is only filled in remote mode. After the hello the remaining steps are
+// sent back to back and their replies checked in order (pipeline = false sends
+// each step after the previous reply), profile receives the timing per step.
+// With a cache the caps of a known camera are taken from it and the reply is
+// checked against the cache in the background.
 bool init_control_connection(native_socket sockfd, char const* deviceName,
-                             std::vector<capability>* caps);
+                             std::vector<capability>* caps,
+                             connection_mode mode = connection_mode_remote,
+                             connect_profile* profile = nullptr,
+                             bool pipeline = true,
+                             capability_cache* cache = nullptr);
+
+// data is the camera_capabilities reply without its message header
+std::vector<capability> parse_camera_caps(void const* data, size_t size);
+// sets the current values of caps (e.g. cached ones) from such a reply,
+// without parsing the rest
+void read_current_values(void const* data, size_t size, std::vector<capability>& caps);
 void terminate_control_connection(native_socket sockfd);
 
 bool shutter(native_socket const sockfd, native_socket const sockfd2, const char* thumbnail = 0);
 
+// shutter() split in two: shutter_release returns as soon as the camera acked
+// the shutter request, shutter_complete waits for the capture events and
+// transfers the thumbnail. Nothing else may be sent in between.
+bool shutter_release(native_socket const sockfd);
+bool shutter_complete(native_socket const sockfd, native_socket const sockfd2, const char* thumbnail = 0);
+bool shutter_complete(native_socket const sockfd, native_socket const sockfd2, data_sink& thumbnail);
+
 uint32_t start_record(native_socket const sockfd);
 bool stop_record(native_socket const sockfd, uint32_t);
 
 bool current_settings(native_socket sockfd, current_properties& settings);
+// data is the data phase of the status reply without its header
+bool parse_current_settings(uint8_t const* data, size_t size, current_properties& settings);
 
 enum fnumber_update_direction {
     fnumber_increment,
@@ -47,6 +108,13 @@ bool update_setting(native_socket sockfd, ss_update_direction dir);
 bool update_setting(native_socket sockfd, exp_update_direction dir);
 bool unlock_focus(native_socket sockfd);
 
+// request messages of the commands above, for sending through a
+// control_channel
+static_message<4> make_focus_point_message(auto_focus_point point);
+static_message<4> make_aperture_step_message(fnumber_update_direction dir);
+static_message<4> make_shutter_speed_step_message(ss_update_direction dir);
+static_message<4> make_exposure_step_message(exp_update_direction dir);
+
 }  // namespace fcwt
 
 #endif  // FUJI_CAM_WIFI_TOOL_COMMANDS_HPP
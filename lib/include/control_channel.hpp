@@ -0,0 +1,163 @@
+#ifndef FUJI_CAM_WIFI_TOOL_CONTROL_CHANNEL_HPP
+#define FUJI_CAM_WIFI_TOOL_CONTROL_CHANNEL_HPP
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "comm.hpp"
+#include "message.hpp"
+
+namespace fcwt {
+
+struct response {
+  bool success = false;
+  uint16_t code = 0;           // 0x2001 on success
+  std::vector<uint8_t> data;   // data phase, empty if it went to a sink
+  std::chrono::steady_clock::time_point sent;
+  std::chrono::steady_clock::time_point completed;
+};
+
+typedef std::function<void(response&)> completion_handler;
+
+class io_reactor;
+
+// Pipelined control connection: requests are written as soon as they are
+// submitted and the camera answers them in order, so a reader matches each
+// reply to the oldest pending request. The reader is a thread of the channel
+// or an io_reactor shared by several channels. Use it after
+// init_control_connection; the blocking functions taking the socket must not
+// be used on it while the channel exists.
+class control_channel {
+  struct pending {
+    uint32_t id;
+    std::shared_ptr<data_sink> sink;
+    completion_handler done;
+    response result;
+  };
+
+  native_socket const sockfd;
+  io_reactor* const reactor;
+  std::mutex write_mutex;
+  std::mutex pending_mutex;
+  std::condition_variable idle_cv;
+  std::deque<pending> in_flight;
+  std::atomic<bool> stopping;
+  std::thread reader;
+
+  // reader state, only touched by the reader thread
+  uint8_t frame_header[4 + message_header_bytes];
+  size_t frame_header_bytes = 0;
+  size_t payload_remaining = 0;
+
+ public:
+  explicit control_channel(native_socket sockfd);
+  // replies are read on the reactor thread, which must outlive the channel
+  control_channel(native_socket sockfd, io_reactor& reactor);
+  ~control_channel();  // fails requests still pending
+  control_channel(control_channel const&) = delete;
+  control_channel& operator=(control_channel const&) = delete;
+
+  native_socket socket() const { return sockfd; }
+
+  static void log_send(message_type type, void const* msg, size_t size);
+
+  // done is called on the reader thread (the reactor thread if there is one)
+  void submit(uint32_t id, void const* part1, size_t size1, void const* part2,
+              size_t size2, std::shared_ptr<data_sink> sink, completion_handler done);
+
+  template <size_t N>
+  std::future<response> request(static_message<N> const& msg,
+                                std::shared_ptr<data_sink> sink = nullptr) {
+    log_send(msg.type, &msg, msg.size());
+    return submit_future(msg.id, &msg, msg.size(), nullptr, 0, std::move(sink));
+  }
+
+  template <size_t N1, size_t N2>
+  std::future<response> request(static_message<N1> const& part1,
+                                 static_message<N2> const& part2) {
+    log_send(part1.type, &part1, part1.size());
+    log_send(part2.type, &part2, part2.size());
+    return submit_future(part2.id, &part1, part1.size(), &part2, part2.size(), nullptr);
+  }
+
+  size_t pending_count();
+  // blocks until no request is in flight
+  void wait_idle();
+
+ private:
+  std::future<response> submit_future(uint32_t id, void const* part1, size_t size1,
+                                      void const* part2, size_t size2,
+                                      std::shared_ptr<data_sink> sink);
+  void read_loop();
+  bool feed(uint8_t const* data, size_t size);
+  void complete_front(bool success, uint16_t code, uint32_t id);
+  void fail_all();
+};
+
+// Shutter that returns as soon as the camera acked the release. The capture
+// events and the thumbnail are handled in the background, in order, so the
+// next release can be sent while a thumbnail is still being transferred. The
+// camera only keeps the last image: a thumbnail whose request would follow a
+// later release is not fetched, its job fails.
+class shutter_pipeline {
+  struct job {
+    uint64_t release = 0;  // number of the release, from 1
+    std::shared_ptr<data_sink> sink;
+    std::promise<size_t> done;
+  };
+
+  control_channel& channel;
+  native_socket const async_sockfd;
+  std::chrono::milliseconds const capture_timeout;
+  std::mutex order_mutex;  // keeps releases and image requests in write order
+  uint64_t releases = 0;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<job> jobs;
+  unsigned acks_pending = 0;  // ack handlers still to run on the channel's reader
+  bool capturing = false;     // the worker reads the events of a job
+  bool stopping = false;
+  std::thread worker;
+
+ public:
+  // a capture whose events do not arrive within capture_timeout fails
+  shutter_pipeline(control_channel& channel, native_socket async_sockfd,
+                   std::chrono::milliseconds capture_timeout = std::chrono::seconds(30));
+  // waits for the acks of the releases sent, then fails the captures that
+  // did not complete yet
+  ~shutter_pipeline();
+  shutter_pipeline(shutter_pipeline const&) = delete;
+  shutter_pipeline& operator=(shutter_pipeline const&) = delete;
+
+  // false if the camera did not ack the shutter; thumbnail (optional) becomes
+  // ready with the number of thumbnail bytes passed to sink, 0 on failure
+  bool release(std::shared_ptr<data_sink> sink, std::future<size_t>* thumbnail = nullptr);
+
+  // sends the release without waiting for the ack, the capture is handled as
+  // with release once the ack arrived
+  std::future<response> release_async(std::shared_ptr<data_sink> sink,
+                                      std::future<size_t>* thumbnail = nullptr);
+
+ private:
+  void run();
+  // reads one async event, false on timeout or stop
+  bool receive_event(std::vector<uint8_t>& event, std::chrono::steady_clock::time_point deadline);
+  void fail(job& j);
+  // after a lost event: fails the queued captures and drops the events
+  // already received, one arriving later is dropped by the next release
+  void resync();
+  size_t drop_events();
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_CONTROL_CHANNEL_HPP
@@ -0,0 +1,72 @@
+#ifndef FUJI_CAM_WIFI_TOOL_FOCUS_PEAKING_HPP
+#define FUJI_CAM_WIFI_TOOL_FOCUS_PEAKING_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "color_convert.hpp"
+
+namespace fcwt {
+
+// Sharpness of columns x rows equal regions of an image, row by row: the
+// mean absolute Laplacian |4 c - left - right - above - below| of the luma
+// in each region. In-focus detail gives high values, but so does texture,
+// compare regions of the same frame or one region over several frames.
+struct sharpness_map {
+  int columns = 0;
+  int rows = 0;
+  std::vector<float> scores;
+
+  float score(int column, int row) const { return scores[row * columns + column]; }
+  // the region with the highest score
+  void sharpest(int& column, int& row) const;
+};
+
+void print(sharpness_map const& map);
+
+// Edge mask of the pixels from 1 to width - 1 of a row, their |Laplacian|
+// (up to 255) added to column_sums; for as many pixels as the vector code
+// covers, returns where the scalar code continues.
+typedef int (*laplacian_row_function)(uint8_t const* above, uint8_t const* row, uint8_t const* below,
+                                      int width, uint8_t threshold, uint8_t* mask, uint16_t* column_sums);
+
+struct peaking_kernels {
+  simd_level level;
+  laplacian_row_function laplacian_row;
+};
+
+// same selection as the color kernels
+peaking_kernels const& best_peaking_kernels();
+peaking_kernels const* peaking_kernels_for(simd_level level);
+
+// Focus peaking on the decoded luma. One peaker is reused for every frame
+// of a consumer, it only keeps the scratch rows.
+class focus_peaker {
+  peaking_kernels const* kernels;
+  std::vector<uint16_t> column_sums;
+  std::vector<uint8_t> scratch_mask;
+  std::vector<uint64_t> sums;
+
+ public:
+  explicit focus_peaker(peaking_kernels const& kernels = best_peaking_kernels()) : kernels(&kernels) {}
+
+  // Scores the regions of map (its columns and rows must be set) and, if
+  // edges is not null, sets the pixels whose |Laplacian| is above threshold
+  // to 255 and all others to 0. The border pixels have no Laplacian.
+  void process(uint8_t const* luma, size_t luma_stride, int width, int height, uint8_t threshold,
+               uint8_t* edges, size_t edges_stride, sharpness_map& map);
+  // Scores only the regions in rows first_row to last_row - 1 of map, its
+  // scores must have their size already. Peakers on separate threads can
+  // score separate rows of one map.
+  void score(uint8_t const* luma, size_t luma_stride, int width, int height, int first_row,
+             int last_row, sharpness_map& map);
+
+ private:
+  void score_rows(uint8_t const* luma, size_t luma_stride, int width, int height, uint8_t threshold,
+                  uint8_t* edges, size_t edges_stride, int first_row, int last_row, sharpness_map& map);
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_FOCUS_PEAKING_HPP
@@ -0,0 +1,127 @@
+#ifndef FUJI_CAM_WIFI_TOOL_FRAME_POOL_HPP
+#define FUJI_CAM_WIFI_TOOL_FRAME_POOL_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "comm.hpp"
+
+namespace fcwt {
+
+class frame;
+
+// Fixed set of equally sized buffers (slabs) for live view frames. All
+// memory is allocated up front; a slab goes back to the pool when the last
+// frame handle referring to it is released, from any thread.
+class frame_pool {
+  friend class frame;
+
+  struct slab {
+    uint8_t* data = nullptr;
+    size_t size = 0;
+    uint64_t sequence = 0;
+    std::chrono::steady_clock::time_point received;
+    std::atomic<unsigned> refs;
+  };
+
+  size_t const slab_bytes;
+  std::vector<uint8_t> memory;
+  std::unique_ptr<slab[]> slabs;
+  size_t const slab_count;
+
+  std::mutex free_mutex;  // guards the members below
+  std::vector<slab*> free_slabs;
+  uint64_t next_sequence = 0;
+  uint64_t exhausted_ = 0;
+
+ public:
+  frame_pool(size_t count, size_t bytes);
+  ~frame_pool();  // every frame must have been released
+  frame_pool(frame_pool const&) = delete;
+  frame_pool& operator=(frame_pool const&) = delete;
+
+  // a writable frame, empty if every slab is in use
+  frame acquire();
+
+  size_t capacity() const { return slab_bytes; }
+  size_t size() const { return slab_count; }
+  size_t available();
+  uint64_t exhausted();  // acquire calls that found no free slab
+
+ private:
+  void release(slab* s);
+};
+
+// Reference counted handle to a slab. Copies share the slab; the producer
+// fills it through buffer() and set_size() while it holds the only handle.
+class frame {
+  friend class frame_pool;
+
+  frame_pool* pool = nullptr;
+  frame_pool::slab* s = nullptr;
+
+  frame(frame_pool* pool, frame_pool::slab* s) : pool(pool), s(s) {}
+
+ public:
+  frame() {}
+  frame(frame const& other);
+  frame(frame&& other);
+  frame& operator=(frame other);
+  ~frame() { reset(); }
+
+  void swap(frame& other);
+  void reset();
+  explicit operator bool() const { return s != nullptr; }
+
+  uint8_t const* data() const { return s->data; }
+  size_t size() const { return s->size; }
+  uint64_t sequence() const { return s->sequence; }  // order of acquire
+  std::chrono::steady_clock::time_point received() const { return s->received; }
+
+  uint8_t* buffer() { return s->data; }
+  size_t capacity() const { return pool->capacity(); }
+  void set_size(size_t size);  // also stamps the receive time
+};
+
+// Bounded FIFO of frames between a producer and a consumer. When the
+// consumer falls behind the oldest frame is dropped, so it always gets the
+// most recent ones; the ring is allocated up front.
+class frame_queue {
+  std::mutex mutex;  // guards the members below
+  std::condition_variable cv;
+  std::vector<frame> ring;
+  size_t head = 0;
+  size_t count = 0;
+  uint64_t pushed_ = 0;
+  uint64_t dropped_ = 0;
+  bool closed = false;
+
+ public:
+  explicit frame_queue(size_t depth);
+
+  void push(frame f);
+  // waits for a frame, false once the queue was closed and is empty
+  bool pop(frame& f);
+  bool try_pop(frame& f);
+  // releases the oldest queued frame, false if the queue is empty
+  bool drop_oldest();
+  // wakes the consumer, later pushes are dropped
+  void close();
+
+  uint64_t pushed();
+  uint64_t dropped();
+};
+
+// Reads one message from the stream socket into f, returns its size. The
+// message is drained and 0 returned if f is empty or too small.
+size_t receive_frame(native_socket sockfd, frame& f);
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_FRAME_POOL_HPP
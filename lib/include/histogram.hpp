@@ -0,0 +1,59 @@
+#ifndef FUJI_CAM_WIFI_TOOL_HISTOGRAM_HPP
+#define FUJI_CAM_WIFI_TOOL_HISTOGRAM_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace fcwt {
+
+enum histogram_channel {
+  histogram_blue,
+  histogram_green,
+  histogram_red,
+  histogram_luma,  // BT.601 limited range as bgr_to_gray: 16 black, 235 white
+  histogram_channels
+};
+
+struct image_histogram {
+  uint32_t bins[histogram_channels][256] = {};
+  uint64_t pixels = 0;
+
+  // share of the pixels with a channel value in [low, high]
+  float share(histogram_channel channel, int low, int high) const;
+  // 0 to 255
+  float mean(histogram_channel channel) const;
+};
+
+// Exposure feedback from a histogram, shares of the pixels from 0 to 1.
+// Pixels count as clipped within tolerance of the end of the range, JPEG
+// compression leaves clipped areas a few values below it.
+struct exposure_stats {
+  float mean_luma = 0;  // 16 black, 235 white
+  float shadows = 0;     // luma at black
+  float highlights = 0;  // luma at white
+  float clipped[3] = {0, 0, 0};  // blue, green, red at 255; one clips before luma does
+};
+
+exposure_stats exposure(image_histogram const& histogram, int tolerance = 2);
+
+void print(exposure_stats const& stats);
+
+// Histograms of the decoded live view. Counting can't use vector
+// instructions, so every pixel goes to one of several banks of bins in
+// turn: neighbouring pixels are often equal, and increments of the same
+// bin would otherwise wait for each other. One builder is reused for every
+// frame of a consumer.
+class histogram_builder {
+  std::vector<uint32_t> banks;
+  std::vector<uint8_t> luma_row;
+
+ public:
+  // luma as bgr_to_gray gives it, computed here if null
+  void process(uint8_t const* bgr, size_t bgr_stride, int width, int height, uint8_t const* luma,
+               size_t luma_stride, image_histogram& histogram);
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_HISTOGRAM_HPP
@@ -0,0 +1,85 @@
+#ifndef FUJI_CAM_WIFI_TOOL_INTERVALOMETER_HPP
+#define FUJI_CAM_WIFI_TOOL_INTERVALOMETER_HPP
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "comm.hpp"
+
+namespace fcwt {
+
+class shutter_pipeline;
+class camera_session;
+
+struct intervalometer_options {
+  std::chrono::microseconds interval = std::chrono::seconds(1);
+  unsigned slots = 0;  // 0: until stop()
+  unsigned burst = 1;  // shots per slot
+  std::chrono::microseconds burst_interval = std::chrono::microseconds(0);
+  // a shot that cannot be sent within this time after its slot is skipped
+  // and counted as missed, 0: a quarter of the interval
+  std::chrono::microseconds miss_tolerance = std::chrono::microseconds(0);
+  // send early by the estimated one way latency (half the shutter ack rtt)
+  bool compensate_latency = true;
+  // printf pattern taking the frame number, empty: thumbnails are discarded
+  std::string thumbnail_pattern;
+};
+
+// times are in microseconds relative to the start of the run
+struct frame_timing {
+  unsigned frame = 0;
+  unsigned slot = 0;
+  int64_t scheduled = 0;
+  int64_t sent = 0;
+  int64_t acked = 0;
+  // estimated arrival at the camera (sent + rtt/2) minus scheduled
+  int64_t trigger_error = 0;
+  bool success = false;
+};
+
+struct intervalometer_report {
+  std::vector<frame_timing> frames;
+  unsigned missed = 0;  // shots skipped because they could not be sent in time
+  int64_t max_abs_error = 0;
+  double mean_abs_error = 0.0;
+};
+
+// Fires the shutter on a steady clock schedule: slot n starts at
+// start + n * interval, so late shots never shift the following ones. With
+// a session or a shutter_pipeline a shot returns at the ack and its
+// thumbnail is transferred in the background while waiting for the next
+// one; with plain sockets the transfer is part of the shot.
+class intervalometer {
+  native_socket const sockfd;
+  native_socket const sockfd2;
+  std::timed_mutex* const io_lock;
+  shutter_pipeline* const pipeline;
+  camera_session* const session;
+  std::atomic<bool> stopped;
+
+ public:
+  // io_lock, if given, is held while talking to the camera
+  intervalometer(native_socket sockfd, native_socket sockfd2,
+                 std::timed_mutex* io_lock = nullptr);
+  explicit intervalometer(shutter_pipeline& pipeline);
+  // every shot is a task on the session strand, posted shortly before it is due
+  explicit intervalometer(camera_session& session);
+
+  typedef std::function<void(frame_timing const&)> frame_callback;
+
+  // blocks until all slots are done or stop() is called
+  bool run(intervalometer_options const& options, intervalometer_report* report,
+           frame_callback const& on_frame = frame_callback());
+  void stop();
+};
+
+void print(intervalometer_report const& report);
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_INTERVALOMETER_HPP
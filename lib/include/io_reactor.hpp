@@ -0,0 +1,62 @@
+#ifndef FUJI_CAM_WIFI_TOOL_IO_REACTOR_HPP
+#define FUJI_CAM_WIFI_TOOL_IO_REACTOR_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "comm.hpp"
+
+namespace fcwt {
+
+// One thread reading many sockets: whatever arrives on a watched socket is
+// passed to its read handler, so the connections of several cameras need no
+// reader thread each. Handlers run on the reactor thread and must not block.
+class io_reactor {
+ public:
+  // false stops watching the socket
+  typedef std::function<bool(uint8_t const* data, size_t size)> read_handler;
+  // called once the socket was closed or its read handler returned false
+  typedef std::function<void()> close_handler;
+
+ private:
+  struct watch {
+    native_socket sockfd;
+    read_handler on_read;
+    close_handler on_close;
+  };
+
+  std::mutex mutex;  // guards the members below
+  std::condition_variable changed_cv;
+  std::vector<std::shared_ptr<watch>> watches;
+  watch const* dispatching = nullptr;
+  std::atomic<bool> stopping;
+  std::thread thread;
+
+ public:
+  io_reactor();
+  // sockets still watched get their close handler
+  ~io_reactor();
+  io_reactor(io_reactor const&) = delete;
+  io_reactor& operator=(io_reactor const&) = delete;
+
+  void add(native_socket sockfd, read_handler on_read, close_handler on_close = nullptr);
+  // once it returns the handlers of sockfd are not called anymore
+  void remove(native_socket sockfd);
+  size_t size();
+
+  bool on_reactor_thread() const { return std::this_thread::get_id() == thread.get_id(); }
+
+ private:
+  void run();
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_IO_REACTOR_HPP
@@ -0,0 +1,57 @@
+#ifndef FUJI_CAM_WIFI_TOOL_JPEG_DECODER_HPP
+#define FUJI_CAM_WIFI_TOOL_JPEG_DECODER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+
+namespace fcwt {
+
+// decoded size is the image size divided by the scale, rounded up; libjpeg
+// scales while it transforms the DCT blocks, so smaller is also faster
+enum class jpeg_scale {
+  full = 1,
+  half = 2,
+  quarter = 4,
+  eighth = 8,
+};
+
+enum class jpeg_pixel_format {
+  bgr,   // 3 bytes per pixel, as OpenCV uses it
+  gray,  // the luma only, the chroma is not decoded at all
+};
+
+// Decoder for the live view JPEGs, needs the library built WITH_LIBJPEG
+// (libjpeg-turbo). One decoder is reused for every frame of a consumer,
+// decoding into buffers the consumer owns.
+class jpeg_decoder {
+  struct state;
+  std::unique_ptr<state> s;
+
+ public:
+  jpeg_decoder();
+  ~jpeg_decoder();
+  jpeg_decoder(jpeg_decoder const&) = delete;
+  jpeg_decoder& operator=(jpeg_decoder const&) = delete;
+
+  // false if the library was built without a JPEG decoder
+  static bool available();
+
+  // image size from the frame header only, nothing is decoded (works
+  // without libjpeg too)
+  static bool read_header(uint8_t const* jpeg, size_t size, int& width, int& height);
+  static void scaled_size(int width, int height, jpeg_scale scale, int& scaled_width,
+                          int& scaled_height);
+  // the largest reduction that still gives at least max_width x max_height
+  static jpeg_scale scale_for(int width, int height, int max_width, int max_height);
+
+  // Decodes into out, rows stride bytes apart, capacity bytes in total.
+  // width and height receive the decoded size. False if the JPEG is broken
+  // or out is too small.
+  bool decode(uint8_t const* jpeg, size_t size, jpeg_scale scale, jpeg_pixel_format format,
+              uint8_t* out, size_t stride, size_t capacity, int& width, int& height);
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_JPEG_DECODER_HPP
@@ -0,0 +1,185 @@
+#ifndef FUJI_CAM_WIFI_TOOL_LIVE_VIEW_HPP
+#define FUJI_CAM_WIFI_TOOL_LIVE_VIEW_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include "comm.hpp"
+#include "frame_pool.hpp"
+
+namespace fcwt {
+
+// Hands values from one producer thread to one consumer thread without
+// locks, keeping only the latest (a triple buffer): the producer fills
+// back(), publish() swaps it with the middle slot, acquire() swaps the middle
+// slot with front() if it holds a newer value. A value published while the
+// previous one was not acquired yet replaces it and counts as dropped. The
+// slots are reused, so values that own buffers (frames, images) keep them.
+template <typename T>
+class latest_buffer {
+  static const uint8_t index_mask = 0x3;
+  static const uint8_t fresh = 0x4;
+
+  std::array<T, 3> slots;
+  uint8_t back_index = 0;   // producer only
+  uint8_t front_index = 1;  // consumer only
+  std::atomic<uint8_t> middle;
+  std::atomic<uint64_t> published_;
+  std::atomic<uint64_t> dropped_;
+  std::atomic<bool> closed;
+
+  // only used to sleep in wait(), publish() never takes the mutex
+  std::mutex wait_mutex;
+  std::condition_variable wait_cv;
+
+ public:
+  latest_buffer() : middle(2), published_(0), dropped_(0), closed(false) {}
+  latest_buffer(latest_buffer const&) = delete;
+  latest_buffer& operator=(latest_buffer const&) = delete;
+
+  // producer side
+  T& back() { return slots[back_index]; }
+  void publish() {
+    uint8_t const previous = middle.exchange(static_cast<uint8_t>(back_index | fresh));
+    back_index = previous & index_mask;
+    if (previous & fresh) ++dropped_;
+    ++published_;
+    wait_cv.notify_one();
+  }
+  // wakes the consumer, wait() returns false from now on
+  void close() {
+    closed = true;
+    wait_cv.notify_all();
+  }
+
+  // consumer side: true if front() now holds a value not seen before
+  bool acquire() {
+    if (!(middle.load() & fresh)) return false;
+    front_index = middle.exchange(front_index) & index_mask;
+    return true;
+  }
+  // acquire, sleeping up to timeout for a value; a publish racing with the
+  // sleep is seen after at most the timeout
+  bool wait(std::chrono::microseconds const timeout) {
+    if (acquire()) return true;
+    {
+      std::unique_lock<std::mutex> lock(wait_mutex);
+      wait_cv.wait_for(lock, timeout, [this]() { return closed || (middle.load() & fresh); });
+    }
+    return acquire();
+  }
+  T& front() { return slots[front_index]; }
+  bool is_closed() const { return closed; }
+
+  uint64_t published() const { return published_; }
+  uint64_t dropped() const { return dropped_; }
+};
+
+// running latency figures of one stage, updated by that stage and read from
+// any thread
+class latency_stats {
+  std::atomic<uint64_t> count_;
+  std::atomic<int64_t> total_us;
+  std::atomic<int64_t> max_us;
+  std::atomic<int64_t> last_us;
+
+ public:
+  latency_stats() : count_(0), total_us(0), max_us(0), last_us(0) {}
+
+  void add(std::chrono::steady_clock::duration d);
+  void reset();
+
+  uint64_t count() const { return count_; }
+  std::chrono::microseconds last() const { return std::chrono::microseconds(last_us); }
+  std::chrono::microseconds max() const { return std::chrono::microseconds(max_us); }
+  std::chrono::microseconds mean() const;
+};
+
+// per stage latency of the live view: reading a frame from the socket,
+// waiting for and decoding it, waiting for and displaying the decoded image,
+// and from the end of the receive until the image was shown
+struct live_view_latency {
+  latency_stats receive;
+  latency_stats decode;
+  latency_stats display;
+  latency_stats total;
+
+  void reset();
+};
+
+void print(live_view_latency const& latency);
+
+// Every live view frame starts with a header, followed by the JPEG:
+// uint32_t  0
+// uint32_t  frame number, increments by one for each frame the camera sends
+// 6 bytes   0
+const size_t live_view_header_size = 14;
+
+struct live_view_header {
+  uint32_t frame_number = 0;
+};
+
+// false if data is too short to hold a header and an image
+bool parse_live_view_header(uint8_t const* data, size_t size, live_view_header& header);
+
+// reads the image size from the frame header (SOF marker) of a JPEG
+// without decoding it, false if there is none
+bool jpeg_dimensions(uint8_t const* data, size_t size, int& width, int& height);
+
+struct live_view_statistics {
+  uint64_t frames = 0;
+  uint64_t bytes = 0;
+  uint64_t missed = 0;        // gaps in the frame numbers
+  uint64_t out_of_order = 0;  // frame numbers that did not increase
+  uint32_t last_frame_number = 0;  // the highest so far
+  double fps = 0;               // over the last second
+  double bytes_per_second = 0;  // over the last second
+  double interval_ms = 0;       // smoothed time between frames
+  double jitter_ms = 0;         // smoothed deviation from interval_ms
+};
+
+void print(live_view_statistics const& stats);
+
+// Statistics of the frames arriving on the stream socket, updated by the
+// receiver and read from any thread. Missed frame numbers with a steady fps
+// on our side point at the camera or the Wi-Fi link rather than at us.
+class live_view_monitor {
+  typedef std::chrono::steady_clock steady;
+
+  mutable std::mutex mutex;  // guards the members below
+  live_view_statistics stats;
+  steady::time_point last_arrival;
+  steady::time_point window_start;
+  uint64_t window_frames = 0;
+  uint64_t window_bytes = 0;
+
+ public:
+  // received is the monotonic time the frame was read from the socket
+  void add(live_view_header const& header, size_t bytes, steady::time_point received);
+  void reset();
+  live_view_statistics statistics() const;
+};
+
+// Receive stage: receives frames into slabs of pool and publishes each to
+// frames, replacing one the next stage did not take yet, until running is
+// cleared; then closes frames. Frames without a valid header are skipped.
+// Returns the number of frames received.
+uint64_t receive_frames(native_socket sockfd, frame_pool& pool, latest_buffer<frame>& frames,
+                        std::atomic<bool> const& running, latency_stats* latency = nullptr,
+                        live_view_monitor* monitor = nullptr);
+
+// Receives frames into slabs of pool and pushes them to queue until running
+// is cleared. If no slab is free the oldest queued frame is dropped; a frame
+// that does not fit into a slab or has no valid header is skipped. Returns
+// the number of frames received.
+uint64_t receive_frames(native_socket sockfd, frame_pool& pool, frame_queue& queue,
+                        std::atomic<bool> const& running, live_view_monitor* monitor = nullptr);
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_LIVE_VIEW_HPP
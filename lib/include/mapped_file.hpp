@@ -0,0 +1,43 @@
+#ifndef FUJI_CAM_WIFI_TOOL_MAPPED_FILE_HPP
+#define FUJI_CAM_WIFI_TOOL_MAPPED_FILE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace fcwt {
+
+// A file mapped into memory as a whole, used for the on-disk indices so that
+// readers can use the data in place without parsing or copying it.
+class mapped_file {
+  int fd = -1;
+  uint8_t* bytes = nullptr;
+  size_t sizeBytes = 0;
+  bool writable = false;
+
+ public:
+  mapped_file() = default;
+  ~mapped_file();
+  mapped_file(mapped_file const&) = delete;
+  mapped_file& operator=(mapped_file const&) = delete;
+
+  // create: create the file if it does not exist (implies writable)
+  bool open(char const* path, bool writable, bool create = false);
+  void close();
+
+  // grows or shrinks the file and remaps it, invalidates data()
+  bool resize(size_t size);
+  bool sync();
+
+  bool is_open() const { return fd >= 0; }
+  uint8_t* data() { return bytes; }
+  uint8_t const* data() const { return bytes; }
+  size_t size() const { return sizeBytes; }
+
+ private:
+  bool map();
+  void unmap();
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_MAPPED_FILE_HPP
@@ -2,6 +2,9 @@
 #define FUJI_CAM_WIFI_TOOL_MESSAGE_HPP
 
 #include <array>
+#include <memory>
+#include <string>
+#include <vector>
 #include <stdint.h>
 #include <assert.h>
 #include "log.hpp"
@@ -41,6 +44,16 @@ enum class message_type : uint16_t {
 char const* to_string(message_type type);
 bool is_success_response(uint32_t id, void const* buffer, size_t size);
 
+// first two bytes of every message, messages sent by the camera are either
+// data (e.g. image info, thumbnails) or the final response to a request
+enum message_phase : uint16_t {
+  message_phase_request = 1,
+  message_phase_data = 2,
+  message_phase_response = 3
+};
+
+const size_t message_header_bytes = 8;  // phase, type, id
+
 struct message_header {
   uint16_t index =
       1;  // all but terminate (0) and two_part_message (2) have 1 here
@@ -70,6 +83,45 @@ uint32_t generate_message_id();
 bool fuji_message(native_socket const sockfd, uint32_t const id, void const* message,
                   size_t size);
 
+// receives the data phase of a reply (without its header) as it arrives
+class data_sink {
+ public:
+  virtual ~data_sink() {}
+  virtual void write(uint8_t const* data, size_t size) = 0;
+  // called once the reply is complete
+  virtual void finish(bool /*success*/) {}
+};
+
+// writes to path, the file is only created once data arrives and removed if
+// the transfer fails
+std::shared_ptr<data_sink> file_sink(std::string const& path);
+
+// counts the bytes passed on to sink (which may be null)
+class counting_sink : public data_sink {
+  std::shared_ptr<data_sink> const sink;
+
+ public:
+  explicit counting_sink(std::shared_ptr<data_sink> sink) : sink(std::move(sink)) {}
+  size_t bytes = 0;
+
+  void write(uint8_t const* data, size_t size) override {
+    bytes += size;
+    if (sink) sink->write(data, size);
+  }
+
+  void finish(bool success) override {
+    if (sink) sink->finish(success);
+  }
+};
+
+// receives the reply to request id: an optional data phase, which is stored
+// without its header in data, followed by the response
+bool fuji_receive_response(native_socket const sockfd, uint32_t const id,
+                           std::vector<uint8_t>* data);
+// as above but the data phase is passed to sink in chunks
+bool fuji_receive_response(native_socket const sockfd, uint32_t const id,
+                           data_sink& sink);
+
 template <size_t N>
 bool fuji_message(native_socket const sockfd, const static_message<N>& msg) {
   std::string log_msg = string_format("send: %s(%d) ", to_string(msg.type), static_cast<int>(msg.type));
@@ -106,6 +158,14 @@ size_t fuji_receive_log(native_socket sockfd, uint8_t(&data)[N]) {
   return size;
 }
 
+inline size_t fuji_receive_log(native_socket sockfd, std::vector<uint8_t>& data) {
+  size_t size = fuji_receive(sockfd, data);
+
+  std::string log_msg = string_format("receive %zu bytes ", size);
+  log(LOG_DEBUG, log_msg.append(hex_format(data.data(), size)));
+  return size;
+}
+
 // query the current camera state
 // app is polling this constantly, probably to update UI
 struct status_request_message : static_message<4> {
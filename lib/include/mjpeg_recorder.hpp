@@ -0,0 +1,138 @@
+#ifndef FUJI_CAM_WIFI_TOOL_MJPEG_RECORDER_HPP
+#define FUJI_CAM_WIFI_TOOL_MJPEG_RECORDER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_pool.hpp"
+#include "mapped_file.hpp"
+
+namespace fcwt {
+
+const uint32_t mjpeg_segment_version = 1;
+
+// Segment file: header, one record per frame (record header followed by the
+// JPEG), then the frame table. The table is appended and the header
+// rewritten when the segment is finished; until then entries_offset is 0 and
+// readers rebuild the table from the records.
+struct mjpeg_segment_header {
+  char magic[8];  // "FCWTREC\0"
+  uint32_t version;
+  uint32_t entry_bytes;
+  uint64_t entries_offset;
+  uint64_t count;
+  uint32_t segment;  // number of the segment within the recording
+  uint32_t reserved;
+};
+
+struct mjpeg_record_header {
+  uint32_t size;  // of the JPEG that follows, 0 ends the records
+  uint32_t frame_number;
+  int64_t timestamp_us;
+};
+
+struct mjpeg_frame_entry {
+  uint64_t offset;       // of the JPEG, from the start of the segment file
+  int64_t timestamp_us;  // received, from the first frame of the recording
+  uint32_t size;
+  uint32_t frame_number;
+};
+
+static_assert(sizeof(mjpeg_segment_header) == 40, "mjpeg segment layout");
+static_assert(sizeof(mjpeg_record_header) == 16, "mjpeg segment layout");
+static_assert(sizeof(mjpeg_frame_entry) == 24, "mjpeg segment layout");
+
+enum class sync_policy {
+  never,     // leave it to the OS
+  segment,   // when a segment is finished
+  interval,  // at most every sync_interval, and when a segment is finished
+  frame,     // after every frame
+};
+
+struct mjpeg_recorder_options {
+  // segments are written to <path_prefix>_0000.fcwtrec, _0001 and so on
+  std::string path_prefix = "out/live_view";
+  // preallocated for each segment, a new one is started when it is full
+  uint64_t segment_bytes = 256 * 1024 * 1024;
+  // frames waiting for the disk, the oldest is dropped when it falls behind
+  size_t queue_frames = 8;
+  sync_policy sync = sync_policy::segment;
+  std::chrono::milliseconds sync_interval = std::chrono::milliseconds(1000);
+};
+
+// Appends live view frames to preallocated segment files on its own thread.
+// Frames are pushed to input(), e.g. by receive_frames; the pool they come
+// from needs queue_frames + 2 slabs. A recorder records once: after stop()
+// it can't be started again.
+class mjpeg_recorder {
+  typedef std::chrono::steady_clock steady;
+
+  mjpeg_recorder_options const options;
+  frame_queue queue;
+  std::thread writer;
+
+  // used by the writer thread only
+  int fd = -1;
+  uint32_t segment = 0;
+  uint64_t offset = 0;
+  std::vector<mjpeg_frame_entry> entries;
+  steady::time_point first_frame;
+  steady::time_point last_sync;
+  bool failed = false;
+
+  std::atomic<uint64_t> written_;
+  std::atomic<uint64_t> bytes_;
+  std::atomic<uint32_t> segments_;
+
+ public:
+  explicit mjpeg_recorder(mjpeg_recorder_options const& options = mjpeg_recorder_options());
+  ~mjpeg_recorder();  // stops
+  mjpeg_recorder(mjpeg_recorder const&) = delete;
+  mjpeg_recorder& operator=(mjpeg_recorder const&) = delete;
+
+  // opens the first segment and starts the writer thread
+  bool start();
+  frame_queue& input() { return queue; }
+  // writes the queued frames and finishes the segment
+  void stop();
+
+  uint64_t written() const { return written_; }
+  uint64_t bytes() const { return bytes_; }  // JPEG data only
+  uint32_t segments() const { return segments_; }
+  uint64_t dropped() { return queue.dropped(); }
+
+ private:
+  void run();
+  bool append(frame const& f);
+  bool open_segment();
+  void finish_segment();
+};
+
+// read-only view of a segment file, memory mapped
+class mjpeg_segment {
+  mapped_file file;
+  std::vector<mjpeg_frame_entry> scanned;  // of a segment never finished
+  mjpeg_frame_entry const* entries = nullptr;
+  size_t count = 0;
+  uint32_t segment_ = 0;
+
+ public:
+  bool open(char const* path);
+
+  size_t size() const { return count; }
+  uint32_t segment() const { return segment_; }
+  mjpeg_frame_entry const& operator[](size_t i) const { return entries[i]; }
+  uint8_t const* image(size_t i) const { return file.data() + entries[i].offset; }
+  // the last frame received at or before timestamp (from the start of the
+  // recording), the first frame if all are later; size() if it is empty
+  size_t seek(std::chrono::microseconds timestamp) const;
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_MJPEG_RECORDER_HPP
@@ -0,0 +1,79 @@
+#ifndef FUJI_CAM_WIFI_TOOL_MJPEG_SERVER_HPP
+#define FUJI_CAM_WIFI_TOOL_MJPEG_SERVER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "comm.hpp"
+#include "frame_pool.hpp"
+
+namespace fcwt {
+
+struct mjpeg_server_options {
+  uint16_t port = 8080;
+  char const* address = "127.0.0.1";  // local clients only by default
+  // further connections are turned away; every client can hold on to a
+  // frame, so the pool needs max_clients more slabs than the receiver
+  size_t max_clients = 8;
+};
+
+// Serves the live view as multipart/x-mixed-replace MJPEG over HTTP to any
+// number of clients from one thread, so the one stream socket of the camera
+// can feed several viewers. Clients share the published frame: its JPEG is
+// written to every socket straight from the slab with scatter-gather I/O. A
+// client that can't keep up finishes the frame it started and then jumps to
+// the newest one, it never holds back the others.
+class mjpeg_server {
+  struct client;
+
+  mjpeg_server_options options;
+  native_socket listener = -1;
+  native_socket wake_read = -1;  // publish() wakes the server thread
+  native_socket wake_write = -1;
+  std::vector<std::unique_ptr<client>> clients;  // server thread only
+  std::thread thread;
+  std::atomic<bool> stopping;
+
+  std::mutex latest_mutex;  // guards the members below
+  frame latest;
+  uint64_t latest_number = 0;
+
+  std::atomic<size_t> connected;
+  std::atomic<uint64_t> sent;
+  std::atomic<uint64_t> skipped;
+
+ public:
+  mjpeg_server();
+  ~mjpeg_server();  // stops
+  mjpeg_server(mjpeg_server const&) = delete;
+  mjpeg_server& operator=(mjpeg_server const&) = delete;
+
+  // listens and starts the server thread
+  bool start(mjpeg_server_options const& options = mjpeg_server_options());
+  // disconnects all clients and releases their frames
+  void stop();
+
+  // a live view frame (with its header), from any thread
+  void publish(frame const& f);
+
+  size_t clients_connected() const { return connected; }
+  uint64_t frames_sent() const { return sent; }        // to all clients
+  uint64_t frames_skipped() const { return skipped; }  // by slow clients
+
+ private:
+  void run();
+  void accept_clients();
+  // false once the client has to be disconnected
+  bool read_request(client& c);
+  bool write_pending(client& c);
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_MJPEG_SERVER_HPP
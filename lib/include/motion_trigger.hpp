@@ -0,0 +1,147 @@
+#ifndef FUJI_CAM_WIFI_TOOL_MOTION_TRIGGER_HPP
+#define FUJI_CAM_WIFI_TOOL_MOTION_TRIGGER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "color_convert.hpp"
+#include "comm.hpp"
+#include "message.hpp"
+
+namespace fcwt {
+
+class camera_session;
+class camera_io;
+
+// Adds |a - b| of the pixels of a row to difference and counts those above
+// threshold in changed; for as many pixels as the vector code covers,
+// returns where the scalar code continues.
+typedef int (*difference_row_function)(uint8_t const* a, uint8_t const* b, int width, uint8_t threshold,
+                                       uint64_t& difference, uint64_t& changed);
+
+struct motion_kernels {
+  simd_level level;
+  difference_row_function difference_row;
+};
+
+// same selection as the color kernels
+motion_kernels const& best_motion_kernels();
+motion_kernels const* motion_kernels_for(simd_level level);
+
+// area watched for motion, fractions of the image width and height
+struct motion_region {
+  float x = 0;
+  float y = 0;
+  float width = 1;
+  float height = 1;
+};
+
+struct motion_options {
+  motion_region region;
+  // luma change of a pixel that counts as motion, above sensor noise and
+  // JPEG artifacts
+  uint8_t pixel_threshold = 24;
+  // share of the region's pixels that have to change
+  float trigger_share = 0.02f;
+  // consecutive frames over trigger_share, more ignore single frame flicker
+  unsigned frames = 1;
+};
+
+struct motion_sample {
+  float changed = 0;          // share of the region's pixels
+  float mean_difference = 0;  // of the region, 0 to 255
+};
+
+// Frame differencing on the luma: the region of every frame is compared with
+// that of the previous one. Meant for live view images decoded at a reduced
+// scale (jpeg_scale::quarter is 160x120), which is both cheaper and less
+// noisy. One detector is reused for every frame of a stream, it only keeps
+// the region of the last frame.
+class motion_detector {
+  motion_kernels const* kernels;
+  motion_options const options;
+  std::vector<uint8_t> previous;
+  int image_width = 0;
+  int image_height = 0;
+  unsigned frames_over = 0;
+
+ public:
+  explicit motion_detector(motion_options const& options,
+                           motion_kernels const& kernels = best_motion_kernels());
+
+  // true once motion crossed the threshold for options.frames frames in a
+  // row; the first frame, and one of another size, only becomes the
+  // reference
+  bool process(uint8_t const* luma, size_t luma_stride, int width, int height,
+               motion_sample* sample = nullptr);
+  void reset();
+};
+
+// microseconds
+struct motion_shot_report {
+  bool acked = false;
+  std::chrono::microseconds detect = std::chrono::microseconds(0);  // frame received until detected
+  std::chrono::microseconds send = std::chrono::microseconds(0);    // detected until sent
+  std::chrono::microseconds ack = std::chrono::microseconds(0);     // sent until acked
+  std::chrono::microseconds trigger_to_ack = std::chrono::microseconds(0);  // detected until acked
+  size_t thumbnail_bytes = 0;
+};
+
+void print(motion_shot_report const& report);
+
+// Releases the shutter of a session as soon as motion was detected. Arming
+// parks the session's strand in a shutter priority task with the release
+// message prepared and TCP_NODELAY set, so fire() sends it on the control
+// socket right from the detecting thread: no queue, lock wait or thread
+// wakeup before the send. The parked task then reads the ack, the capture
+// events and the thumbnail. The park is bounded: every park_slice it yields
+// the strand if commands were queued meanwhile and parks again behind them,
+// a detection in between waits for those commands.
+class motion_shutter {
+  enum class state { idle, arming, armed, yielding, firing, fired, disarming };
+
+  camera_session& session;
+  std::mutex mutex;  // guards the members below
+  std::condition_variable cv;
+  state state_ = state::idle;
+  native_socket control = 0;
+  static_message<8> release;
+  std::string thumbnail;
+  std::chrono::steady_clock::time_point received;
+  std::chrono::steady_clock::time_point detected;
+  std::chrono::steady_clock::time_point sent;
+  motion_shot_report report;
+  std::future<void> parked;  // the task holding the strand, or the last one
+
+  void park(camera_io& io);
+
+ public:
+  static const std::chrono::milliseconds park_slice;
+
+  explicit motion_shutter(camera_session& session);
+  ~motion_shutter();  // disarms
+  motion_shutter(motion_shutter const&) = delete;
+  motion_shutter& operator=(motion_shutter const&) = delete;
+
+  // blocks until the strand is parked (after the commands queued before);
+  // the thumbnail of the shot goes to the file, empty to discard it
+  bool arm(std::string const& thumbnail);
+  void disarm();
+  bool armed();
+
+  // sends the release if armed; received is when the frame showing the
+  // motion arrived, detected when the analysis finished
+  bool fire(std::chrono::steady_clock::time_point received, std::chrono::steady_clock::time_point detected);
+  // blocks until the camera acked and the capture completed, after fire()
+  motion_shot_report wait();
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_MOTION_TRIGGER_HPP
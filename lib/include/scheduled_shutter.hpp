@@ -0,0 +1,114 @@
+#ifndef FUJI_CAM_WIFI_TOOL_SCHEDULED_SHUTTER_HPP
+#define FUJI_CAM_WIFI_TOOL_SCHEDULED_SHUTTER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+#include "comm.hpp"
+
+namespace fcwt {
+
+class camera_session;
+class control_channel;
+class shutter_pipeline;
+
+// rolling window of request/ack round trips
+class rtt_estimator {
+ public:
+  typedef std::chrono::steady_clock::duration duration;
+  static const size_t window = 16;
+
+ private:
+  std::array<duration, window> samples;
+  size_t count = 0;
+  size_t next = 0;
+
+ public:
+  void add(duration rtt);
+  void clear() { count = next = 0; }
+  size_t size() const { return count; }
+
+  duration min() const;
+  duration max() const;
+  duration median() const;
+  // estimated time from sending a request until the camera acts on it
+  duration one_way() const { return median() / 2; }
+};
+
+struct scheduled_shutter_options {
+  std::chrono::system_clock::time_point at;  // CLOCK_REALTIME target
+  // round trips measured right before the shot, the camera is probed with
+  // the status request, which only reads settings
+  unsigned probes = 8;
+  // probing continues at this interval while waiting for the target
+  std::chrono::microseconds probe_interval = std::chrono::milliseconds(250);
+  // nothing else is sent to the camera this long before the shot
+  std::chrono::microseconds guard = std::chrono::milliseconds(50);
+  std::string thumbnail;  // empty: the thumbnail is discarded
+};
+
+// microseconds, negative is early
+struct scheduled_shutter_report {
+  bool success = false;
+  size_t rtt_samples = 0;
+  std::chrono::microseconds rtt_min = std::chrono::microseconds(0);
+  std::chrono::microseconds rtt_median = std::chrono::microseconds(0);
+  std::chrono::microseconds rtt_max = std::chrono::microseconds(0);
+  std::chrono::microseconds lead = std::chrono::microseconds(0);  // sent this early
+  std::chrono::microseconds send_error = std::chrono::microseconds(0);  // vs the planned send
+  std::chrono::microseconds shutter_rtt = std::chrono::microseconds(0);
+  // estimated arrival (send + shutter_rtt / 2) minus the target
+  std::chrono::microseconds trigger_error = std::chrono::microseconds(0);
+  // half the spread of the measured round trips
+  std::chrono::microseconds uncertainty = std::chrono::microseconds(0);
+};
+
+void print(scheduled_shutter_report const& report);
+
+// Releases the shutter so that it reaches the camera at a wall clock
+// instant. The one way latency is estimated from the round trips of status
+// requests and of previous shutters. Shortly before the shot the camera is
+// used exclusively (io_lock held, or the channel drained) and the clock is
+// polled in a busy loop, so the release is not queued behind other requests.
+class scheduled_shutter {
+  native_socket const sockfd;
+  native_socket const sockfd2;
+  std::timed_mutex* const io_lock;
+  control_channel* const channel;
+  shutter_pipeline* const pipeline;
+  camera_session* const session;
+  rtt_estimator rtt;
+  std::atomic<bool> cancelled;
+
+ public:
+  // io_lock, if given, is held while talking to the camera
+  scheduled_shutter(native_socket sockfd, native_socket sockfd2,
+                    std::timed_mutex* io_lock = nullptr);
+  // other users of the channel must not send during the guard time
+  scheduled_shutter(control_channel& channel, shutter_pipeline& pipeline);
+  // probes and the shot are session tasks, the shot holds the strand for the
+  // guard time
+  explicit scheduled_shutter(camera_session& session);
+
+  // measures one status request round trip
+  bool probe();
+  rtt_estimator const& estimator() const { return rtt; }
+
+  // blocks until the shot was taken (or cancel() was called)
+  bool fire_at(scheduled_shutter_options const& options, scheduled_shutter_report* report);
+  void cancel();
+
+ private:
+  bool probe(native_socket control);
+  bool release(native_socket control, std::chrono::steady_clock::time_point& sent,
+               std::chrono::steady_clock::time_point& acked);
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_SCHEDULED_SHUTTER_HPP
@@ -0,0 +1,140 @@
+#ifndef FUJI_CAM_WIFI_TOOL_SHM_EXPORT_HPP
+#define FUJI_CAM_WIFI_TOOL_SHM_EXPORT_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include "frame_pool.hpp"
+
+namespace fcwt {
+
+// Layout of the shared memory object: a shm_ring_header, then slot_count
+// slots slot_stride bytes apart, each a shm_slot_header followed by up to
+// slot_bytes of JPEG. Only the exporter writes; readers map it read-only.
+const char shm_ring_magic[8] = "FCWTSHM";
+const uint32_t shm_ring_version = 1;
+
+struct alignas(64) shm_ring_header {
+  char magic[8];  // written last, readers ignore the object until then
+  uint32_t version;
+  uint32_t slot_count;
+  uint64_t slot_bytes;
+  uint64_t slot_stride;
+  std::atomic<uint64_t> published;  // frames written so far
+  std::atomic<uint32_t> wake;       // futex word, changes with every frame
+  std::atomic<uint32_t> closed;     // the exporter is gone
+};
+
+// Seqlock per slot: sequence is 2 * (index + 1) while the slot holds frame
+// index, odd while the exporter rewrites it. A reader that sees the same
+// even value before and after reading got an intact frame.
+struct alignas(64) shm_slot_header {
+  std::atomic<uint64_t> sequence;
+  std::atomic<int64_t> received_ns;  // steady clock, comparable across processes
+  std::atomic<uint32_t> size;
+  std::atomic<uint32_t> frame_number;  // from the live view header
+};
+
+struct shm_export_options {
+  std::string name = "/fcwt_live_view";
+  // frames a reader can fall behind before they are overwritten
+  size_t slots = 8;
+  size_t slot_bytes = 1024 * 1024;  // larger frames are not exported
+};
+
+// Exports the live view into a POSIX shared memory ring, so processes other
+// than the one holding the camera connection get every frame. Publishing
+// copies the JPEG into the next slot once; readers use it in place and
+// never block the exporter, a slow reader loses the frames overwritten
+// under it.
+class shm_exporter {
+  shm_export_options options;
+  int fd = -1;
+  uint8_t* memory = nullptr;
+  size_t memory_bytes = 0;
+  uint64_t published_ = 0;
+  uint64_t oversized_ = 0;
+
+ public:
+  shm_exporter() {}
+  ~shm_exporter();  // closes
+  shm_exporter(shm_exporter const&) = delete;
+  shm_exporter& operator=(shm_exporter const&) = delete;
+
+  // replaces a leftover object of the same name
+  bool open(shm_export_options const& options = shm_export_options());
+  // tells readers and removes the name, attached readers keep their mapping
+  void close();
+  bool is_open() const { return memory != nullptr; }
+
+  // a live view frame (with its header), from one thread
+  void publish(frame const& f);
+
+  uint64_t published() const { return published_; }
+  uint64_t oversized() const { return oversized_; }
+};
+
+// A frame in the ring, valid until the exporter reuses its slot.
+struct shm_frame_view {
+  uint64_t index = 0;  // position in the export, counting from 0
+  uint8_t const* jpeg = nullptr;
+  size_t size = 0;
+  uint32_t frame_number = 0;
+  std::chrono::steady_clock::time_point received;
+  uint64_t sequence = 0;
+};
+
+// Reader side of an shm_exporter, for other processes. It needs nothing
+// from the camera session:
+//
+//   shm_reader reader;
+//   reader.attach("/fcwt_live_view");
+//   uint64_t next = reader.published();
+//   while (reader.wait(next, std::chrono::milliseconds(1000))) {
+//     shm_frame_view view;
+//     if (reader.acquire(next++, view)) {
+//       ... use view.jpeg ...
+//       if (!reader.valid(view)) ... overwritten meanwhile, discard results
+//     }
+//   }
+class shm_reader {
+  int fd = -1;
+  uint8_t const* memory = nullptr;
+  size_t memory_bytes = 0;
+
+  shm_ring_header const* header() const {
+    return reinterpret_cast<shm_ring_header const*>(memory);
+  }
+  shm_slot_header const* slot(uint64_t index) const;
+
+ public:
+  shm_reader() {}
+  ~shm_reader();  // detaches
+  shm_reader(shm_reader const&) = delete;
+  shm_reader& operator=(shm_reader const&) = delete;
+
+  // false if there is no export of that name (yet)
+  bool attach(char const* name);
+  void detach();
+  bool is_attached() const { return memory != nullptr; }
+
+  uint64_t published() const;  // index of the next frame
+  // the exporter closed, attach again to follow a new one
+  bool closed() const;
+  // waits until frame index is published; false on timeout or when closed
+  bool wait(uint64_t index, std::chrono::milliseconds timeout) const;
+
+  // false if the frame is not published yet or already overwritten
+  bool acquire(uint64_t index, shm_frame_view& view) const;
+  // the newest frame, false if there is none
+  bool acquire_latest(shm_frame_view& view) const;
+  // whether view was intact all along, to be checked after using it
+  bool valid(shm_frame_view const& view) const;
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_SHM_EXPORT_HPP
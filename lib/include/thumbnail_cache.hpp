@@ -0,0 +1,91 @@
+#ifndef FUJI_CAM_WIFI_TOOL_THUMBNAIL_CACHE_HPP
+#define FUJI_CAM_WIFI_TOOL_THUMBNAIL_CACHE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mapped_file.hpp"
+
+namespace fcwt {
+
+// images are identified by the camera, their index on the card and the file
+// size from image_info_by_index, a different size means a different image
+struct thumbnail_key {
+  uint64_t camera = 0;
+  uint32_t index = 0;
+  uint32_t size = 0;
+};
+
+bool operator==(thumbnail_key const& a, thumbnail_key const& b);
+
+// stable 64 bit key for a camera name/identity string
+uint64_t camera_key(std::string const& camera);
+
+struct thumbnail_key_hash {
+  size_t operator()(thumbnail_key const& key) const;
+};
+
+// Persistent thumbnail cache: thumbnails are appended to one pack file, the
+// index file is memory mapped and records where each thumbnail lives.
+// Once the pack grows over the budget the least recently used thumbnails are
+// dropped and the pack is rewritten.
+class thumbnail_cache {
+ public:
+  struct record {
+    uint64_t camera;
+    uint32_t index;
+    uint32_t size;
+    uint64_t offset;   // in the pack file
+    uint32_t length;
+    uint32_t last_used;  // use counter value of the last hit
+  };
+
+  struct index_header {
+    char magic[8];  // "FCWTTHC\0"
+    uint32_t version;
+    uint32_t use_counter;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t pack_bytes;
+  };
+
+ private:
+  std::string directory;
+  uint64_t budget = 0;
+  mapped_file index_file;
+  FILE* pack = nullptr;
+  std::unordered_map<thumbnail_key, size_t, thumbnail_key_hash> slots;
+
+ public:
+  thumbnail_cache() = default;
+  ~thumbnail_cache();
+  thumbnail_cache(thumbnail_cache const&) = delete;
+  thumbnail_cache& operator=(thumbnail_cache const&) = delete;
+
+  // creates thumbnails.pack and thumbnails.idx in the (existing) directory
+  bool open(char const* directory, uint64_t budget_bytes);
+  void close();
+  bool is_open() const { return pack != nullptr; }
+
+  bool find(thumbnail_key const& key, std::vector<uint8_t>& jpeg);
+  bool insert(thumbnail_key const& key, uint8_t const* jpeg, size_t size);
+
+  size_t count() const;
+  uint64_t pack_bytes() const;
+
+ private:
+  index_header& header();
+  record* records();
+  bool init_index();
+  bool reserve(uint64_t capacity);
+  bool evict();
+  std::string path(char const* name) const;
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_THUMBNAIL_CACHE_HPP
@@ -0,0 +1,53 @@
+#ifndef FUJI_CAM_WIFI_TOOL_V4L2_OUTPUT_HPP
+#define FUJI_CAM_WIFI_TOOL_V4L2_OUTPUT_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+namespace fcwt {
+
+enum class v4l2_pixel_format {
+  mjpeg,  // the camera's JPEGs as they are
+  bgr24,
+  yuyv,
+  nv12,
+};
+
+// bytes of one frame, 0 for MJPEG
+size_t frame_size(v4l2_pixel_format format, int width, int height);
+
+// Video output device (v4l2loopback) for other applications to use the live
+// view as a webcam. Linux only.
+class v4l2_output {
+  int fd = -1;
+  v4l2_pixel_format format_ = v4l2_pixel_format::mjpeg;
+  int width_ = 0;
+  int height_ = 0;
+  std::vector<uint8_t> converted;  // reused for every frame
+
+ public:
+  v4l2_output() = default;
+  ~v4l2_output();
+  v4l2_output(v4l2_output const&) = delete;
+  v4l2_output& operator=(v4l2_output const&) = delete;
+
+  // frame_bytes bounds the compressed size of MJPEG frames, the raw
+  // formats have a fixed size
+  bool open(char const* device, v4l2_pixel_format format, int width, int height,
+            size_t frame_bytes = 0);
+  void close();
+  // one whole frame, the device is closed if it fails
+  bool write(void const* data, size_t size);
+  // a BGR24 image of the device's size, converted to its raw format
+  bool write_bgr(uint8_t const* bgr, size_t stride);
+
+  bool is_open() const { return fd >= 0; }
+  v4l2_pixel_format format() const { return format_; }
+  int width() const { return width_; }
+  int height() const { return height_; }
+};
+
+}  // namespace fcwt
+
+#endif  // FUJI_CAM_WIFI_TOOL_V4L2_OUTPUT_HPP
@@ -0,0 +1,111 @@
+#include "async_commands.hpp"
+
+#include "log.hpp"
+
+namespace fcwt {
+
+namespace {
+
+// the future gets convert(reply), evaluated on the channel's reader thread
+template <typename T, typename F>
+std::future<T> submit(control_channel& channel, uint32_t const id, void const* part1,
+                      size_t const size1, void const* part2, size_t const size2, F convert) {
+  auto const promise = std::make_shared<std::promise<T>>();
+  std::future<T> result = promise->get_future();
+  channel.submit(id, part1, size1, part2, size2, nullptr,
+                 [promise, convert](response& r) { promise->set_value(convert(r)); });
+  return result;
+}
+
+template <size_t N>
+std::future<bool> request_ok(control_channel& channel, static_message<N> const& msg) {
+  control_channel::log_send(msg.type, &msg, msg.size());
+  return submit<bool>(channel, msg.id, &msg, msg.size(), nullptr, 0,
+                      [](response const& r) { return r.success; });
+}
+
+// passes the thumbnail on and completes the future once it is done
+class completion_sink : public data_sink {
+  std::shared_ptr<data_sink> const sink;
+  std::promise<bool> done;
+
+ public:
+  explicit completion_sink(std::shared_ptr<data_sink> sink) : sink(std::move(sink)) {}
+  std::future<bool> get_future() { return done.get_future(); }
+
+  void write(uint8_t const* data, size_t size) override {
+    if (sink) sink->write(data, size);
+  }
+
+  void finish(bool success) override {
+    if (sink) sink->finish(success);
+    done.set_value(success);
+  }
+};
+
+}  // namespace
+
+std::future<bool> shutter_async(shutter_pipeline& pipeline, std::shared_ptr<data_sink> thumbnail) {
+  log(LOG_INFO, "shutter");
+  auto const sink = std::make_shared<completion_sink>(std::move(thumbnail));
+  std::future<bool> result = sink->get_future();
+  pipeline.release_async(sink);
+  return result;
+}
+
+std::future<uint32_t> start_record_async(control_channel& channel) {
+  log(LOG_INFO, "start_record");
+  auto const req = make_static_message(message_type::start_record, 0x00, 0x00, 0x00, 0x00,
+                                       0x00, 0x00, 0x00, 0x00);
+  control_channel::log_send(req.type, &req, req.size());
+  uint32_t const id = req.id;
+  return submit<uint32_t>(channel, req.id, &req, req.size(), nullptr, 0,
+                          [id](response const& r) { return r.success ? id : 0u; });
+}
+
+std::future<bool> stop_record_async(control_channel& channel, uint32_t const start_id) {
+  log(LOG_INFO, "stop_record");
+  return request_ok(channel, make_static_message(message_type::stop_record, make_byte_array(start_id)));
+}
+
+std::future<bool> current_settings_async(control_channel& channel, current_properties& settings) {
+  auto const msg = generate<status_request_message>();
+  control_channel::log_send(msg.type, &msg, msg.size());
+  current_properties* const out = &settings;
+  return submit<bool>(channel, msg.id, &msg, msg.size(), nullptr, 0, [out](response const& r) {
+    return r.success && parse_current_settings(r.data.data(), r.data.size(), *out);
+  });
+}
+
+std::future<bool> update_setting_async(control_channel& channel, property_codes const code,
+                                       uint32_t const value) {
+  auto const msg_1 = make_static_message(message_type::two_part,
+                                         make_byte_array(static_cast<uint32_t>(code)));
+  auto const msg_2 = make_static_message_followup(msg_1, make_byte_array(value));
+  control_channel::log_send(msg_1.type, &msg_1, msg_1.size());
+  control_channel::log_send(msg_2.type, &msg_2, msg_2.size());
+  return submit<bool>(channel, msg_2.id, &msg_1, msg_1.size(), &msg_2, msg_2.size(),
+                      [](response const& r) { return r.success; });
+}
+
+std::future<bool> update_setting_async(control_channel& channel, auto_focus_point const point) {
+  return request_ok(channel, make_focus_point_message(point));
+}
+
+std::future<bool> update_setting_async(control_channel& channel, fnumber_update_direction const dir) {
+  return request_ok(channel, make_aperture_step_message(dir));
+}
+
+std::future<bool> update_setting_async(control_channel& channel, ss_update_direction const dir) {
+  return request_ok(channel, make_shutter_speed_step_message(dir));
+}
+
+std::future<bool> update_setting_async(control_channel& channel, exp_update_direction const dir) {
+  return request_ok(channel, make_exposure_step_message(dir));
+}
+
+std::future<bool> unlock_focus_async(control_channel& channel) {
+  return request_ok(channel, make_static_message(message_type::focus_unlock));
+}
+
+}  // namespace fcwt
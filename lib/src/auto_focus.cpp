@@ -0,0 +1,89 @@
+#include "auto_focus.hpp"
+
+#include <stdio.h>
+#include <algorithm>
+#include <thread>
+
+namespace fcwt {
+
+focus_grid_scorer::focus_grid_scorer(int const columns, int const rows, unsigned threads)
+    : columns(columns), rows(rows) {
+  if (threads == 0) threads = std::max(std::thread::hardware_concurrency(), 1u);
+  threads = std::min(threads, static_cast<unsigned>(rows));
+  for (unsigned i = 0; i < threads; ++i) peakers.emplace_back(new focus_peaker());
+  cells.columns = columns + 2;
+  cells.rows = rows + 2;
+  cells.scores.assign(static_cast<size_t>(cells.columns) * cells.rows, 0.0f);
+}
+
+void focus_grid_scorer::score(uint8_t const* const luma, size_t const luma_stride, int const width,
+                              int const height, sharpness_map& points) {
+  // the rows of points are spread evenly, the calling thread scores the
+  // first share; the margin cells are not scored at all
+  size_t const count = peakers.size();
+  auto const score_share = [&](size_t const i) {
+    int const first = 1 + static_cast<int>(i * rows / count);
+    int const last = 1 + static_cast<int>((i + 1) * rows / count);
+    peakers[i]->score(luma, luma_stride, width, height, first, last, cells);
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < count; ++i) workers.emplace_back(score_share, i);
+  score_share(0);
+  for (std::thread& worker : workers) worker.join();
+
+  points.columns = columns;
+  points.rows = rows;
+  points.scores.resize(static_cast<size_t>(columns) * rows);
+  for (int y = 0; y < rows; ++y)
+    std::copy_n(&cells.scores[(y + 1) * cells.columns + 1], columns, &points.scores[y * columns]);
+}
+
+auto_focus_point choose_focus_point(sharpness_map const& points, focus_rule const rule,
+                                    auto_focus_point reference, float const contrast) {
+  auto_focus_point chosen = 0;
+  if (points.scores.empty()) return chosen;
+  // no point set yet, the center is the reference
+  if (reference.x == 0 || reference.y == 0) {
+    reference.x = static_cast<uint8_t>((points.columns + 1) / 2);
+    reference.y = static_cast<uint8_t>((points.rows + 1) / 2);
+  }
+
+  float const highest = *std::max_element(points.scores.begin(), points.scores.end());
+  float const limit = rule == focus_rule::sharpest ? highest : highest * contrast;
+  int best_distance = -1;
+  for (int y = 0; y < points.rows; ++y) {
+    for (int x = 0; x < points.columns; ++x) {
+      if (points.score(x, y) < limit) continue;
+      int const dx = x + 1 - reference.x;
+      int const dy = y + 1 - reference.y;
+      int const distance = rule == focus_rule::sharpest ? 0 : dx * dx + dy * dy;
+      if (best_distance < 0 || distance < best_distance) {
+        best_distance = distance;
+        chosen.x = static_cast<uint8_t>(x + 1);
+        chosen.y = static_cast<uint8_t>(y + 1);
+      }
+    }
+  }
+  return chosen;
+}
+
+auto_focus_report confirm_focus_point(sharpness_map const& before, sharpness_map const& after,
+                                      auto_focus_point const point, focus_rule const rule,
+                                      float const contrast) {
+  auto_focus_report report;
+  report.point = point;
+  if (point.x < 1 || point.x > after.columns || point.y < 1 || point.y > after.rows) return report;
+
+  report.before = before.score(point.x - 1, point.y - 1);
+  report.after = after.score(point.x - 1, point.y - 1);
+  auto_focus_point const again = choose_focus_point(after, rule, point, contrast);
+  report.confirmed = again.x == point.x && again.y == point.y;
+  return report;
+}
+
+void print(auto_focus_report const& report) {
+  printf("auto focus point %s: sharpness %.1f before, %.1f after, %s\n", to_string(report.point).c_str(),
+         report.before, report.after, report.confirmed ? "confirmed" : "not confirmed");
+}
+
+}  // namespace fcwt
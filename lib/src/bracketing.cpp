@@ -0,0 +1,157 @@
+#include "bracketing.hpp"
+
+#include "async_commands.hpp"
+#include "commands.hpp"
+#include "control_channel.hpp"
+#include "log.hpp"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+namespace fcwt {
+
+namespace {
+
+typedef std::chrono::steady_clock steady;
+
+bool query_settings(control_channel& channel, current_properties& settings) {
+  return current_settings_async(channel, settings).get();
+}
+
+void queue_exposure_steps(control_channel& channel, int const steps,
+                          std::vector<std::future<bool>>& acks) {
+  exp_update_direction const dir = steps > 0 ? exp_increment : exp_decrement;
+  for (int i = 0; i < abs(steps); ++i)
+    acks.push_back(update_setting_async(channel, dir));
+}
+
+bool wait_acks(std::vector<std::future<bool>>& acks) {
+  bool success = true;
+  for (auto& ack : acks)
+    success = ack.get() && success;
+  acks.clear();
+  return success;
+}
+
+double exposure_ev(uint32_t value) {
+  return static_cast<double>(static_cast<int16_t>(value)) / 1000.0;
+}
+
+}  // namespace
+
+bracket_plan exposure_bracket(double const range_ev, double const step_ev) {
+  bracket_plan plan;
+  int const step = std::max(1, static_cast<int>(lround(fabs(step_ev) * exposure_steps_per_ev)));
+  int const range = static_cast<int>(lround(fabs(range_ev) * exposure_steps_per_ev));
+
+  for (int steps = -range / step * step; steps <= range; steps += step) {
+    bracket_shot shot;
+    shot.exposure_steps = steps;
+    plan.shots.push_back(shot);
+  }
+  return plan;
+}
+
+bracket_plan focus_sweep(std::vector<auto_focus_point> const& points) {
+  bracket_plan plan;
+  for (auto_focus_point const& point : points) {
+    bracket_shot shot;
+    shot.set_focus_point = true;
+    shot.focus_point = point;
+    plan.shots.push_back(shot);
+  }
+  return plan;
+}
+
+bracket_plan focus_grid_sweep(uint8_t const columns, uint8_t const rows) {
+  std::vector<auto_focus_point> points;
+  for (uint8_t y = 1; y <= rows; ++y) {
+    for (uint8_t x = 1; x <= columns; ++x) {
+      auto_focus_point point = 0;
+      point.x = x;
+      point.y = y;
+      points.push_back(point);
+    }
+  }
+  return focus_sweep(points);
+}
+
+bool run_bracket(control_channel& channel, shutter_pipeline& pipeline,
+                 bracket_plan const& plan, bracket_report* report) {
+  bracket_report local;
+  if (!report) report = &local;
+  *report = bracket_report();
+
+  steady::time_point const start = steady::now();
+
+  current_properties settings;
+  if (!query_settings(channel, settings)) {
+    log(LOG_ERROR, "run_bracket: failed to get camera settings");
+    return false;
+  }
+  report->exposure_before = settings.values[property_exposure_compensation];
+  auto_focus_point const focus_before = settings.values[property_focus_point];
+
+  std::vector<std::future<bool>> acks;
+  std::future<size_t> previous_capture;
+  int position = 0;
+  bool focus_changed = false;
+
+  for (size_t i = 0; i < plan.shots.size(); ++i) {
+    bracket_shot const& shot = plan.shots[i];
+
+    queue_exposure_steps(channel, shot.exposure_steps - position, acks);
+    position = shot.exposure_steps;
+    if (shot.set_focus_point) {
+      acks.push_back(update_setting_async(channel, shot.focus_point));
+      focus_changed = true;
+    }
+
+    // the next release has to wait until the previous capture is complete
+    if (previous_capture.valid()) previous_capture.get();
+    bool success = wait_acks(acks);
+    if (!success)
+      log(LOG_WARN, string_format("run_bracket: setting for shot %zu not acked", i));
+
+    std::shared_ptr<data_sink> sink;
+    if (!plan.thumbnail_pattern.empty())
+      sink = file_sink(string_format(plan.thumbnail_pattern.c_str(), static_cast<unsigned>(i)));
+    success = pipeline.release(sink, &previous_capture) && success;
+
+    ++report->shots;
+    if (!success) ++report->failed;
+  }
+
+  if (previous_capture.valid()) previous_capture.get();
+
+  bool restored = true;
+  if (plan.restore && (position != 0 || focus_changed)) {
+    queue_exposure_steps(channel, -position, acks);
+    if (focus_changed)
+      acks.push_back(update_setting_async(channel, focus_before));
+    restored = wait_acks(acks) && query_settings(channel, settings);
+    report->exposure_after = settings.values[property_exposure_compensation];
+    if (restored && report->exposure_after != report->exposure_before) {
+      log(LOG_WARN, string_format("run_bracket: exposure compensation %.1f instead of %.1f after restoring",
+                                  exposure_ev(report->exposure_after), exposure_ev(report->exposure_before)));
+      restored = false;
+    }
+  } else {
+    report->exposure_after = report->exposure_before;
+  }
+
+  report->duration = std::chrono::duration_cast<std::chrono::microseconds>(steady::now() - start);
+  return restored && report->failed == 0;
+}
+
+void print(bracket_report const& report) {
+  printf("bracket:\n");
+  printf("\tshots: %u (%u failed)\n", report.shots, report.failed);
+  printf("\tduration: %.1f ms\n", report.duration.count() / 1000.0);
+  printf("\texposure compensation: %.1f -> %.1f\n", exposure_ev(report.exposure_before),
+         exposure_ev(report.exposure_after));
+}
+
+}  // namespace fcwt
@@ -0,0 +1,387 @@
+#include "browse.hpp"
+
+#include "log.hpp"
+#include "message.hpp"
+#include "thumbnail_cache.hpp"
+
+#include <string.h>
+#include <algorithm>
+#include <deque>
+
+namespace fcwt {
+
+namespace {
+
+// ObjectInfo as returned by image_info_by_index, offsets into the data phase:
+//
+// 4 bytes   StorageID
+// 2 bytes   ObjectFormat
+// 2 bytes   ProtectionStatus
+// 4 bytes   ObjectCompressedSize
+// 2 bytes   ThumbFormat
+// 4 bytes   ThumbCompressedSize
+// 4 bytes   ThumbPixWidth
+// 4 bytes   ThumbPixHeight
+// 4 bytes   ImagePixWidth
+// 4 bytes   ImagePixHeight
+// 18 bytes  bit depth, parent, association, sequence number (unused)
+// string    Filename, e.g. "DSCF0591.JPG"
+// string    CaptureDate, e.g. "20160102T150136"
+// string    ModificationDate
+// string    Keywords, e.g. "Orientation:1"
+//
+// strings are a one byte count of UTF-16 code units (including the
+// terminating zero) followed by the UTF-16LE characters
+const size_t object_info_fixed_bytes = 52;
+
+template <typename T>
+T read_le(uint8_t const* data, size_t offset) {
+  T value;
+  memcpy(&value, data + offset, sizeof(value));
+  return value;
+}
+
+void append_utf8(std::string& out, uint32_t cp) {
+  if (cp < 0x80) {
+    out.push_back(static_cast<char>(cp));
+  } else if (cp < 0x800) {
+    out.push_back(static_cast<char>(0xc0 | (cp >> 6)));
+    out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+  } else if (cp < 0x10000) {
+    out.push_back(static_cast<char>(0xe0 | (cp >> 12)));
+    out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+    out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+  } else {
+    out.push_back(static_cast<char>(0xf0 | (cp >> 18)));
+    out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+    out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+    out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+  }
+}
+
+// reads one string at offset and advances it, false if truncated
+bool read_ptp_string(uint8_t const* data, size_t size, size_t& offset, std::string& out) {
+  out.clear();
+  if (offset + 1 > size) return false;
+  size_t const units = data[offset++];
+  if (offset + units * 2 > size) return false;
+
+  for (size_t i = 0; i < units; ++i) {
+    uint32_t cp = read_le<uint16_t>(data, offset + i * 2);
+    if (cp == 0) break;
+    if (cp >= 0xd800 && cp < 0xdc00 && i + 1 < units) {
+      uint32_t const low = read_le<uint16_t>(data, offset + (i + 1) * 2);
+      if (low >= 0xdc00 && low < 0xe000) {
+        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+        ++i;
+      }
+    }
+    append_utf8(out, cp);
+  }
+  offset += units * 2;
+  return true;
+}
+
+int parse_digits(char const* str, int count) {
+  int value = 0;
+  for (int i = 0; i < count; ++i) {
+    if (str[i] < '0' || str[i] > '9') return -1;
+    value = value * 10 + (str[i] - '0');
+  }
+  return value;
+}
+
+// "YYYYMMDDThhmmss"
+bool parse_image_date(std::string const& str, image_date& date) {
+  if (str.size() < 15 || str[8] != 'T') return false;
+  char const* s = str.c_str();
+  int const fields[] = {parse_digits(s, 4), parse_digits(s + 4, 2),
+                        parse_digits(s + 6, 2), parse_digits(s + 9, 2),
+                        parse_digits(s + 11, 2), parse_digits(s + 13, 2)};
+  if (std::find(std::begin(fields), std::end(fields), -1) != std::end(fields))
+    return false;
+
+  date.year = static_cast<uint16_t>(fields[0]);
+  date.month = static_cast<uint8_t>(fields[1]);
+  date.day = static_cast<uint8_t>(fields[2]);
+  date.hour = static_cast<uint8_t>(fields[3]);
+  date.minute = static_cast<uint8_t>(fields[4]);
+  date.second = static_cast<uint8_t>(fields[5]);
+  return true;
+}
+
+uint32_t send_by_index(native_socket sockfd, message_type type, uint32_t index) {
+  auto const msg = make_static_message(type, make_byte_array(index));
+  fuji_send(sockfd, msg);
+  return msg.id;
+}
+
+struct pending_request {
+  uint32_t index;
+  uint32_t id;
+  bool thumbnail;
+  image_info info;  // thumbnail requests sent after the info reply
+};
+
+thumbnail_key make_thumbnail_key(browse_options const& options, image_info const& info) {
+  thumbnail_key key;
+  key.camera = options.camera;
+  key.index = info.index;
+  key.size = info.size;
+  return key;
+}
+
+}  // namespace
+
+bool parse_image_info(void const* data, size_t size, image_info& info) {
+  if (size < object_info_fixed_bytes) {
+    log(LOG_WARN, string_format("parse_image_info: message too short (%zu bytes)", size));
+    return false;
+  }
+
+  uint8_t const* bytes = static_cast<uint8_t const*>(data);
+  info.storage_id = read_le<uint32_t>(bytes, 0);
+  info.format = read_le<uint16_t>(bytes, 4);
+  info.size = read_le<uint32_t>(bytes, 8);
+  info.thumbnail_size = read_le<uint32_t>(bytes, 14);
+  info.thumbnail_width = read_le<uint32_t>(bytes, 18);
+  info.thumbnail_height = read_le<uint32_t>(bytes, 22);
+  info.width = read_le<uint32_t>(bytes, 26);
+  info.height = read_le<uint32_t>(bytes, 30);
+
+  size_t offset = object_info_fixed_bytes;
+  std::string date;
+  if (!read_ptp_string(bytes, size, offset, info.filename) ||
+      !read_ptp_string(bytes, size, offset, date)) {
+    log(LOG_WARN, "parse_image_info: truncated string");
+    return false;
+  }
+
+  info.date = image_date();
+  if (!date.empty() && !parse_image_date(date, info.date))
+    log(LOG_DEBUG, string_format("parse_image_info: unknown date format %s", date.c_str()));
+
+  return true;
+}
+
+bool image_info_by_index(native_socket sockfd, uint32_t index, image_info& info) {
+  if (sockfd <= 0) return false;
+
+  std::vector<uint8_t> data;
+  uint32_t const id = send_by_index(sockfd, message_type::image_info_by_index, index);
+  if (!fuji_receive_response(sockfd, id, &data))
+    return false;
+
+  info.index = index;
+  return parse_image_info(data.data(), data.size(), info);
+}
+
+bool thumbnail_by_index(native_socket sockfd, uint32_t index, std::vector<uint8_t>& jpeg) {
+  if (sockfd <= 0) return false;
+
+  uint32_t const id = send_by_index(sockfd, message_type::thumbnail_by_index, index);
+  return fuji_receive_response(sockfd, id, &jpeg);
+}
+
+size_t browse_card(native_socket sockfd, browse_options const& options,
+                   browse_callback const& callback) {
+  if (sockfd <= 0) return 0;
+
+  log(LOG_INFO, string_format("browse_card (depth %u)", options.pipeline_depth));
+
+  uint32_t const last_index = options.max_images
+      ? options.first_index + options.max_images
+      : UINT32_MAX;
+  size_t const depth = std::max(options.pipeline_depth, 1u);
+  thumbnail_cache* const cache = options.thumbnails && options.cache && options.cache->is_open()
+      ? options.cache : nullptr;
+  bool const eager_thumbnails = options.thumbnails && !cache;
+
+  std::deque<pending_request> in_flight;
+  uint32_t next_index = options.first_index;
+  bool end_of_card = false;
+  size_t count = 0;
+  size_t cache_hits = 0;
+
+  image_info info;
+  std::vector<uint8_t> data;
+
+  for (;;) {
+    // keep up to depth images requested, replies arrive in request order
+    while (!end_of_card && next_index < last_index) {
+      size_t const images_in_flight = eager_thumbnails ? (in_flight.size() + 1) / 2 : in_flight.size();
+      if (images_in_flight >= depth) break;
+
+      pending_request req;
+      req.index = next_index;
+      req.thumbnail = false;
+      req.id = send_by_index(sockfd, message_type::image_info_by_index, next_index);
+      in_flight.push_back(req);
+      if (eager_thumbnails) {
+        req.id = send_by_index(sockfd, message_type::thumbnail_by_index, next_index);
+        req.thumbnail = true;
+        in_flight.push_back(req);
+      }
+      ++next_index;
+    }
+
+    if (in_flight.empty()) break;
+
+    pending_request req = std::move(in_flight.front());
+    in_flight.pop_front();
+    bool const success = fuji_receive_response(sockfd, req.id, &data);
+
+    // requests sent past the last image fail, drain them
+    if (end_of_card && req.index >= info.index) continue;
+
+    if (!req.thumbnail) {
+      info.index = req.index;
+      if (!success || !parse_image_info(data.data(), data.size(), info)) {
+        log(LOG_INFO, string_format("browse_card: no image at index %u", req.index));
+        end_of_card = true;
+        continue;
+      }
+
+      if (!options.thumbnails) {
+        callback(info, nullptr, 0);
+        ++count;
+      } else if (cache) {
+        if (cache->find(make_thumbnail_key(options, info), data)) {
+          callback(info, data.data(), data.size());
+          ++count;
+          ++cache_hits;
+        } else {
+          req.id = send_by_index(sockfd, message_type::thumbnail_by_index, req.index);
+          req.thumbnail = true;
+          req.info = info;
+          in_flight.push_back(std::move(req));
+        }
+      }
+    } else {
+      image_info const& thumbnail_info = eager_thumbnails ? info : req.info;
+      if (!success)
+        log(LOG_WARN, string_format("browse_card: failed to get thumbnail %u", req.index));
+      else if (cache)
+        cache->insert(make_thumbnail_key(options, thumbnail_info), data.data(), data.size());
+      callback(thumbnail_info, success ? data.data() : nullptr, success ? data.size() : 0);
+      ++count;
+    }
+  }
+
+  log(LOG_INFO, string_format("browse_card: %zu images, %zu thumbnails from cache", count, cache_hits));
+  return count;
+}
+
+card_index_writer::~card_index_writer() { finish(); }
+
+bool card_index_writer::open(char const* path) {
+  finish();
+  file = fopen(path, "wb");
+  if (!file) {
+    log(LOG_ERROR, string_format("card_index_writer: failed to create %s", path));
+    return false;
+  }
+
+  card_index_header header = {};
+  offset = sizeof(header);
+  entries.clear();
+  return fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+bool card_index_writer::add(image_info const& info, uint8_t const* thumbnail,
+                            size_t const thumbnail_size) {
+  if (!file) return false;
+
+  card_index_entry entry = {};
+  entry.index = info.index;
+  entry.size = info.size;
+  entry.width = info.width;
+  entry.height = info.height;
+  entry.thumbnail_width = info.thumbnail_width;
+  entry.thumbnail_height = info.thumbnail_height;
+  entry.format = info.format;
+  entry.year = info.date.year;
+  entry.month = info.date.month;
+  entry.day = info.date.day;
+  entry.hour = info.date.hour;
+  entry.minute = info.date.minute;
+  entry.second = info.date.second;
+  strncpy(entry.filename, info.filename.c_str(), sizeof(entry.filename) - 1);
+
+  if (thumbnail && thumbnail_size > 0) {
+    if (fwrite(thumbnail, thumbnail_size, 1, file) != 1) {
+      log(LOG_ERROR, "card_index_writer: failed to write thumbnail");
+      return false;
+    }
+    entry.thumbnail_offset = offset;
+    entry.thumbnail_size = static_cast<uint32_t>(thumbnail_size);
+    offset += thumbnail_size;
+  }
+
+  entries.push_back(entry);
+  return true;
+}
+
+bool card_index_writer::finish() {
+  if (!file) return true;
+
+  // entry table 8 byte aligned so it can be used in place when mapped
+  uint8_t const padding[8] = {};
+  size_t const paddingBytes = (8 - offset % 8) % 8;
+
+  card_index_header header = {};
+  memcpy(header.magic, "FCWTIDX", 8);
+  header.version = card_index_version;
+  header.entry_bytes = sizeof(card_index_entry);
+  header.entries_offset = offset + paddingBytes;
+  header.count = entries.size();
+
+  bool success = fwrite(padding, 1, paddingBytes, file) == paddingBytes;
+  if (!entries.empty())
+    success = success && fwrite(entries.data(), sizeof(card_index_entry), entries.size(), file) == entries.size();
+  success = success && fseek(file, 0, SEEK_SET) == 0;
+  success = success && fwrite(&header, sizeof(header), 1, file) == 1;
+  success = fclose(file) == 0 && success;
+  file = nullptr;
+
+  if (!success)
+    log(LOG_ERROR, "card_index_writer: failed to write index");
+  return success;
+}
+
+bool card_index::open(char const* path) {
+  entries = nullptr;
+  count = 0;
+  if (!file.open(path, false)) return false;
+
+  card_index_header header;
+  if (file.size() < sizeof(header)) {
+    log(LOG_ERROR, string_format("card_index: %s is too small", path));
+    return false;
+  }
+  memcpy(&header, file.data(), sizeof(header));
+
+  if (memcmp(header.magic, "FCWTIDX", 8) != 0 ||
+      header.version != card_index_version ||
+      header.entry_bytes != sizeof(card_index_entry) ||
+      header.entries_offset % 8 != 0 ||
+      header.entries_offset > file.size() ||
+      header.count > (file.size() - header.entries_offset) / sizeof(card_index_entry)) {
+    log(LOG_ERROR, string_format("card_index: %s is not a valid index", path));
+    return false;
+  }
+
+  entries = reinterpret_cast<card_index_entry const*>(file.data() + header.entries_offset);
+  count = static_cast<size_t>(header.count);
+  return true;
+}
+
+uint8_t const* card_index::thumbnail(size_t i) const {
+  card_index_entry const& entry = entries[i];
+  if (entry.thumbnail_size == 0 ||
+      entry.thumbnail_offset + entry.thumbnail_size > file.size())
+    return nullptr;
+  return file.data() + entry.thumbnail_offset;
+}
+
+}  // namespace fcwt
@@ -0,0 +1,525 @@
+#include "camera_session.hpp"
+
+#include "control_channel.hpp"
+#include "log.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace fcwt {
+
+namespace {
+
+typedef std::chrono::steady_clock steady;
+
+std::chrono::microseconds micros(steady::duration const d) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(d);
+}
+
+size_t level(command_priority const priority) { return static_cast<size_t>(priority); }
+
+bool step_setting(native_socket const sockfd, property_codes const code, bool const down) {
+  switch (code) {
+    case property_aperture:
+      return update_setting(sockfd, down ? fnumber_decrement : fnumber_increment);
+    case property_shutter_speed:
+      return update_setting(sockfd, down ? ss_decrement : ss_increment);
+    case property_exposure_compensation:
+      return update_setting(sockfd, down ? exp_decrement : exp_increment);
+    default:
+      log(LOG_ERROR, string_format("step: property 0x%04x has no steps", code));
+      return false;
+  }
+}
+
+}  // namespace
+
+bool camera_io::refresh_settings() {
+  if (!current_settings(control, settings)) return false;
+  std::lock_guard<std::mutex> const lock(session.state_mutex);
+  session.settings_ = settings;
+  return true;
+}
+
+std::unique_ptr<control_channel> camera_io::open_channel() {
+  return std::unique_ptr<control_channel>(session.reactor ? new control_channel(control, *session.reactor)
+                                                         : new control_channel(control));
+}
+
+camera_session::camera_session(camera_endpoint endpoint, io_reactor* const reactor)
+    : endpoint_(std::move(endpoint)), reactor(reactor), io(*this) {
+  worker = std::thread([this]() { run(); });
+}
+
+camera_session::~camera_session() {
+  {
+    std::lock_guard<std::mutex> const lock(queue_mutex);
+    stopping = true;
+  }
+  queue_cv.notify_one();
+  if (worker.joinable()) worker.join();
+  close_connection();
+}
+
+void camera_session::enqueue(std::function<void()> task, command_priority const priority) {
+  {
+    std::lock_guard<std::mutex> const lock(queue_mutex);
+    push(std::move(task), priority);
+  }
+  queue_cv.notify_one();
+}
+
+void camera_session::push(std::function<void()> task, command_priority const priority) {
+  // a step must not be merged across another setting change
+  if (priority == command_priority::normal) queued_steps.clear();
+  queued_task queued;
+  queued.run = std::move(task);
+  queued.queued = steady::now();
+  queues[level(priority)].push_back(std::move(queued));
+}
+
+void camera_session::run() {
+  typedef std::array<std::deque<queued_task>, command_priorities>::iterator queue_iterator;
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex);
+      auto const next = [this]() {
+        return std::find_if(queues.begin(), queues.end(),
+                            [](std::deque<queued_task> const& q) { return !q.empty(); });
+      };
+      queue_cv.wait(lock, [&]() { return stopping || next() != queues.end(); });
+      queue_iterator const q = next();
+      if (q == queues.end()) return;
+
+      command_queue_stats::level& l = stats.levels[q - queues.begin()];
+      std::chrono::microseconds const wait = micros(steady::now() - q->front().queued);
+      ++l.tasks;
+      l.total_wait += wait;
+      l.max_wait = std::max(l.max_wait, wait);
+      task = std::move(q->front().run);
+      q->pop_front();
+    }
+    task();
+  }
+}
+
+bool camera_session::connect(char const* deviceName, capability_cache* cache,
+                             connection_mode const mode, bool const pipeline) {
+  return execute([this, deviceName, cache, mode, pipeline](camera_io& io) -> bool {
+    close_connection();
+
+    char const* const device = endpoint_.device.empty() ? nullptr : endpoint_.device.c_str();
+    control = connect_to_camera(control_server_port, endpoint_.address.c_str(), device);
+    if (control <= 0) return false;
+
+    connect_profile profile;
+    std::vector<capability> caps;
+    bool const success =
+        init_control_connection(control, deviceName, &caps, mode, &profile, pipeline, cache);
+    if (!success) {
+      control = sock();
+    } else {
+      io.control = control;
+      if (mode == connection_mode_remote) {
+        if (!current_settings(control, io.settings))
+          log(LOG_WARN, string_format("%s: failed to read the camera settings",
+                                      endpoint_.address.c_str()));
+        async = connect_to_camera(async_response_server_port, endpoint_.address.c_str(), device);
+        io.async = async;
+      }
+    }
+
+    std::lock_guard<std::mutex> const lock(state_mutex);
+    profile_ = profile;
+    if (success) {
+      caps_ = caps;
+      settings_ = io.settings;
+      mode_ = mode;
+      connected = true;
+    }
+    return success;
+  });
+}
+
+void camera_session::disconnect() {
+  execute([this](camera_io&) { close_connection(); });
+}
+
+// only called on the strand, or once it stopped
+void camera_session::close_connection() {
+  {
+    std::lock_guard<std::mutex> const lock(state_mutex);
+    if (!connected) return;
+    connected = false;
+  }
+  terminate_control_connection(control);
+  io.control = io.async = 0;
+  async = sock();
+  control = sock();
+}
+
+bool camera_session::is_connected() const {
+  std::lock_guard<std::mutex> const lock(state_mutex);
+  return connected;
+}
+
+bool camera_session::open_stream() {
+  std::lock_guard<std::mutex> const lock(stream_mutex);
+  if (stream > 0) {
+    log(LOG_ERROR, "the live view is already open");
+    return false;
+  }
+  char const* const device = endpoint_.device.empty() ? nullptr : endpoint_.device.c_str();
+  stream = connect_to_camera(jpg_stream_server_port, endpoint_.address.c_str(), device);
+  return stream > 0;
+}
+
+native_socket camera_session::stream_socket() const {
+  std::lock_guard<std::mutex> const lock(stream_mutex);
+  return stream;
+}
+
+void camera_session::close_stream() {
+  std::lock_guard<std::mutex> const lock(stream_mutex);
+  stream = sock();
+}
+
+std::future<bool> camera_session::shutter(std::string const& thumbnail) {
+  return post([thumbnail](camera_io& io) {
+    return fcwt::shutter(io.control, io.async, thumbnail.empty() ? nullptr : thumbnail.c_str());
+  }, command_priority::shutter);
+}
+
+std::future<bool> camera_session::update(property_codes const code, uint32_t const value) {
+  return post([code, value](camera_io& io) {
+    return update_setting(io.control, code, value) && io.refresh_settings();
+  });
+}
+
+std::future<bool> camera_session::focus(auto_focus_point const point) {
+  return post([point](camera_io& io) {
+    return update_setting(io.control, point) && io.refresh_settings();
+  }, command_priority::focus);
+}
+
+std::shared_future<bool> camera_session::step(property_codes const code, int const steps) {
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  auto const it = queued_steps.find(code);
+  if (it != queued_steps.end()) {
+    it->second->steps += steps;
+    ++stats.levels[level(command_priority::normal)].coalesced;
+    return it->second->result;
+  }
+
+  auto const queued = std::make_shared<queued_step>();
+  queued->steps = steps;
+  auto const task = std::make_shared<std::packaged_task<bool(camera_io&)>>(
+      [this, code, queued](camera_io& io) -> bool {
+        int total = 0;
+        {
+          std::lock_guard<std::mutex> const lock(queue_mutex);
+          total = queued->steps;
+          auto const it = queued_steps.find(code);
+          if (it != queued_steps.end() && it->second == queued) queued_steps.erase(it);
+        }
+        bool success = true;
+        for (int i = 0; i < abs(total) && success; ++i)
+          success = step_setting(io.control, code, total < 0);
+        return success && io.refresh_settings();
+      });
+  queued->result = task->get_future().share();
+  push([this, task]() { (*task)(io); }, command_priority::normal);
+  queued_steps[code] = queued;  // after push, which ends the previous run of steps
+  lock.unlock();
+  queue_cv.notify_one();
+  return queued->result;
+}
+
+std::shared_future<bool> camera_session::refresh_settings() {
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  if (poll_queued) {
+    ++stats.levels[level(command_priority::poll)].coalesced;
+    return queued_poll;
+  }
+
+  auto const task = std::make_shared<std::packaged_task<bool(camera_io&)>>(
+      [this](camera_io& io) -> bool {
+        {
+          std::lock_guard<std::mutex> const lock(queue_mutex);
+          poll_queued = false;  // later polls may see a different state
+        }
+        return io.refresh_settings();
+      });
+  queued_poll = task->get_future().share();
+  poll_queued = true;
+  push([this, task]() { (*task)(io); }, command_priority::poll);
+  lock.unlock();
+  queue_cv.notify_one();
+  return queued_poll;
+}
+
+command_queue_stats camera_session::queue_stats() const {
+  std::lock_guard<std::mutex> const lock(queue_mutex);
+  return stats;
+}
+
+size_t camera_session::queued() const {
+  std::lock_guard<std::mutex> const lock(queue_mutex);
+  size_t count = 0;
+  for (std::deque<queued_task> const& q : queues) count += q.size();
+  return count;
+}
+
+connection_mode camera_session::mode() const {
+  std::lock_guard<std::mutex> const lock(state_mutex);
+  return mode_;
+}
+
+connect_profile camera_session::profile() const {
+  std::lock_guard<std::mutex> const lock(state_mutex);
+  return profile_;
+}
+
+std::vector<capability> camera_session::caps() const {
+  std::lock_guard<std::mutex> const lock(state_mutex);
+  return caps_;
+}
+
+void camera_session::set_caps(std::vector<capability> caps) {
+  std::lock_guard<std::mutex> const lock(state_mutex);
+  caps_ = std::move(caps);
+}
+
+current_properties camera_session::settings() const {
+  std::lock_guard<std::mutex> const lock(state_mutex);
+  return settings_;
+}
+
+uint32_t camera_session::setting(property_codes const code) const {
+  std::lock_guard<std::mutex> const lock(state_mutex);
+  auto const it = settings_.values.find(code);
+  return it != settings_.values.end() ? it->second : 0;
+}
+
+void print(command_queue_stats const& stats) {
+  static char const* const names[command_priorities] = {"shutter", "focus", "normal", "poll"};
+  printf("command queue:\n");
+  for (size_t i = 0; i < command_priorities; ++i) {
+    command_queue_stats::level const& l = stats.levels[i];
+    double const mean = l.tasks ? l.total_wait.count() / 1000.0 / l.tasks : 0.0;
+    printf("\t%-8s %6llu run, %6llu coalesced, wait mean %.1f ms, max %.1f ms\n", names[i],
+           static_cast<unsigned long long>(l.tasks), static_cast<unsigned long long>(l.coalesced),
+           mean, l.max_wait.count() / 1000.0);
+  }
+}
+
+void print(sync_shutter_report const& report) {
+  printf("synchronized shutter, %zu cameras:\n", report.cameras.size());
+  for (camera_trigger const& t : report.cameras) {
+    printf("\tcamera %2zu: sent +%6lld us  ack %8.1f ms  thumbnail %zu bytes%s\n", t.camera,
+           static_cast<long long>(t.send_offset.count()), t.ack_latency.count() / 1000.0,
+           t.thumbnail_bytes, !t.parked ? "  BUSY" : t.acked ? "" : "  FAILED");
+  }
+  printf("\tskew %lld us, ack latency min %.1f ms max %.1f ms mean %.1f ms (spread %.1f ms)\n",
+         static_cast<long long>(report.skew.count()), report.ack_min.count() / 1000.0,
+         report.ack_max.count() / 1000.0, report.ack_mean.count() / 1000.0,
+         (report.ack_max - report.ack_min).count() / 1000.0);
+}
+
+camera_session& camera_manager::add(camera_endpoint endpoint) {
+  sessions.emplace_back(new camera_session(std::move(endpoint), &reactor));
+  return *sessions.back();
+}
+
+size_t camera_manager::connect_all(char const* deviceName, capability_cache* cache) {
+  std::vector<std::thread> threads;
+  for (auto& session : sessions) {
+    camera_session* const s = session.get();
+    if (!s->is_connected())
+      threads.emplace_back([s, deviceName, cache]() { s->connect(deviceName, cache); });
+  }
+  for (auto& t : threads) t.join();
+
+  return std::count_if(sessions.begin(), sessions.end(),
+                       [](std::unique_ptr<camera_session> const& s) { return s->is_connected(); });
+}
+
+void camera_manager::disconnect_all() {
+  std::vector<std::thread> threads;
+  for (auto& session : sessions) {
+    camera_session* const s = session.get();
+    threads.emplace_back([s]() { s->disconnect(); });
+  }
+  for (auto& t : threads) t.join();
+}
+
+namespace {
+
+// shared with the parking tasks, which may still run after shutter()
+// returned without them
+struct sync_release {
+  typedef static_message<8> shutter_message;
+
+  std::vector<size_t> cameras;
+  std::vector<std::shared_ptr<counting_sink>> sinks;
+  std::vector<shutter_message> messages;
+  std::vector<steady::time_point> sent;
+  std::mutex mutex;  // guards the members below
+  std::condition_variable cv;
+  std::vector<native_socket> sockets;
+  std::vector<bool> parked;
+  size_t parked_count = 0;
+  bool closed = false;  // the releases are sent, later tasks return right away
+  std::promise<void> go;
+  std::shared_future<void> released;
+};
+
+}  // namespace
+
+bool camera_manager::shutter(std::string const& thumbnail_pattern, sync_shutter_report* report,
+                             std::chrono::milliseconds const park_timeout) {
+  auto const state = std::make_shared<sync_release>();
+  std::vector<size_t>& cameras = state->cameras;
+  for (size_t i = 0; i < sessions.size(); ++i) {
+    if (!sessions[i]->is_connected()) continue;
+    cameras.push_back(i);
+    state->sinks.push_back(std::make_shared<counting_sink>(
+        thumbnail_pattern.empty()
+            ? nullptr
+            : file_sink(string_format(thumbnail_pattern.c_str(), static_cast<unsigned>(i)))));
+  }
+  if (cameras.empty()) {
+    log(LOG_ERROR, "shutter: no camera connected");
+    return false;
+  }
+
+  size_t const n = cameras.size();
+  for (size_t i = 0; i < n; ++i)
+    state->messages.push_back(make_static_message(message_type::shutter, 0x00, 0x00, 0x00, 0x00,
+                                                  0x00, 0x00, 0x00, 0x00));
+  state->sockets.assign(n, 0);
+  state->parked.assign(n, false);
+  state->sent.resize(n);
+  state->released = state->go.get_future().share();
+
+  // every strand parks until the releases are sent, which leaves this thread
+  // the only user of the control sockets; then each reads its own ack
+  std::vector<std::future<camera_trigger>> results;
+  for (size_t i = 0; i < n; ++i) {
+    results.push_back(sessions[cameras[i]]->post([state, i](camera_io& io) -> camera_trigger {
+      camera_trigger t;
+      t.camera = state->cameras[i];
+      {
+        std::lock_guard<std::mutex> const lock(state->mutex);
+        if (state->closed) return t;  // too late, the others are released
+        state->sockets[i] = io.control;
+        state->parked[i] = true;
+        ++state->parked_count;
+      }
+      state->cv.notify_one();
+      state->released.wait();
+
+      t.parked = true;
+      if (io.control <= 0) return t;
+      t.acked = fuji_receive_response(io.control, state->messages[i].id, nullptr);
+      t.ack_latency = micros(steady::now() - state->sent[i]);
+      if (t.acked && shutter_complete(io.control, io.async, *state->sinks[i]))
+        t.thumbnail_bytes = state->sinks[i]->bytes;
+      return t;
+    }, command_priority::shutter));
+  }
+
+  std::vector<bool> parked;
+  {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait_for(lock, park_timeout, [&]() { return state->parked_count == n; });
+    state->closed = true;
+    parked = state->parked;
+  }
+
+  log(LOG_INFO, string_format("shutter (%zu cameras)", n));
+  for (size_t i = 0; i < n; ++i) {
+    state->sent[i] = steady::now();
+    if (parked[i] && state->sockets[i] > 0)  // disconnected in the meantime otherwise
+      fuji_send(state->sockets[i], &state->messages[i], state->messages[i].size());
+  }
+  state->go.set_value();
+
+  sync_shutter_report r;
+  bool all_acked = true;
+  std::chrono::microseconds ack_total(0);
+  size_t acked = 0;
+  for (size_t i = 0; i < n; ++i) {
+    camera_trigger t;
+    t.camera = cameras[i];
+    if (parked[i]) {
+      t = results[i].get();
+      t.send_offset = micros(state->sent[i] - state->sent[0]);
+    } else {
+      log(LOG_ERROR, string_format("shutter: camera %zu is busy, not released", cameras[i]));
+    }
+    r.cameras.push_back(t);
+
+    if (!t.acked) {
+      if (parked[i]) log(LOG_ERROR, string_format("shutter: camera %zu did not ack", cameras[i]));
+      all_acked = false;
+      continue;
+    }
+    if (acked == 0 || t.ack_latency < r.ack_min) r.ack_min = t.ack_latency;
+    r.ack_max = std::max(r.ack_max, t.ack_latency);
+    ack_total += t.ack_latency;
+    ++acked;
+  }
+  r.skew = micros(state->sent[n - 1] - state->sent[0]);
+  if (acked) r.ack_mean = ack_total / static_cast<int64_t>(acked);
+
+  if (report) *report = std::move(r);
+  return all_acked;
+}
+
+bool camera_manager::bracket(bracket_plan const& plan, std::vector<bracket_report>* reports) {
+  typedef std::pair<bool, bracket_report> camera_bracket;
+  std::vector<size_t> cameras;
+  std::vector<std::future<camera_bracket>> results;
+  for (size_t i = 0; i < sessions.size(); ++i) {
+    if (!sessions[i]->is_connected()) continue;
+    bracket_plan camera_plan = plan;
+    if (!plan.thumbnail_pattern.empty()) {
+      size_t const name = plan.thumbnail_pattern.find_last_of('/') + 1;  // 0 without a directory
+      camera_plan.thumbnail_pattern.insert(name, string_format("camera%02u_", static_cast<unsigned>(i)));
+    }
+    cameras.push_back(i);
+    // the strands run the plans side by side, their channels are all read by
+    // the reactor
+    results.push_back(sessions[i]->post([camera_plan](camera_io& io) -> camera_bracket {
+      camera_bracket result(false, bracket_report());
+      if (io.control <= 0) return result;
+      std::unique_ptr<control_channel> const channel = io.open_channel();
+      shutter_pipeline pipeline(*channel, io.async);
+      result.first = run_bracket(*channel, pipeline, camera_plan, &result.second);
+      return result;
+    }));
+  }
+  if (cameras.empty()) {
+    log(LOG_ERROR, "bracket: no camera connected");
+    return false;
+  }
+
+  if (reports) reports->clear();
+  bool all = true;
+  for (size_t i = 0; i < cameras.size(); ++i) {
+    camera_bracket const result = results[i].get();
+    if (!result.first) {
+      log(LOG_ERROR, string_format("bracket: camera %zu failed", cameras[i]));
+      all = false;
+    }
+    if (reports) reports->push_back(result.second);
+  }
+  return all;
+}
+
+}  // namespace fcwt
@@ -0,0 +1,239 @@
+#include "capability_cache.hpp"
+
+#include "commands.hpp"
+#include "log.hpp"
+#include "thumbnail_cache.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+namespace fcwt {
+
+namespace {
+
+char const capability_file_magic[8] = {'F', 'C', 'W', 'T', 'C', 'A', 'P', '\0'};
+const uint32_t capability_file_version = 2;
+
+struct capability_file_header {
+  char magic[8];  // "FCWTCAP\0"
+  uint32_t version;
+  uint32_t count;
+  uint64_t hash;  // of the records
+};
+
+// what a camera model supports, followed by stored_values uint32_t values;
+// the current value changes with every setting and is not stored
+struct capability_record {
+  uint16_t property_code;
+  uint16_t data_type;
+  uint8_t get_set;
+  uint8_t form_flag;
+  uint16_t count;
+  uint16_t stored_values;
+  uint16_t reserved;
+  uint32_t default_value;
+  uint32_t min_value;
+  uint32_t max_value;
+  uint32_t step_size;
+};
+
+uint64_t hash_bytes(uint8_t const* data, size_t size) {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= data[i];
+    hash *= 1099511628211ull;
+  }
+  return hash ^ size;
+}
+
+uint16_t stored_values(capability const& cap) {
+  return cap.form_flag == 2 ? std::min(cap.count, capability_max_values) : 0;
+}
+
+}  // namespace
+
+bool operator==(capability const& a, capability const& b) {
+  if (a.property_code != b.property_code || a.data_type != b.data_type ||
+      a.get_set != b.get_set || a.default_value != b.default_value || a.form_flag != b.form_flag ||
+      a.min_value != b.min_value || a.max_value != b.max_value ||
+      a.step_size != b.step_size || a.count != b.count)
+    return false;
+  uint16_t const n = stored_values(a);
+  return std::equal(a.values, a.values + n, b.values);
+}
+
+bool operator!=(capability const& a, capability const& b) { return !(a == b); }
+
+uint64_t write_capabilities(std::vector<capability> const& caps, std::vector<uint8_t>& out) {
+  capability_file_header header = {};
+  memcpy(header.magic, capability_file_magic, sizeof(header.magic));
+  header.version = capability_file_version;
+  header.count = static_cast<uint32_t>(caps.size());
+
+  out.resize(sizeof(header));
+  for (capability const& cap : caps) {
+    capability_record rec = {};
+    rec.property_code = cap.property_code;
+    rec.data_type = cap.data_type;
+    rec.get_set = cap.get_set;
+    rec.form_flag = cap.form_flag;
+    rec.count = cap.count;
+    rec.stored_values = stored_values(cap);
+    rec.default_value = cap.default_value;
+    rec.min_value = cap.min_value;
+    rec.max_value = cap.max_value;
+    rec.step_size = cap.step_size;
+
+    size_t const offset = out.size();
+    size_t const values_size = rec.stored_values * sizeof(uint32_t);
+    out.resize(offset + sizeof(rec) + values_size);
+    memcpy(&out[offset], &rec, sizeof(rec));
+    memcpy(&out[offset + sizeof(rec)], cap.values, values_size);
+  }
+  header.hash = hash_bytes(out.data() + sizeof(header), out.size() - sizeof(header));
+  memcpy(out.data(), &header, sizeof(header));
+  return header.hash;
+}
+
+bool read_capabilities(uint8_t const* data, size_t const size, std::vector<capability>& caps,
+                       uint64_t* hash) {
+  capability_file_header header;
+  if (size < sizeof(header)) return false;
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, capability_file_magic, sizeof(header.magic)) != 0 ||
+      header.version != capability_file_version)
+    return false;
+
+  std::vector<capability> result;
+  result.reserve(header.count);
+  size_t offset = sizeof(header);
+  for (uint32_t i = 0; i < header.count; ++i) {
+    capability_record rec;
+    if (size - offset < sizeof(rec)) return false;
+    memcpy(&rec, data + offset, sizeof(rec));
+    offset += sizeof(rec);
+
+    size_t const values_size = rec.stored_values * sizeof(uint32_t);
+    if (rec.stored_values > capability_max_values || size - offset < values_size)
+      return false;
+
+    capability cap;
+    cap.property_code = static_cast<property_codes>(rec.property_code);
+    cap.data_type = static_cast<data_types>(rec.data_type);
+    cap.get_set = rec.get_set;
+    cap.form_flag = rec.form_flag;
+    cap.count = rec.count;
+    cap.default_value = rec.default_value;
+    cap.min_value = rec.min_value;
+    cap.max_value = rec.max_value;
+    cap.step_size = rec.step_size;
+    memcpy(cap.values, data + offset, values_size);
+    offset += values_size;
+    result.push_back(cap);
+  }
+
+  caps.swap(result);
+  if (hash) *hash = header.hash;
+  return true;
+}
+
+capability_cache::~capability_cache() { wait(); }
+
+void capability_cache::open(char const* dir, change_handler handler) {
+  wait();
+  std::lock_guard<std::mutex> lock(mutex);
+  directory = dir;
+  on_change = std::move(handler);
+  entries.clear();
+}
+
+std::string capability_cache::path(std::string const& camera) const {
+  return directory + "/" +
+         string_format("capabilities_%016llx.bin",
+                       static_cast<unsigned long long>(camera_key(camera)));
+}
+
+bool capability_cache::load(std::string const& camera) {
+  if (entries.count(camera)) return true;
+  if (directory.empty()) return false;
+
+  std::vector<uint8_t> data;
+  FILE* file = fopen(path(camera).c_str(), "rb");
+  if (!file) return false;
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    data.insert(data.end(), chunk, chunk + n);
+  fclose(file);
+
+  entry e;
+  if (!read_capabilities(data.data(), data.size(), e.caps, &e.hash)) {
+    log(LOG_WARN, string_format("capability_cache: ignoring invalid %s", path(camera).c_str()));
+    return false;
+  }
+  entries[camera] = std::move(e);
+  return true;
+}
+
+bool capability_cache::find(std::string const& camera, std::vector<capability>& caps) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (camera.empty() || !load(camera)) return false;
+  caps = entries[camera].caps;
+  return true;
+}
+
+void capability_cache::refresh(std::string const& camera, std::vector<uint8_t> data) {
+  if (camera.empty()) return;
+  std::lock_guard<std::mutex> lock(worker_mutex);
+  if (worker.joinable()) worker.join();
+  worker = std::thread([this, camera](std::vector<uint8_t> const& data) { update(camera, data); },
+                       std::move(data));
+}
+
+void capability_cache::update(std::string const& camera, std::vector<uint8_t> const& data) {
+  std::vector<capability> const caps = parse_camera_caps(data.data(), data.size());
+  if (caps.empty()) return;
+
+  // only what the camera supports counts, the current values always change
+  std::vector<uint8_t> file_data;
+  uint64_t const hash = write_capabilities(caps, file_data);
+  change_handler handler;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    bool const known = load(camera);
+    if (known && entries[camera].hash == hash) return;
+    if (known) handler = on_change;
+    entry& e = entries[camera];
+    e.hash = hash;
+    e.caps = caps;
+  }
+  if (!directory.empty()) {
+    std::string const file_path = path(camera);
+    std::string const tmp_path = file_path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    bool written = file && fwrite(file_data.data(), 1, file_data.size(), file) == file_data.size();
+    if (file) written = fclose(file) == 0 && written;
+    if (!written || rename(tmp_path.c_str(), file_path.c_str()) != 0) {
+      log(LOG_WARN, string_format("capability_cache: failed to write %s", file_path.c_str()));
+      remove(tmp_path.c_str());
+    }
+  }
+
+  if (handler) handler(camera, caps);
+}
+
+void capability_cache::invalidate(std::string const& camera) {
+  wait();
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.erase(camera);
+  if (!directory.empty()) remove(path(camera).c_str());
+}
+
+void capability_cache::wait() {
+  std::lock_guard<std::mutex> lock(worker_mutex);
+  if (worker.joinable()) worker.join();
+}
+
+}  // namespace fcwt
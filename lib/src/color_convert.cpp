@@ -0,0 +1,428 @@
+#include "color_convert.hpp"
+
+#include "platform.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FCWT_COLOR_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FCWT_COLOR_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace fcwt {
+
+namespace {
+
+// BT.601 limited range:
+// Y =  ( 66 R + 129 G +  25 B + 128) / 256 + 16
+// U =  (-38 R -  74 G + 112 B + 128) / 256 + 128
+// V =  (112 R -  94 G -  18 B + 128) / 256 + 128
+// Chroma is computed from the sum of 1 << shift pixels, the vector kernels
+// use the same integer steps so all levels give the same bytes.
+
+inline uint8_t luma(int b, int g, int r) {
+  return static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+inline uint8_t chroma_u(int b, int g, int r, int shift) {
+  return static_cast<uint8_t>(((-38 * r - 74 * g + 112 * b + (128 << shift)) >> (8 + shift)) + 128);
+}
+
+inline uint8_t chroma_v(int b, int g, int r, int shift) {
+  return static_cast<uint8_t>(((112 * r - 94 * g - 18 * b + (128 << shift)) >> (8 + shift)) + 128);
+}
+
+// pixels from x to width of one row
+void yuyv_row_scalar(uint8_t const* bgr, int x, int width, uint8_t* yuyv) {
+  for (; x < width; x += 2) {
+    uint8_t const* const p = bgr + x * 3;
+    uint8_t* const out = yuyv + x * 2;
+    out[0] = luma(p[0], p[1], p[2]);
+    out[1] = chroma_u(p[0] + p[3], p[1] + p[4], p[2] + p[5], 1);
+    out[2] = luma(p[3], p[4], p[5]);
+    out[3] = chroma_v(p[0] + p[3], p[1] + p[4], p[2] + p[5], 1);
+  }
+}
+
+// pixels from x to width of two rows
+void nv12_rows_scalar(uint8_t const* bgr0, uint8_t const* bgr1, int x, int width, uint8_t* y0,
+                      uint8_t* y1, uint8_t* uv) {
+  for (; x < width; x += 2) {
+    uint8_t const* const p = bgr0 + x * 3;
+    uint8_t const* const q = bgr1 + x * 3;
+    y0[x] = luma(p[0], p[1], p[2]);
+    y0[x + 1] = luma(p[3], p[4], p[5]);
+    y1[x] = luma(q[0], q[1], q[2]);
+    y1[x + 1] = luma(q[3], q[4], q[5]);
+    int const b = p[0] + p[3] + q[0] + q[3];
+    int const g = p[1] + p[4] + q[1] + q[4];
+    int const r = p[2] + p[5] + q[2] + q[5];
+    uv[x] = chroma_u(b, g, r, 2);
+    uv[x + 1] = chroma_v(b, g, r, 2);
+  }
+}
+
+// pixels from x to width of one row
+void gray_row_scalar(uint8_t const* bgr, int x, int width, uint8_t* gray) {
+  for (; x < width; ++x) gray[x] = luma(bgr[x * 3], bgr[x * 3 + 1], bgr[x * 3 + 2]);
+}
+
+int yuyv_row_none(uint8_t const*, int, uint8_t*) { return 0; }
+
+int nv12_rows_none(uint8_t const*, uint8_t const*, int, uint8_t*, uint8_t*, uint8_t*) { return 0; }
+
+int gray_row_none(uint8_t const*, int, uint8_t*) { return 0; }
+
+// the vector part of a row returns how many pixels it converted, the scalar
+// code does the rest
+template <int (*yuyv_row)(uint8_t const*, int, uint8_t*)>
+void bgr_to_yuyv_rows(uint8_t const* bgr, size_t bgr_stride, int width, int height,
+                      uint8_t* yuyv, size_t yuyv_stride) {
+  for (int row = 0; row < height; ++row) {
+    uint8_t const* const src = bgr + row * bgr_stride;
+    uint8_t* const dst = yuyv + row * yuyv_stride;
+    yuyv_row_scalar(src, yuyv_row(src, width, dst), width, dst);
+  }
+}
+
+template <int (*nv12_rows)(uint8_t const*, uint8_t const*, int, uint8_t*, uint8_t*, uint8_t*)>
+void bgr_to_nv12_rows(uint8_t const* bgr, size_t bgr_stride, int width, int height, uint8_t* y,
+                      size_t y_stride, uint8_t* uv, size_t uv_stride) {
+  for (int row = 0; row < height; row += 2) {
+    uint8_t const* const src0 = bgr + row * bgr_stride;
+    uint8_t const* const src1 = src0 + bgr_stride;
+    uint8_t* const y0 = y + row * y_stride;
+    uint8_t* const y1 = y0 + y_stride;
+    uint8_t* const dst_uv = uv + (row / 2) * uv_stride;
+    nv12_rows_scalar(src0, src1, nv12_rows(src0, src1, width, y0, y1, dst_uv), width, y0, y1, dst_uv);
+  }
+}
+
+template <int (*gray_row)(uint8_t const*, int, uint8_t*)>
+void bgr_to_gray_rows(uint8_t const* bgr, size_t bgr_stride, int width, int height, uint8_t* gray,
+                      size_t gray_stride) {
+  for (int row = 0; row < height; ++row) {
+    uint8_t const* const src = bgr + row * bgr_stride;
+    uint8_t* const dst = gray + row * gray_stride;
+    gray_row_scalar(src, gray_row(src, width, dst), width, dst);
+  }
+}
+
+#if FCWT_COLOR_X86
+
+// 8 pixels of BGR24 spread to 16 bit lanes; lo holds bytes 0 to 15, hi
+// bytes 16 to 23 in its lower half
+#define FCWT_BGR_MASKS                                                                          \
+  __m128i const b_lo = _mm_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, 12, -1, 15, -1, -1, -1, -1, -1); \
+  __m128i const b_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, -1, 5, -1); \
+  __m128i const g_lo = _mm_setr_epi8(1, -1, 4, -1, 7, -1, 10, -1, 13, -1, -1, -1, -1, -1, -1, -1); \
+  __m128i const g_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, -1, 3, -1, 6, -1); \
+  __m128i const r_lo = _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, 14, -1, -1, -1, -1, -1, -1, -1); \
+  __m128i const r_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, -1, 4, -1, 7, -1)
+
+__attribute__((target("sse4.1"))) inline void load_bgr8(uint8_t const* p, __m128i& b, __m128i& g,
+                                                         __m128i& r) {
+  FCWT_BGR_MASKS;
+  __m128i const lo = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+  __m128i const hi = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(p + 16));
+  b = _mm_or_si128(_mm_shuffle_epi8(lo, b_lo), _mm_shuffle_epi8(hi, b_hi));
+  g = _mm_or_si128(_mm_shuffle_epi8(lo, g_lo), _mm_shuffle_epi8(hi, g_hi));
+  r = _mm_or_si128(_mm_shuffle_epi8(lo, r_lo), _mm_shuffle_epi8(hi, r_hi));
+}
+
+// the sum fits into 16 bits unsigned
+__attribute__((target("sse4.1"))) inline __m128i luma8(__m128i b, __m128i g, __m128i r) {
+  __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+  y = _mm_add_epi16(y, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+  return _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+}
+
+// madd adds each pair of neighbouring pixels: 4 chroma sums in 32 bit lanes
+__attribute__((target("sse4.1"))) inline __m128i chroma_sum(__m128i b, __m128i g, __m128i r,
+                                                            short cb, short cg, short cr) {
+  return _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(b, _mm_set1_epi16(cb)), _mm_madd_epi16(g, _mm_set1_epi16(cg))),
+                       _mm_madd_epi16(r, _mm_set1_epi16(cr)));
+}
+
+// U0 V0 U1 V1 U2 V2 U3 V3 in 16 bit lanes
+__attribute__((target("sse4.1"))) inline __m128i interleave_uv(__m128i u, __m128i v) {
+  return _mm_packs_epi32(_mm_unpacklo_epi32(u, v), _mm_unpackhi_epi32(u, v));
+}
+
+__attribute__((target("sse4.1"))) int yuyv_row_sse41(uint8_t const* bgr, int width, uint8_t* yuyv) {
+  __m128i const round = _mm_set1_epi32(256);
+  __m128i const offset = _mm_set1_epi32(128);
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    __m128i b, g, r;
+    load_bgr8(bgr + x * 3, b, g, r);
+    __m128i const y = luma8(b, g, r);
+    __m128i const u = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(chroma_sum(b, g, r, 112, -74, -38), round), 9), offset);
+    __m128i const v = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(chroma_sum(b, g, r, -18, -94, 112), round), 9), offset);
+    __m128i const uv = interleave_uv(u, v);
+    __m128i const out = _mm_packus_epi16(_mm_unpacklo_epi16(y, uv), _mm_unpackhi_epi16(y, uv));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(yuyv + x * 2), out);
+  }
+  return x;
+}
+
+__attribute__((target("sse4.1"))) int nv12_rows_sse41(uint8_t const* bgr0, uint8_t const* bgr1, int width,
+                                                       uint8_t* y0, uint8_t* y1, uint8_t* uv) {
+  __m128i const round = _mm_set1_epi32(512);
+  __m128i const offset = _mm_set1_epi32(128);
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    __m128i b0, g0, r0, b1, g1, r1;
+    load_bgr8(bgr0 + x * 3, b0, g0, r0);
+    load_bgr8(bgr1 + x * 3, b1, g1, r1);
+    __m128i const l0 = luma8(b0, g0, r0);
+    __m128i const l1 = luma8(b1, g1, r1);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(y0 + x), _mm_packus_epi16(l0, l0));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(y1 + x), _mm_packus_epi16(l1, l1));
+
+    __m128i u = _mm_add_epi32(chroma_sum(b0, g0, r0, 112, -74, -38), chroma_sum(b1, g1, r1, 112, -74, -38));
+    __m128i v = _mm_add_epi32(chroma_sum(b0, g0, r0, -18, -94, 112), chroma_sum(b1, g1, r1, -18, -94, 112));
+    u = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(u, round), 10), offset);
+    v = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(v, round), 10), offset);
+    __m128i const packed = interleave_uv(u, v);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(uv + x), _mm_packus_epi16(packed, packed));
+  }
+  return x;
+}
+
+__attribute__((target("sse4.1"))) int gray_row_sse41(uint8_t const* bgr, int width, uint8_t* gray) {
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    __m128i b, g, r;
+    load_bgr8(bgr + x * 3, b, g, r);
+    __m128i const y = luma8(b, g, r);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(gray + x), _mm_packus_epi16(y, y));
+  }
+  return x;
+}
+
+// the SSE steps on 16 pixels, 8 in each 128 bit lane; the lane wise packs
+// and unpacks keep every lane's pixels together
+__attribute__((target("avx2"))) inline void load_bgr16(uint8_t const* p, __m256i& b, __m256i& g,
+                                                       __m256i& r) {
+  FCWT_BGR_MASKS;
+  __m256i const lo = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const*>(p))),
+      _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + 24)), 1);
+  __m256i const hi = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(p + 16))),
+      _mm_loadl_epi64(reinterpret_cast<__m128i const*>(p + 40)), 1);
+  b = _mm256_or_si256(_mm256_shuffle_epi8(lo, _mm256_broadcastsi128_si256(b_lo)),
+                      _mm256_shuffle_epi8(hi, _mm256_broadcastsi128_si256(b_hi)));
+  g = _mm256_or_si256(_mm256_shuffle_epi8(lo, _mm256_broadcastsi128_si256(g_lo)),
+                      _mm256_shuffle_epi8(hi, _mm256_broadcastsi128_si256(g_hi)));
+  r = _mm256_or_si256(_mm256_shuffle_epi8(lo, _mm256_broadcastsi128_si256(r_lo)),
+                      _mm256_shuffle_epi8(hi, _mm256_broadcastsi128_si256(r_hi)));
+}
+
+__attribute__((target("avx2"))) inline __m256i luma16(__m256i b, __m256i g, __m256i r) {
+  __m256i y = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(66)),
+                               _mm256_mullo_epi16(g, _mm256_set1_epi16(129)));
+  y = _mm256_add_epi16(y, _mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(25)), _mm256_set1_epi16(128)));
+  return _mm256_add_epi16(_mm256_srli_epi16(y, 8), _mm256_set1_epi16(16));
+}
+
+__attribute__((target("avx2"))) inline __m256i chroma_sum16(__m256i b, __m256i g, __m256i r,
+                                                            short cb, short cg, short cr) {
+  return _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(b, _mm256_set1_epi16(cb)),
+                                           _mm256_madd_epi16(g, _mm256_set1_epi16(cg))),
+                          _mm256_madd_epi16(r, _mm256_set1_epi16(cr)));
+}
+
+__attribute__((target("avx2"))) inline __m256i interleave_uv16(__m256i u, __m256i v) {
+  return _mm256_packs_epi32(_mm256_unpacklo_epi32(u, v), _mm256_unpackhi_epi32(u, v));
+}
+
+// the lower 8 bytes of both lanes, next to each other
+__attribute__((target("avx2"))) inline __m128i low_halves(__m256i packed) {
+  return _mm256_castsi256_si128(_mm256_permute4x64_epi64(packed, 0x08));
+}
+
+__attribute__((target("avx2"))) int yuyv_row_avx2(uint8_t const* bgr, int width, uint8_t* yuyv) {
+  __m256i const round = _mm256_set1_epi32(256);
+  __m256i const offset = _mm256_set1_epi32(128);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m256i b, g, r;
+    load_bgr16(bgr + x * 3, b, g, r);
+    __m256i const y = luma16(b, g, r);
+    __m256i const u = _mm256_add_epi32(
+        _mm256_srai_epi32(_mm256_add_epi32(chroma_sum16(b, g, r, 112, -74, -38), round), 9), offset);
+    __m256i const v = _mm256_add_epi32(
+        _mm256_srai_epi32(_mm256_add_epi32(chroma_sum16(b, g, r, -18, -94, 112), round), 9), offset);
+    __m256i const uv = interleave_uv16(u, v);
+    __m256i const out = _mm256_packus_epi16(_mm256_unpacklo_epi16(y, uv), _mm256_unpackhi_epi16(y, uv));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(yuyv + x * 2), out);
+  }
+  return x + yuyv_row_sse41(bgr + x * 3, width - x, yuyv + x * 2);
+}
+
+__attribute__((target("avx2"))) int nv12_rows_avx2(uint8_t const* bgr0, uint8_t const* bgr1, int width,
+                                                    uint8_t* y0, uint8_t* y1, uint8_t* uv) {
+  __m256i const round = _mm256_set1_epi32(512);
+  __m256i const offset = _mm256_set1_epi32(128);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m256i b0, g0, r0, b1, g1, r1;
+    load_bgr16(bgr0 + x * 3, b0, g0, r0);
+    load_bgr16(bgr1 + x * 3, b1, g1, r1);
+    __m256i const l0 = luma16(b0, g0, r0);
+    __m256i const l1 = luma16(b1, g1, r1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(y0 + x), low_halves(_mm256_packus_epi16(l0, l0)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(y1 + x), low_halves(_mm256_packus_epi16(l1, l1)));
+
+    __m256i u = _mm256_add_epi32(chroma_sum16(b0, g0, r0, 112, -74, -38), chroma_sum16(b1, g1, r1, 112, -74, -38));
+    __m256i v = _mm256_add_epi32(chroma_sum16(b0, g0, r0, -18, -94, 112), chroma_sum16(b1, g1, r1, -18, -94, 112));
+    u = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(u, round), 10), offset);
+    v = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(v, round), 10), offset);
+    __m256i const packed = interleave_uv16(u, v);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(uv + x), low_halves(_mm256_packus_epi16(packed, packed)));
+  }
+  return x + nv12_rows_sse41(bgr0 + x * 3, bgr1 + x * 3, width - x, y0 + x, y1 + x, uv + x);
+}
+
+__attribute__((target("avx2"))) int gray_row_avx2(uint8_t const* bgr, int width, uint8_t* gray) {
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m256i b, g, r;
+    load_bgr16(bgr + x * 3, b, g, r);
+    __m256i const y = luma16(b, g, r);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(gray + x), low_halves(_mm256_packus_epi16(y, y)));
+  }
+  return x + gray_row_sse41(bgr + x * 3, width - x, gray + x);
+}
+
+#undef FCWT_BGR_MASKS
+
+#elif FCWT_COLOR_NEON
+
+// vld3 splits 8 pixels into B, G and R
+inline uint8x8_t luma8(uint8x8x3_t const& px) {
+  uint16x8_t y = vmull_u8(px.val[2], vdup_n_u8(66));
+  y = vmlal_u8(y, px.val[1], vdup_n_u8(129));
+  y = vmlal_u8(y, px.val[0], vdup_n_u8(25));
+  return vadd_u8(vshrn_n_u16(vaddq_u16(y, vdupq_n_u16(128)), 8), vdup_n_u8(16));
+}
+
+inline int32x4_t chroma_sum(int16x4_t b, int16x4_t g, int16x4_t r, int16_t cb, int16_t cg, int16_t cr) {
+  return vmlal_n_s16(vmlal_n_s16(vmull_n_s16(b, cb), g, cg), r, cr);
+}
+
+// U0 V0 U1 V1 U2 V2 U3 V3
+inline uint8x8_t interleave_uv(int32x4_t u, int32x4_t v) {
+  int16x4x2_t const uv = vzip_s16(vmovn_s32(u), vmovn_s32(v));
+  return vqmovun_s16(vcombine_s16(uv.val[0], uv.val[1]));
+}
+
+int yuyv_row_neon(uint8_t const* bgr, int width, uint8_t* yuyv) {
+  int32x4_t const round = vdupq_n_s32(256);
+  int32x4_t const offset = vdupq_n_s32(128);
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    uint8x8x3_t const px = vld3_u8(bgr + x * 3);
+    // sums of neighbouring pixels
+    int16x4_t const b = vreinterpret_s16_u16(vpaddl_u8(px.val[0]));
+    int16x4_t const g = vreinterpret_s16_u16(vpaddl_u8(px.val[1]));
+    int16x4_t const r = vreinterpret_s16_u16(vpaddl_u8(px.val[2]));
+    int32x4_t const u = vaddq_s32(vshrq_n_s32(vaddq_s32(chroma_sum(b, g, r, 112, -74, -38), round), 9), offset);
+    int32x4_t const v = vaddq_s32(vshrq_n_s32(vaddq_s32(chroma_sum(b, g, r, -18, -94, 112), round), 9), offset);
+    uint8x8x2_t out;
+    out.val[0] = luma8(px);
+    out.val[1] = interleave_uv(u, v);
+    vst2_u8(yuyv + x * 2, out);  // Y0 U0 Y1 V0 ...
+  }
+  return x;
+}
+
+int nv12_rows_neon(uint8_t const* bgr0, uint8_t const* bgr1, int width, uint8_t* y0, uint8_t* y1,
+                   uint8_t* uv) {
+  int32x4_t const round = vdupq_n_s32(512);
+  int32x4_t const offset = vdupq_n_s32(128);
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    uint8x8x3_t const p0 = vld3_u8(bgr0 + x * 3);
+    uint8x8x3_t const p1 = vld3_u8(bgr1 + x * 3);
+    vst1_u8(y0 + x, luma8(p0));
+    vst1_u8(y1 + x, luma8(p1));
+    // sums of 2x2 pixels
+    int16x4_t const b = vreinterpret_s16_u16(vpadal_u8(vpaddl_u8(p0.val[0]), p1.val[0]));
+    int16x4_t const g = vreinterpret_s16_u16(vpadal_u8(vpaddl_u8(p0.val[1]), p1.val[1]));
+    int16x4_t const r = vreinterpret_s16_u16(vpadal_u8(vpaddl_u8(p0.val[2]), p1.val[2]));
+    int32x4_t const u = vaddq_s32(vshrq_n_s32(vaddq_s32(chroma_sum(b, g, r, 112, -74, -38), round), 10), offset);
+    int32x4_t const v = vaddq_s32(vshrq_n_s32(vaddq_s32(chroma_sum(b, g, r, -18, -94, 112), round), 10), offset);
+    vst1_u8(uv + x, interleave_uv(u, v));
+  }
+  return x;
+}
+
+int gray_row_neon(uint8_t const* bgr, int width, uint8_t* gray) {
+  int x = 0;
+  for (; x + 8 <= width; x += 8) vst1_u8(gray + x, luma8(vld3_u8(bgr + x * 3)));
+  return x;
+}
+
+#endif
+
+color_kernels const scalar_kernels = {simd_level::scalar, bgr_to_yuyv_rows<yuyv_row_none>,
+                                      bgr_to_nv12_rows<nv12_rows_none>, bgr_to_gray_rows<gray_row_none>};
+#if FCWT_COLOR_X86
+color_kernels const sse41_kernels = {simd_level::sse41, bgr_to_yuyv_rows<yuyv_row_sse41>,
+                                     bgr_to_nv12_rows<nv12_rows_sse41>, bgr_to_gray_rows<gray_row_sse41>};
+color_kernels const avx2_kernels = {simd_level::avx2, bgr_to_yuyv_rows<yuyv_row_avx2>,
+                                    bgr_to_nv12_rows<nv12_rows_avx2>, bgr_to_gray_rows<gray_row_avx2>};
+#elif FCWT_COLOR_NEON
+color_kernels const neon_kernels = {simd_level::neon, bgr_to_yuyv_rows<yuyv_row_neon>,
+                                    bgr_to_nv12_rows<nv12_rows_neon>, bgr_to_gray_rows<gray_row_neon>};
+#endif
+
+}  // namespace
+
+char const* to_string(simd_level const level) {
+  switch (level) {
+    case simd_level::scalar:
+      return "scalar";
+    case simd_level::sse41:
+      return "sse4.1";
+    case simd_level::avx2:
+      return "avx2";
+    case simd_level::neon:
+      return "neon";
+  }
+  FCWT_UNREACHABLE;
+}
+
+color_kernels const* color_kernels_for(simd_level const level) {
+  switch (level) {
+    case simd_level::scalar:
+      return &scalar_kernels;
+#if FCWT_COLOR_X86
+    case simd_level::sse41:
+      return __builtin_cpu_supports("sse4.1") ? &sse41_kernels : nullptr;
+    case simd_level::avx2:
+      return __builtin_cpu_supports("avx2") ? &avx2_kernels : nullptr;
+#elif FCWT_COLOR_NEON
+    case simd_level::neon:
+      return &neon_kernels;
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+color_kernels const& best_color_kernels() {
+  static color_kernels const* const best = []() -> color_kernels const* {
+    simd_level const levels[] = {simd_level::avx2, simd_level::neon, simd_level::sse41};
+    for (simd_level const level : levels)
+      if (color_kernels const* kernels = color_kernels_for(level)) return kernels;
+    return &scalar_kernels;
+  }();
+  return *best;
+}
+
+}  // namespace fcwt
@@ -11,6 +11,8 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -26,8 +28,6 @@
 
 namespace fcwt {
 
-const char* const server_ipv4_addr = "192.168.0.1";
-
 namespace {
 #if FCWT_USE_WINSOCK
 	void print_socket_api_error()
@@ -129,26 +129,47 @@ static void set_nonblocking_io(native_socket sockfd, bool nonblocking)
 #endif
 }
 
-sock connect_to_camera(int port) {
+sock connect_to_camera(int port, char const* address, char const* device) {
   // TODO: proper error handling
 
   api_init();
 
+  if (!address) address = default_camera_address;
+
   const native_socket sockfd = socket(AF_INET, SOCK_STREAM, 0);
   if (sockfd < 0) fatal_error("Failed to create socket\n");
 
+  if (device && device[0]) {
+#ifdef SO_BINDTODEVICE
+    // every camera has the same address, each on its own interface
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BINDTODEVICE, device,
+                   static_cast<socklen_t>(strlen(device) + 1)) != 0) {
+      log(LOG_ERROR, string_format("Failed to bind to %s: %s", device, strerror(errno)));
+      close_socket(sockfd);
+      return 0;
+    }
+#else
+    log(LOG_WARN, string_format("Binding to %s not supported, using the default route", device));
+#endif
+  }
+
   set_nonblocking_io(sockfd, true);  // for timeout
 
   sockaddr_in sa = {};
   sa.sin_family = AF_INET;
   sa.sin_port = htons(port);
 #if FCWT_USE_BSD_SOCKETS
-  inet_pton(AF_INET, server_ipv4_addr, &sa.sin_addr);
+  int const parsed = inet_pton(AF_INET, address, &sa.sin_addr);
 #elif FCWT_USE_WINSOCK
-  InetPton(AF_INET, server_ipv4_addr, &sa.sin_addr);
+  int const parsed = InetPton(AF_INET, address, &sa.sin_addr);
 #else
 #error need inet_pton
 #endif
+  if (parsed != 1) {
+    log(LOG_ERROR, string_format("Invalid camera address %s", address));
+    close_socket(sockfd);
+    return 0;
+  }
   connect(sockfd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa));
 
   // timeout handling
@@ -166,7 +187,7 @@ sock connect_to_camera(int port) {
 
     if (so_error == 0) {
       log(LOG_INFO, string_format("Connection esatablished %s:%d (%lld)",
-                                  server_ipv4_addr, port, (long long) sockfd));
+                                  address, port, (long long) sockfd));
       set_nonblocking_io(sockfd, false);
       return sockfd;
     }
@@ -188,6 +209,12 @@ static uint32_t from_fuji_size_prefix(uint32_t sizeBytes) {
   return sizeBytes;
 }
 
+void set_no_delay(native_socket sockfd, bool no_delay) {
+  int const flag = no_delay ? 1 : 0;
+  if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char const*>(&flag), sizeof(flag)) != 0)
+    log(LOG_WARN, string_format("Failed to set TCP_NODELAY: %s", strerror(errno)));
+}
+
 void send_data(native_socket sockfd, void const* data, size_t sizeBytes) {
   bool retry = false;
   do {
@@ -221,6 +248,48 @@ void receive_data(native_socket sockfd, void* data, size_t sizeBytes) {
   }
 }
 
+bool wait_readable(native_socket sockfd, int timeoutMs) {
+  fd_set fdset;
+  FD_ZERO(&fdset);
+  FD_SET(sockfd, &fdset);
+  struct timeval tv = {};
+  tv.tv_sec = timeoutMs / 1000;
+  tv.tv_usec = (timeoutMs % 1000) * 1000;
+  return select(static_cast<int>(sockfd + 1), &fdset, NULL, NULL, &tv) > 0;
+}
+
+bool wait_readable(std::vector<native_socket> const& sockets, int timeoutMs,
+                   std::vector<native_socket>& readable) {
+  readable.clear();
+  fd_set fdset;
+  FD_ZERO(&fdset);
+  native_socket highest = 0;
+  for (native_socket const sockfd : sockets) {
+    FD_SET(sockfd, &fdset);
+    highest = std::max(highest, sockfd);
+  }
+  struct timeval tv = {};
+  tv.tv_sec = timeoutMs / 1000;
+  tv.tv_usec = (timeoutMs % 1000) * 1000;
+  if (select(static_cast<int>(highest + 1), &fdset, NULL, NULL, &tv) <= 0) return false;
+
+  for (native_socket const sockfd : sockets)
+    if (FD_ISSET(sockfd, &fdset)) readable.push_back(sockfd);
+  return !readable.empty();
+}
+
+long receive_available(native_socket sockfd, void* data, size_t sizeBytes) {
+  for (;;) {
+#if FCWT_USE_BSD_SOCKETS
+    ssize_t const result = read(sockfd, data, sizeBytes);
+#elif FCWT_USE_WINSOCK
+    int const result = recv(sockfd, static_cast<char*>(data), static_cast<int>(sizeBytes), 0);
+#endif
+    if (result >= 0) return static_cast<long>(result);
+    if (errno != EINTR) return -1;
+  }
+}
+
 void fuji_send(native_socket sockfd, void const* data, size_t sizeBytes) {
   std::vector<uint8_t> msg(sizeof(uint32_t) + sizeBytes);
   *((uint32_t *)msg.data()) = to_fuji_size_prefix(msg.size());
@@ -242,4 +311,19 @@ size_t fuji_receive(native_socket sockfd, void* data, size_t sizeBytes) {
   return size;
 }
 
+size_t fuji_receive(native_socket sockfd, std::vector<uint8_t>& data) {
+  uint32_t size = 0;
+  receive_data(sockfd, &size, sizeof(size));
+  size = from_fuji_size_prefix(size);
+  if (size < sizeof(size)) {
+    log(LOG_WARN, "fuji_receive, 0x invalid message");
+    data.clear();
+    return 0;
+  }
+  size -= sizeof(size);
+  data.resize(size);
+  receive_data(sockfd, data.data(), size);
+  return size;
+}
+
 }  // namespace fcwt
@@ -1,8 +1,11 @@
 #include "commands.hpp"
+#include "capability_cache.hpp"
 
 #include "comm.hpp"
 #include "log.hpp"
 
+#include <algorithm>
+
 namespace fcwt {
 
 namespace {
@@ -220,14 +223,16 @@ capability parse_capability(uint8_t const* data, size_t const size) {
     return cap;
 }
 
+}  // namespace
+
 std::vector<capability> parse_camera_caps(void const* data, size_t const size) {
   std::vector<capability> caps;
   size_t remainingBytes = size;
   uint8_t const* bytes = static_cast<uint8_t const*>(data);
-  if (remainingBytes < 12) return caps;
+  if (remainingBytes < 4) return caps;
 
-  bytes += 12;  // 12 bytes unknown
-  remainingBytes -= 12;
+  bytes += 4;  // 4 bytes unknown (after the message header)
+  remainingBytes -= 4;
 
   while (remainingBytes > 0) {
     // sub-message size
@@ -261,7 +266,34 @@ std::vector<capability> parse_camera_caps(void const* data, size_t const size) {
   return caps;
 }
 
-}  // namespace
+void read_current_values(void const* data, size_t const size, std::vector<capability>& caps) {
+  uint8_t const* bytes = static_cast<uint8_t const*>(data);
+  uint8_t const* const end = bytes + size;
+  if (size < 4) return;
+  bytes += 4;  // 4 bytes unknown, as in parse_camera_caps
+
+  // every sub-message starts with code, data type, get/set flag, default
+  // and current value
+  while (end - bytes >= 4) {
+    uint32_t subMsgSize = 0;
+    memcpy(&subMsgSize, bytes, sizeof(subMsgSize));
+    if (subMsgSize < 4 || static_cast<size_t>(end - bytes) < subMsgSize) break;
+    uint8_t const* const sub = bytes + 4;
+    bytes += subMsgSize;
+
+    uint16_t code = 0, type = 0;
+    if (subMsgSize - 4 < 5) continue;
+    memcpy(&code, sub, 2);
+    memcpy(&type, sub + 2, 2);
+    size_t const value_size = data_type_size(static_cast<data_types>(type));
+    if (subMsgSize - 4 < 5 + 2 * value_size) continue;
+    for (capability& cap : caps) {
+      if (cap.property_code != code) continue;
+      cap.current_value = 0;
+      memcpy(&cap.current_value, sub + 5 + value_size, value_size);
+    }
+  }
+}
 
 bool update_setting(native_socket sockfd, property_codes code, uint32_t value) {
   if (sockfd <= 0) return false;
@@ -275,10 +307,26 @@ bool update_setting(native_socket sockfd, property_codes code, uint32_t value) {
   return fuji_twopart_message(sockfd, msg_1, msg_2);
 }
 
+static_message<4> make_focus_point_message(auto_focus_point point) {
+  return make_static_message(message_type::focus_point, point.y, point.x, 0x02, 0x03);
+}
+
+static_message<4> make_aperture_step_message(fnumber_update_direction dir) {
+  return make_static_message(message_type::aperture, dir == fnumber_increment ? 1 : 0, 0, 0, 0);
+}
+
+static_message<4> make_shutter_speed_step_message(ss_update_direction dir) {
+  return make_static_message(message_type::shutter_speed, dir == ss_increment ? 1 : 0, 0, 0, 0);
+}
+
+static_message<4> make_exposure_step_message(exp_update_direction dir) {
+  return make_static_message(
+      message_type::exposure_correction, dir == exp_increment ? 1 : 0, 0, 0, 0);
+}
+
 bool update_setting(native_socket sockfd, auto_focus_point point) {
   if (sockfd <= 0) return false;
-  auto const msg = make_static_message(message_type::focus_point, point.y, point.x, 0x02, 0x03);
-  return fuji_message(sockfd, msg);
+  return fuji_message(sockfd, make_focus_point_message(point));
 }
 
 bool unlock_focus(native_socket sockfd) {
@@ -288,83 +336,216 @@ bool unlock_focus(native_socket sockfd) {
 
 bool update_setting(native_socket sockfd, fnumber_update_direction dir) {
   if (sockfd <= 0) return false;
-  auto const msg = make_static_message(
-      message_type::aperture, dir == fnumber_increment ? 1 : 0, 0, 0, 0);
-  return fuji_message(sockfd, msg);
+  return fuji_message(sockfd, make_aperture_step_message(dir));
 }
 
 bool update_setting(native_socket sockfd, ss_update_direction dir) {
   if (sockfd <= 0) return false;
-  auto const msg = make_static_message(
-      message_type::shutter_speed, dir == ss_increment ? 1 : 0, 0, 0, 0);
-  return fuji_message(sockfd, msg);
+  return fuji_message(sockfd, make_shutter_speed_step_message(dir));
 }
 
 bool update_setting(native_socket sockfd, exp_update_direction dir) {
   if (sockfd <= 0) return false;
-  auto const msg = make_static_message(
-      message_type::exposure_correction, dir == exp_increment ? 1 : 0, 0, 0, 0);
-  return fuji_message(sockfd, msg);
+  return fuji_message(sockfd, make_exposure_step_message(dir));
+}
+
+namespace {
+
+typedef std::chrono::steady_clock steady;
+
+// replies to the handshake steps are checked in the order they were sent
+class handshake {
+  struct step {
+    size_t profile_index;
+    uint32_t id;
+    std::vector<uint8_t>* data;
+  };
+
+  native_socket const sockfd;
+  bool const pipeline;
+  steady::time_point const start;
+  connect_profile& profile;
+  std::vector<step> pending;
+  bool success = true;
+
+ public:
+  handshake(native_socket sockfd, bool pipeline, connect_profile& profile)
+      : sockfd(sockfd), pipeline(pipeline), start(steady::now()), profile(profile) {}
+
+  template <size_t N>
+  void send(char const* name, static_message<N> const& msg, std::vector<uint8_t>* data = nullptr) {
+    fuji_send(sockfd, msg);
+    sent(name, msg.id, data);
+  }
+
+  template <size_t N1, size_t N2>
+  void send(char const* name, static_message<N1> const& msg1, static_message<N2> const& msg2) {
+    fuji_send(sockfd, msg1);
+    fuji_send(sockfd, msg2);
+    sent(name, msg2.id, nullptr);
+  }
+
+  void sent(char const* name, uint32_t id, std::vector<uint8_t>* data) {
+    connect_step s;
+    s.name = name;
+    s.sent = elapsed();
+    profile.steps.push_back(s);
+    step const p = {profile.steps.size() - 1, id, data};
+    pending.push_back(p);
+    if (!pipeline) receive();
+  }
+
+  // true if all steps so far succeeded
+  bool receive() {
+    for (step const& p : pending) {
+      connect_step& s = profile.steps[p.profile_index];
+      s.success = fuji_receive_response(sockfd, p.id, p.data);
+      s.done = elapsed();
+      if (!s.success) {
+        log(LOG_ERROR, string_format("init_control_connection: %s failed", s.name));
+        success = false;
+      }
+    }
+    pending.clear();
+    profile.total = elapsed();
+    return success;
+  }
+
+  std::chrono::microseconds elapsed() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(steady::now() - start);
+  }
+};
+
+// PTP/IP style init ack: 4 bytes type (2), 4 bytes connection number,
+// 16 bytes guid, UTF-16 friendly name
+void parse_hello_response(uint8_t const* data, size_t size, camera_identity& camera) {
+  uint32_t type = 0;
+  if (size < 24) return;
+  memcpy(&type, data, sizeof(type));
+  if (type != 2) return;
+
+  memcpy(camera.guid.data(), data + 8, camera.guid.size());
+  camera.name.clear();
+  for (size_t i = 24; i + 1 < size; i += 2) {
+    uint16_t c = 0;
+    memcpy(&c, data + i, sizeof(c));
+    if (c == 0) break;
+    camera.name.push_back(c < 0x80 ? static_cast<char>(c) : '?');
+  }
+}
+
+}  // namespace
+
+std::string camera_identity::key() const {
+  static std::array<uint8_t, 16> const unknown = {{}};
+  if (guid == unknown && name.empty()) return std::string();
+  return hex_format(guid.data(), guid.size()).append(name);
+}
+
+void print(connect_profile const& profile) {
+  printf("connect profile (%s):\n", profile.camera.name.c_str());
+  for (connect_step const& s : profile.steps) {
+    printf("\t%-20s sent %8.1f ms  done %8.1f ms %s\n", s.name, s.sent.count() / 1000.0,
+           s.done.count() / 1000.0, s.success ? "" : "FAILED");
+  }
+  printf("\ttotal %.1f ms\n", profile.total.count() / 1000.0);
 }
 
 bool init_control_connection(native_socket const sockfd, char const* deviceName,
-                             std::vector<capability>* caps) {
+                             std::vector<capability>* caps,
+                             connection_mode const mode,
+                             connect_profile* profile,
+                             bool const pipeline,
+                             capability_cache* cache) {
   if (sockfd <= 0) return false;
 
   if (!deviceName || !deviceName[0]) deviceName = "CameraClient";
 
+  connect_profile local_profile;
+  if (!profile) profile = &local_profile;
+  *profile = connect_profile();
+  handshake steps(sockfd, pipeline, *profile);
+
   log(LOG_INFO, string_format("init_control_connection (socket %lld)",
                               static_cast<long long>(sockfd)));
   auto const reg_msg = generate_registration_message(deviceName);
   log(LOG_INFO, "send hello");
+  connect_step hello;
+  hello.name = "hello";
+  hello.sent = steps.elapsed();
   fuji_send(sockfd, &reg_msg, sizeof(reg_msg));
 
-  uint8_t buffer[1024];
+  // the hello has to succeed before anything else can be sent
+  std::vector<uint8_t> buffer;
   size_t const receivedBytes = fuji_receive(sockfd, buffer);
+  hello.done = steps.elapsed();
   uint8_t const message1_response_error[] = {0x05, 0x00, 0x00, 0x00,
                                              0x19, 0x20, 0x00, 0x00};
 
-  if (receivedBytes == sizeof(message1_response_error) &&
-      memcmp(buffer, message1_response_error, receivedBytes) == 0) {
+  hello.success = !(receivedBytes == sizeof(message1_response_error) &&
+                    memcmp(buffer.data(), message1_response_error, receivedBytes) == 0);
+  profile->steps.push_back(hello);
+  profile->total = hello.done;
+  if (!hello.success) {
+    log(LOG_ERROR, "init_control_connection: camera refused the connection");
     return false;
   }
+  parse_hello_response(buffer.data(), receivedBytes, profile->camera);
+  std::string const camera = profile->camera.key();
+  bool const cached = cache && caps && mode == connection_mode_remote &&
+                      cache->find(camera, *caps);
 
-  fuji_message(
-      sockfd, make_static_message(message_type::start, 0x01, 0x00, 0x00, 0x00));
+  steps.send("start", make_static_message(message_type::start, 0x01, 0x00, 0x00, 0x00));
 
+  // 'receive mode': 0x08, 'browse mode': 0x08, 'geo mode': 0x0a
+  uint8_t const mode4 = mode == connection_mode_remote ? 0x05 : mode == connection_mode_geo ? 0x0a : 0x08;
   auto const msg4_1 =
       make_static_message(message_type::two_part, 0x01, 0xdf, 0x00, 0x00);
-  auto const msg4_2 = make_static_message_followup(msg4_1, 0x05, 0x00);
-  fuji_twopart_message(sockfd, msg4_1, msg4_2);
+  auto const msg4_2 = make_static_message_followup(msg4_1, mode4, 0x00);
+  steps.send("0xdf01 two_part", msg4_1, msg4_2);
 
   // 'receive mode': 0x21, 'browse mode': 0x22, 'geo mode': 0x31, 'remote mode':
   // 0x24
-  fuji_send(sockfd, make_static_message(message_type::single_part, 0x24, 0xdf,
-                                        0x00, 0x00));
-  fuji_receive_log(sockfd, buffer);
-  fuji_receive_log(sockfd, buffer);
+  std::vector<uint8_t> mode_state;
+  steps.send("0xdf24 single_part",
+             make_static_message(message_type::single_part, mode, 0xdf, 0x00, 0x00),
+             &mode_state);
 
   // 'receive mode': 0x21, 'browse mode': 0x22, 'geo mode': 0x31
   auto const msg6_1 =
-      make_static_message(message_type::two_part, 0x24, 0xdf, 0x00, 0x00);
+      make_static_message(message_type::two_part, mode, 0xdf, 0x00, 0x00);
   // 'receive mode', 'browse mode': 0x03 0x00 0x00 0x00, 'geo mode': 0x02, 0x00,
   // 0x00, 0x00
-  auto const msg6_2 =
-      make_static_message_followup(msg6_1, 0xff, 0x00, 0x02, 0x00);
-  fuji_twopart_message(sockfd, msg6_1, msg6_2);
-
-  fuji_send(sockfd, make_static_message(message_type::camera_capabilities));
-  auto size = fuji_receive_log(sockfd, buffer);
-
-  *caps = parse_camera_caps(buffer, size);
+  std::array<uint8_t, 4> mode6 = {{0xff, 0x00, 0x02, 0x00}};
+  if (mode == connection_mode_geo)
+    mode6 = {{0x02, 0x00, 0x00, 0x00}};
+  else if (mode != connection_mode_remote)
+    mode6 = {{0x03, 0x00, 0x00, 0x00}};
+  auto const msg6_2 = make_static_message_followup(msg6_1, mode6);
+  steps.send("0xdf24 two_part", msg6_1, msg6_2);
+
+  std::vector<uint8_t> caps_data;
+  if (mode == connection_mode_remote) {
+    steps.send("camera_capabilities", make_static_message(message_type::camera_capabilities),
+               &caps_data);
+    steps.send("camera_remote",
+               make_static_message(message_type::camera_remote, 0x00, 0x00, 0x00,
+                                   0x00, 0x00, 0x00, 0x00, 0x00));
+  }
 
-  fuji_receive_log(sockfd, buffer);
+  bool const success = steps.receive();
+  log(LOG_DEBUG, std::string("mode state ").append(hex_format(mode_state.data(), mode_state.size())));
 
-  fuji_message(
-      sockfd, make_static_message(message_type::camera_remote, 0x00, 0x00, 0x00,
-                                  0x00, 0x00, 0x00, 0x00, 0x00));
+  if (caps && mode == connection_mode_remote) {
+    if (cached)
+      read_current_values(caps_data.data(), caps_data.size(), *caps);
+    else
+      *caps = parse_camera_caps(caps_data.data(), caps_data.size());
+  }
+  if (cache && success && mode == connection_mode_remote)
+    cache->refresh(camera, std::move(caps_data));
 
-  return true;
+  return success;
 }
 
 void terminate_control_connection(native_socket sockfd) {
@@ -401,79 +582,73 @@ bool stop_record(native_socket const sockfd, uint32_t start_id) {
 }
 
 bool shutter(native_socket const sockfd, native_socket const sockfd2, const char* thumbnail) {
+  return shutter_release(sockfd) && shutter_complete(sockfd, sockfd2, thumbnail);
+}
+
+bool shutter_release(native_socket const sockfd) {
   if (sockfd <= 0) return false;
 
   log(LOG_INFO, "shutter");
-  bool result = fuji_message(
+  return fuji_message(
       sockfd, make_static_message(message_type::shutter, 0x00, 0x00, 0x00, 0x00,
                                   0x00, 0x00, 0x00, 0x00));
-  if (!result)
-    return false;
-
-  uint8_t buffer[1024 * 1024];
-  uint32_t receivedBytes = 0;
-
-  if (sockfd2) {
-    receivedBytes = fuji_receive(sockfd2, buffer);
-    log(LOG_DEBUG, string_format("received %d bytes (async1) ", receivedBytes).append(hex_format(buffer, receivedBytes)));
+}
 
-    receivedBytes = fuji_receive(sockfd2, buffer);
-    log(LOG_DEBUG, string_format("received %d bytes (async2) ", receivedBytes).append(hex_format(buffer, receivedBytes)));
-  }
+namespace {
 
-  uint32_t lastMsgId = 0;
-  auto const reqImg = make_static_message(message_type::camera_last_image);
-  lastMsgId = reqImg.id;
-  fuji_send(sockfd, reqImg);
+class discard_sink : public data_sink {
+ public:
+  void write(uint8_t const*, size_t) override {}
+};
 
-  receivedBytes = fuji_receive(sockfd, buffer);
-  log(LOG_INFO, string_format("received %d bytes (thumbnail)", receivedBytes));
-  if (thumbnail && sockfd2 && receivedBytes > 8) {
-    log(LOG_INFO, string_format("writing to %s", thumbnail));
-    if (FILE* out = fopen(thumbnail, "wb")) {
-      fwrite(buffer + 8, receivedBytes - 8, 1, out);
-      fclose(out);
-    }
-  }
+}  // namespace
 
-  receivedBytes = fuji_receive(sockfd, buffer);
-  log(LOG_DEBUG, string_format("received %d bytes (response) ", receivedBytes).append(hex_format(buffer, receivedBytes)));
+bool shutter_complete(native_socket const sockfd, native_socket const sockfd2, const char* thumbnail) {
+  // the thumbnail goes straight to the file instead of through a buffer
+  discard_sink discard;
+  std::shared_ptr<data_sink> const file = thumbnail && sockfd2 ? file_sink(thumbnail) : nullptr;
+  return shutter_complete(sockfd, sockfd2, file ? *file : discard);
+}
 
-  const bool success = is_success_response(lastMsgId, buffer, receivedBytes);
+bool shutter_complete(native_socket const sockfd, native_socket const sockfd2, data_sink& thumbnail) {
+  if (sockfd <= 0) return false;
 
+  std::vector<uint8_t> event;
   if (sockfd2) {
-    receivedBytes = fuji_receive(sockfd2, buffer);
-    log(LOG_DEBUG, string_format("received %d bytes (async3) ", receivedBytes).append(hex_format(buffer, receivedBytes)));
+    fuji_receive_log(sockfd2, event);  // async1
+    fuji_receive_log(sockfd2, event);  // async2
   }
 
+  auto const reqImg = make_static_message(message_type::camera_last_image);
+  fuji_send(sockfd, reqImg);
+  const bool success = fuji_receive_response(sockfd, reqImg.id, thumbnail);
+
+  if (sockfd2)
+    fuji_receive_log(sockfd2, event);  // async3
+
   return success;
 }
 
-bool current_settings(native_socket sockfd, current_properties& settings) {
-  auto const msg = generate<status_request_message>();
-  fuji_send(sockfd, &msg, sizeof(msg));
-  uint8_t buf[1024];
-  size_t receivedBytes = fuji_receive(sockfd, buf);
-
-  if (receivedBytes < 8)
+bool parse_current_settings(uint8_t const* data, size_t const size, current_properties& settings) {
+  if (size < 2)
     return false;
 
-  log(LOG_DEBUG2, string_format("Status: %zd bytes ", receivedBytes).append(hex_format(buf, receivedBytes)));
-
-  uint8_t* ptr = buf;
-  ptr += 8; // skip header
   uint16_t numSettings;
-  memcpy(&numSettings, ptr, 2);
-  ptr += 2;
+  memcpy(&numSettings, data, 2);
+  uint8_t const* ptr = data + 2;
+  if (numSettings > (size - 2) / 6) {
+    log(LOG_WARN, string_format("Status: %d settings in %zd bytes", numSettings, size));
+    numSettings = static_cast<uint16_t>((size - 2) / 6);
+  }
 
   settings.camera_order.clear();
 
   for (uint16_t i = 0; i < numSettings; ++i) {
     property_codes code;
     uint32_t value;
-    uint8_t* data = ptr + i * 6;
-    memcpy(&code, data, 2);
-    memcpy(&value, data + 2, 4);
+    uint8_t const* setting = ptr + i * 6;
+    memcpy(&code, setting, 2);
+    memcpy(&value, setting + 2, 4);
 
     settings.camera_order.push_back(code);
     settings.values[code] = value;
@@ -486,6 +661,23 @@ bool current_settings(native_socket sockfd, current_properties& settings) {
     log(LOG_DEBUG2, log_setting.append(to_string(code)));
   }
 
+  return true;
+}
+
+bool current_settings(native_socket sockfd, current_properties& settings) {
+  auto const msg = generate<status_request_message>();
+  fuji_send(sockfd, &msg, sizeof(msg));
+  uint8_t buf[1024];
+  size_t receivedBytes = fuji_receive(sockfd, buf);
+
+  if (receivedBytes < 8)
+    return false;
+
+  log(LOG_DEBUG2, string_format("Status: %zd bytes ", receivedBytes).append(hex_format(buf, receivedBytes)));
+
+  // skip header
+  parse_current_settings(buf + 8, std::min(receivedBytes, sizeof(buf)) - 8, settings);
+
   receivedBytes = fuji_receive(sockfd, buf);
   log(LOG_DEBUG2, std::string("received bytes@@@").append(hex_format(buf, receivedBytes)));
 
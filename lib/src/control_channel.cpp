@@ -0,0 +1,383 @@
+#include "control_channel.hpp"
+
+#include "io_reactor.hpp"
+#include "log.hpp"
+
+#include <string.h>
+#include <algorithm>
+
+namespace fcwt {
+
+namespace {
+
+const uint16_t response_code_ok = 0x2001;
+
+}  // namespace
+
+control_channel::control_channel(native_socket const sockfd)
+    : sockfd(sockfd), reactor(nullptr), stopping(false) {
+  reader = std::thread([this]() { read_loop(); });
+}
+
+control_channel::control_channel(native_socket const sockfd, io_reactor& reactor)
+    : sockfd(sockfd), reactor(&reactor), stopping(false) {
+  reactor.add(sockfd, [this](uint8_t const* data, size_t size) { return feed(data, size); },
+              [this]() { fail_all(); });
+}
+
+control_channel::~control_channel() {
+  stopping = true;
+  if (reader.joinable()) reader.join();
+  if (reactor) {
+    reactor->remove(sockfd);
+    fail_all();
+  }
+}
+
+void control_channel::log_send(message_type type, void const* msg, size_t size) {
+  std::string log_msg = string_format("send: %s(%d) ", to_string(type), static_cast<int>(type));
+  log(LOG_DEBUG, log_msg.append(hex_format(msg, size)));
+}
+
+void control_channel::submit(uint32_t const id, void const* part1, size_t const size1,
+                             void const* part2, size_t const size2,
+                             std::shared_ptr<data_sink> sink, completion_handler done) {
+  pending p;
+  p.id = id;
+  p.sink = std::move(sink);
+  p.done = std::move(done);
+
+  // write order is reply order, the request is queued before it is sent
+  std::lock_guard<std::mutex> const write_lock(write_mutex);
+  bool queued = false;
+  {
+    std::lock_guard<std::mutex> const lock(pending_mutex);
+    if (!stopping) {
+      p.result.sent = std::chrono::steady_clock::now();
+      in_flight.push_back(std::move(p));
+      queued = true;
+    }
+  }
+
+  if (!queued) {
+    log(LOG_ERROR, "control_channel: not running");
+    if (p.sink) p.sink->finish(false);
+    if (p.done) p.done(p.result);
+    return;
+  }
+
+  fuji_send(sockfd, part1, size1);
+  if (part2)
+    fuji_send(sockfd, part2, size2);
+}
+
+std::future<response> control_channel::submit_future(uint32_t const id, void const* part1,
+                                                      size_t const size1, void const* part2,
+                                                      size_t const size2,
+                                                      std::shared_ptr<data_sink> sink) {
+  auto const promise = std::make_shared<std::promise<response>>();
+  std::future<response> result = promise->get_future();
+  submit(id, part1, size1, part2, size2, std::move(sink),
+         [promise](response& r) { promise->set_value(std::move(r)); });
+  return result;
+}
+
+size_t control_channel::pending_count() {
+  std::lock_guard<std::mutex> const lock(pending_mutex);
+  return in_flight.size();
+}
+
+void control_channel::wait_idle() {
+  std::unique_lock<std::mutex> lock(pending_mutex);
+  idle_cv.wait(lock, [this]() { return in_flight.empty(); });
+}
+
+void control_channel::read_loop() {
+  std::vector<uint8_t> buffer(64 * 1024);
+  while (!stopping) {
+    if (!wait_readable(sockfd, 100)) continue;
+
+    long const receivedBytes = receive_available(sockfd, buffer.data(), buffer.size());
+    if (receivedBytes <= 0) {
+      log(LOG_ERROR, "control_channel: connection closed");
+      break;
+    }
+    if (!feed(buffer.data(), static_cast<size_t>(receivedBytes)))
+      break;
+  }
+  fail_all();
+}
+
+// Messages are a 4 byte size prefix, the 8 byte header (phase, type or
+// response code, id) and the payload, which is passed on as it arrives.
+bool control_channel::feed(uint8_t const* data, size_t size) {
+  while (size > 0) {
+    if (frame_header_bytes < sizeof(frame_header)) {
+      size_t const n = std::min(size, sizeof(frame_header) - frame_header_bytes);
+      memcpy(frame_header + frame_header_bytes, data, n);
+      frame_header_bytes += n;
+      data += n;
+      size -= n;
+      if (frame_header_bytes < sizeof(frame_header)) break;
+
+      uint32_t total = 0;
+      memcpy(&total, frame_header, sizeof(total));
+      if (total < sizeof(frame_header)) {
+        log(LOG_ERROR, string_format("control_channel: invalid message size %u", total));
+        return false;
+      }
+      payload_remaining = total - sizeof(frame_header);
+    } else {
+      size_t const n = std::min(size, payload_remaining);
+      uint16_t phase = 0;
+      memcpy(&phase, frame_header + 4, sizeof(phase));
+
+      if (phase == message_phase_data) {
+        pending* front = nullptr;
+        {
+          std::lock_guard<std::mutex> const lock(pending_mutex);
+          if (!in_flight.empty()) front = &in_flight.front();
+        }
+        if (!front)
+          log(LOG_WARN, "control_channel: data without pending request");
+        else if (front->sink)
+          front->sink->write(data, n);
+        else
+          front->result.data.insert(front->result.data.end(), data, data + n);
+      }
+
+      data += n;
+      size -= n;
+      payload_remaining -= n;
+    }
+
+    if (frame_header_bytes == sizeof(frame_header) && payload_remaining == 0) {
+      uint16_t phase = 0, code = 0;
+      uint32_t id = 0;
+      memcpy(&phase, frame_header + 4, sizeof(phase));
+      memcpy(&code, frame_header + 6, sizeof(code));
+      memcpy(&id, frame_header + 8, sizeof(id));
+      frame_header_bytes = 0;
+
+      if (phase == message_phase_response)
+        complete_front(code == response_code_ok, code, id);
+      else if (phase != message_phase_data)
+        log(LOG_WARN, string_format("control_channel: ignoring message phase %d", phase));
+    }
+  }
+  return true;
+}
+
+void control_channel::complete_front(bool success, uint16_t const code, uint32_t const id) {
+  pending p;
+  {
+    std::lock_guard<std::mutex> const lock(pending_mutex);
+    if (in_flight.empty()) {
+      log(LOG_WARN, string_format("control_channel: unexpected response for %u", id));
+      return;
+    }
+    p = std::move(in_flight.front());
+    in_flight.pop_front();
+    if (in_flight.empty()) idle_cv.notify_all();
+  }
+
+  if (p.id != id) {
+    log(LOG_ERROR, string_format("control_channel: response for %u while waiting for %u", id, p.id));
+    success = false;
+  } else if (!success) {
+    log(LOG_WARN, string_format("control_channel: request %u failed (0x%04x)", id, code));
+  }
+
+  p.result.success = success;
+  p.result.code = code;
+  p.result.completed = std::chrono::steady_clock::now();
+  if (p.sink) p.sink->finish(success);
+  if (p.done) p.done(p.result);
+}
+
+void control_channel::fail_all() {
+  std::deque<pending> failed;
+  {
+    std::lock_guard<std::mutex> const lock(pending_mutex);
+    stopping = true;
+    failed.swap(in_flight);
+    idle_cv.notify_all();
+  }
+
+  for (pending& p : failed) {
+    p.result.completed = std::chrono::steady_clock::now();
+    if (p.sink) p.sink->finish(false);
+    if (p.done) p.done(p.result);
+  }
+}
+
+shutter_pipeline::shutter_pipeline(control_channel& channel, native_socket const async_sockfd,
+                                   std::chrono::milliseconds const capture_timeout)
+    : channel(channel), async_sockfd(async_sockfd), capture_timeout(capture_timeout) {
+  worker = std::thread([this]() { run(); });
+}
+
+shutter_pipeline::~shutter_pipeline() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+    cv.notify_all();
+    // the ack handlers use this object, the channel calls each of them once
+    cv.wait(lock, [this]() { return acks_pending == 0; });
+  }
+  if (worker.joinable()) worker.join();
+  std::lock_guard<std::mutex> const lock(mutex);
+  for (job& j : jobs) fail(j);
+}
+
+bool shutter_pipeline::release(std::shared_ptr<data_sink> sink, std::future<size_t>* thumbnail) {
+  log(LOG_INFO, "shutter");
+  return release_async(std::move(sink), thumbnail).get().success;
+}
+
+std::future<response> shutter_pipeline::release_async(std::shared_ptr<data_sink> sink,
+                                                      std::future<size_t>* thumbnail) {
+  auto const msg = make_static_message(message_type::shutter, 0x00, 0x00, 0x00, 0x00,
+                                       0x00, 0x00, 0x00, 0x00);
+  auto const j = std::make_shared<job>();
+  j->sink = std::move(sink);
+  if (thumbnail) *thumbnail = j->done.get_future();
+
+  auto const ack = std::make_shared<std::promise<response>>();
+  std::future<response> result = ack->get_future();
+  control_channel::log_send(msg.type, &msg, msg.size());
+  std::lock_guard<std::mutex> const order(order_mutex);
+  j->release = ++releases;
+  bool idle;
+  {
+    std::lock_guard<std::mutex> const lock(mutex);
+    idle = !capturing && jobs.empty() && acks_pending == 0;
+    ++acks_pending;
+  }
+  // with no capture in progress an event on the socket is a late one of an
+  // earlier capture, it would be taken for one of this
+  if (idle && async_sockfd) {
+    size_t const dropped = drop_events();
+    if (dropped)
+      log(LOG_WARN, string_format("shutter_pipeline: %zu late events dropped", dropped));
+  }
+  // the capture is queued from the reader thread, in ack order
+  channel.submit(msg.id, &msg, msg.size(), nullptr, 0, nullptr, [this, j, ack](response& r) {
+    bool queued = false;
+    {
+      std::lock_guard<std::mutex> const lock(mutex);
+      if (r.success && !stopping) {
+        jobs.push_back(std::move(*j));
+        queued = true;
+      }
+    }
+    if (!queued) fail(*j);
+    ack->set_value(std::move(r));
+    // the destructor may go on once this lock is released, nothing after it
+    std::lock_guard<std::mutex> const lock(mutex);
+    --acks_pending;
+    cv.notify_all();
+  });
+  return result;
+}
+
+void shutter_pipeline::fail(job& j) {
+  if (j.sink) j.sink->finish(false);
+  j.done.set_value(0);
+}
+
+void shutter_pipeline::resync() {
+  std::deque<job> queued;
+  {
+    std::lock_guard<std::mutex> const lock(mutex);
+    if (stopping) return;  // the destructor fails the jobs left
+    queued.swap(jobs);
+  }
+  for (job& j : queued) fail(j);
+  size_t const dropped = async_sockfd ? drop_events() : 0;
+  log(LOG_WARN, string_format("shutter_pipeline: out of step, %zu captures failed, %zu events dropped",
+                              queued.size(), dropped));
+}
+
+size_t shutter_pipeline::drop_events() {
+  std::vector<uint8_t> event;
+  size_t dropped = 0;
+  for (; wait_readable(async_sockfd, 0); ++dropped) fuji_receive_log(async_sockfd, event);
+  return dropped;
+}
+
+bool shutter_pipeline::receive_event(std::vector<uint8_t>& event,
+                                     std::chrono::steady_clock::time_point const deadline) {
+  if (!async_sockfd) return true;
+  // in slices, so a stop does not wait for a camera that never answers
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> const lock(mutex);
+      if (stopping) return false;
+    }
+    std::chrono::steady_clock::time_point const now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      log(LOG_ERROR, "shutter_pipeline: no capture event from the camera");
+      return false;
+    }
+    auto const left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+    if (wait_readable(async_sockfd, static_cast<int>(std::min<long long>(left, 100)))) break;
+  }
+  fuji_receive_log(async_sockfd, event);
+  return true;
+}
+
+void shutter_pipeline::run() {
+  std::vector<uint8_t> event;
+  for (;;) {
+    job j;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      capturing = false;
+      cv.wait(lock, [this]() { return stopping || !jobs.empty(); });
+      if (stopping) return;  // the destructor fails the jobs left
+      j = std::move(jobs.front());
+      jobs.pop_front();
+      capturing = true;
+    }
+
+    // the image is requested once the capture is complete
+    std::chrono::steady_clock::time_point const deadline = std::chrono::steady_clock::now() + capture_timeout;
+    if (!receive_event(event, deadline) || !receive_event(event, deadline)) {  // async1, async2
+      fail(j);
+      resync();
+      continue;
+    }
+
+    std::future<response> image;
+    auto const counter = std::make_shared<counting_sink>(j.sink);
+    {
+      std::lock_guard<std::mutex> const order(order_mutex);
+      if (releases == j.release) {
+        auto const req = make_static_message(message_type::camera_last_image);
+        image = channel.request(req, counter);
+      }
+    }
+    if (!image.valid()) {
+      // the last image already is that of a later shot, whose job fetches it
+      log(LOG_WARN, string_format("shutter_pipeline: release %llu overtaken, no thumbnail",
+                                  static_cast<unsigned long long>(j.release)));
+      fail(j);
+      continue;
+    }
+    bool const success = image.get().success;
+    log(LOG_INFO, string_format("received %zu bytes (thumbnail)", counter->bytes));
+
+    // a late async3 would be taken for async1 of the next capture; the sink
+    // was already finished with the transfer
+    if (!receive_event(event, std::chrono::steady_clock::now() + capture_timeout)) {
+      j.done.set_value(0);
+      resync();
+      continue;
+    }
+
+    j.done.set_value(success ? counter->bytes : 0);
+  }
+}
+
+}  // namespace fcwt
@@ -0,0 +1,277 @@
+#include "focus_peaking.hpp"
+
+#include "platform.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FCWT_PEAKING_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FCWT_PEAKING_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace fcwt {
+
+namespace {
+
+// pixels from x to width - 1 of one row
+void laplacian_row_scalar(uint8_t const* above, uint8_t const* row, uint8_t const* below, int x,
+                          int width, uint8_t threshold, uint8_t* mask, uint16_t* column_sums) {
+  for (; x < width - 1; ++x) {
+    int const laplacian = 4 * row[x] - row[x - 1] - row[x + 1] - above[x] - below[x];
+    int const m = std::min(std::abs(laplacian), 255);
+    mask[x] = m > threshold ? 255 : 0;
+    column_sums[x] = static_cast<uint16_t>(column_sums[x] + m);
+  }
+}
+
+int laplacian_row_none(uint8_t const*, uint8_t const*, uint8_t const*, int, uint8_t, uint8_t*,
+                       uint16_t*) {
+  return 1;
+}
+
+#if FCWT_PEAKING_X86
+
+// 8 pixels in 16 bit lanes; the sum of the neighbours needs 10 bits, the
+// result fits into a signed 16 bit lane
+__attribute__((target("sse4.1"))) inline __m128i laplacian8(__m128i c, __m128i l, __m128i r, __m128i u,
+                                                            __m128i d) {
+  __m128i const neighbours = _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(u, d));
+  return _mm_abs_epi16(_mm_sub_epi16(_mm_slli_epi16(c, 2), neighbours));
+}
+
+// adds the 8 magnitudes in 16 bit lanes to the column sums at p
+__attribute__((target("sse4.1"))) inline void add_sums8(uint16_t* p, __m128i m) {
+  __m128i* const sums = reinterpret_cast<__m128i*>(p);
+  _mm_storeu_si128(sums, _mm_add_epi16(_mm_loadu_si128(sums), m));
+}
+
+__attribute__((target("sse4.1"))) int laplacian_row_sse41(uint8_t const* above, uint8_t const* row,
+                                                          uint8_t const* below, int width,
+                                                          uint8_t threshold, uint8_t* mask,
+                                                          uint16_t* column_sums) {
+  __m128i const zero = _mm_setzero_si128();
+  // unsigned compare as signed, both sides shifted by 128
+  __m128i const bias = _mm_set1_epi8(-128);
+  __m128i const limit = _mm_xor_si128(_mm_set1_epi8(static_cast<char>(threshold)), bias);
+  int x = 1;
+  for (; x + 17 <= width; x += 16) {
+    __m128i const c = _mm_loadu_si128(reinterpret_cast<__m128i const*>(row + x));
+    __m128i const l = _mm_loadu_si128(reinterpret_cast<__m128i const*>(row + x - 1));
+    __m128i const r = _mm_loadu_si128(reinterpret_cast<__m128i const*>(row + x + 1));
+    __m128i const u = _mm_loadu_si128(reinterpret_cast<__m128i const*>(above + x));
+    __m128i const d = _mm_loadu_si128(reinterpret_cast<__m128i const*>(below + x));
+    __m128i const lo = laplacian8(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(l, zero),
+                                  _mm_unpacklo_epi8(r, zero), _mm_unpacklo_epi8(u, zero),
+                                  _mm_unpacklo_epi8(d, zero));
+    __m128i const hi = laplacian8(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(l, zero),
+                                  _mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(u, zero),
+                                  _mm_unpackhi_epi8(d, zero));
+    __m128i const m = _mm_packus_epi16(lo, hi);  // saturates at 255 like the scalar code
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(mask + x), _mm_cmpgt_epi8(_mm_xor_si128(m, bias), limit));
+    add_sums8(column_sums + x, _mm_unpacklo_epi8(m, zero));
+    add_sums8(column_sums + x + 8, _mm_unpackhi_epi8(m, zero));
+  }
+  return x;
+}
+
+// the SSE steps on 32 pixels; unpacks and packs stay within the 128 bit
+// lanes, so the pixels come out in order
+__attribute__((target("avx2"))) inline __m256i laplacian16(__m256i c, __m256i l, __m256i r, __m256i u,
+                                                           __m256i d) {
+  __m256i const neighbours = _mm256_add_epi16(_mm256_add_epi16(l, r), _mm256_add_epi16(u, d));
+  return _mm256_abs_epi16(_mm256_sub_epi16(_mm256_slli_epi16(c, 2), neighbours));
+}
+
+__attribute__((target("avx2"))) inline void add_sums16(uint16_t* p, __m256i m) {
+  __m256i* const sums = reinterpret_cast<__m256i*>(p);
+  _mm256_storeu_si256(sums, _mm256_add_epi16(_mm256_loadu_si256(sums), m));
+}
+
+__attribute__((target("avx2"))) int laplacian_row_avx2(uint8_t const* above, uint8_t const* row,
+                                                       uint8_t const* below, int width,
+                                                       uint8_t threshold, uint8_t* mask,
+                                                       uint16_t* column_sums) {
+  __m256i const zero = _mm256_setzero_si256();
+  __m256i const bias = _mm256_set1_epi8(-128);
+  __m256i const limit = _mm256_xor_si256(_mm256_set1_epi8(static_cast<char>(threshold)), bias);
+  int x = 1;
+  for (; x + 33 <= width; x += 32) {
+    __m256i const c = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(row + x));
+    __m256i const l = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(row + x - 1));
+    __m256i const r = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(row + x + 1));
+    __m256i const u = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(above + x));
+    __m256i const d = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(below + x));
+    __m256i const lo = laplacian16(_mm256_unpacklo_epi8(c, zero), _mm256_unpacklo_epi8(l, zero),
+                                   _mm256_unpacklo_epi8(r, zero), _mm256_unpacklo_epi8(u, zero),
+                                   _mm256_unpacklo_epi8(d, zero));
+    __m256i const hi = laplacian16(_mm256_unpackhi_epi8(c, zero), _mm256_unpackhi_epi8(l, zero),
+                                   _mm256_unpackhi_epi8(r, zero), _mm256_unpackhi_epi8(u, zero),
+                                   _mm256_unpackhi_epi8(d, zero));
+    __m256i const m = _mm256_packus_epi16(lo, hi);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(mask + x),
+                        _mm256_cmpgt_epi8(_mm256_xor_si256(m, bias), limit));
+    // widened per lane: pixels 0-7 and 16-23, 8-15 and 24-31
+    __m256i const lo8 = _mm256_unpacklo_epi8(m, zero);
+    __m256i const hi8 = _mm256_unpackhi_epi8(m, zero);
+    add_sums16(column_sums + x, _mm256_permute2x128_si256(lo8, hi8, 0x20));
+    add_sums16(column_sums + x + 16, _mm256_permute2x128_si256(lo8, hi8, 0x31));
+  }
+  // the SSE code is not VEX encoded, it would stall on the dirty upper
+  // halves; it starts at its x = 1, one pixel before ours
+  _mm256_zeroupper();
+  return x - 1 + laplacian_row_sse41(above + x - 1, row + x - 1, below + x - 1, width - x + 1, threshold,
+                                     mask + x - 1, column_sums + x - 1);
+}
+
+#elif FCWT_PEAKING_NEON
+
+// 8 pixels: |4 c - neighbours| as an unsigned difference in 16 bit lanes,
+// narrowed with saturation
+inline uint8x8_t laplacian8(uint8x8_t c, uint8x8_t l, uint8x8_t r, uint8x8_t u, uint8x8_t d) {
+  uint16x8_t const neighbours = vaddq_u16(vaddl_u8(l, r), vaddl_u8(u, d));
+  return vqmovn_u16(vabdq_u16(vshll_n_u8(c, 2), neighbours));
+}
+
+int laplacian_row_neon(uint8_t const* above, uint8_t const* row, uint8_t const* below, int width,
+                       uint8_t threshold, uint8_t* mask, uint16_t* column_sums) {
+  uint8x16_t const limit = vdupq_n_u8(threshold);
+  int x = 1;
+  for (; x + 17 <= width; x += 16) {
+    uint8x16_t const c = vld1q_u8(row + x);
+    uint8x16_t const l = vld1q_u8(row + x - 1);
+    uint8x16_t const r = vld1q_u8(row + x + 1);
+    uint8x16_t const u = vld1q_u8(above + x);
+    uint8x16_t const d = vld1q_u8(below + x);
+    uint8x16_t const m =
+        vcombine_u8(laplacian8(vget_low_u8(c), vget_low_u8(l), vget_low_u8(r), vget_low_u8(u), vget_low_u8(d)),
+                    laplacian8(vget_high_u8(c), vget_high_u8(l), vget_high_u8(r), vget_high_u8(u), vget_high_u8(d)));
+    vst1q_u8(mask + x, vcgtq_u8(m, limit));
+    vst1q_u16(column_sums + x, vaddw_u8(vld1q_u16(column_sums + x), vget_low_u8(m)));
+    vst1q_u16(column_sums + x + 8, vaddw_u8(vld1q_u16(column_sums + x + 8), vget_high_u8(m)));
+  }
+  return x;
+}
+
+#endif
+
+peaking_kernels const scalar_kernels = {simd_level::scalar, laplacian_row_none};
+#if FCWT_PEAKING_X86
+peaking_kernels const sse41_kernels = {simd_level::sse41, laplacian_row_sse41};
+peaking_kernels const avx2_kernels = {simd_level::avx2, laplacian_row_avx2};
+#elif FCWT_PEAKING_NEON
+peaking_kernels const neon_kernels = {simd_level::neon, laplacian_row_neon};
+#endif
+
+// rows of |Laplacian| a 16 bit column sum holds
+const int max_band_rows = 65535 / 255;
+
+}  // namespace
+
+void sharpness_map::sharpest(int& column, int& row) const {
+  size_t const best = std::max_element(scores.begin(), scores.end()) - scores.begin();
+  column = columns > 0 ? static_cast<int>(best) % columns : 0;
+  row = columns > 0 ? static_cast<int>(best) / columns : 0;
+}
+
+void print(sharpness_map const& map) {
+  printf("sharpness (%dx%d):\n", map.columns, map.rows);
+  for (int row = 0; row < map.rows; ++row) {
+    printf("\t");
+    for (int column = 0; column < map.columns; ++column) printf("%6.1f", map.score(column, row));
+    printf("\n");
+  }
+}
+
+peaking_kernels const* peaking_kernels_for(simd_level const level) {
+  switch (level) {
+    case simd_level::scalar:
+      return &scalar_kernels;
+#if FCWT_PEAKING_X86
+    case simd_level::sse41:
+      return __builtin_cpu_supports("sse4.1") ? &sse41_kernels : nullptr;
+    case simd_level::avx2:
+      return __builtin_cpu_supports("avx2") ? &avx2_kernels : nullptr;
+#elif FCWT_PEAKING_NEON
+    case simd_level::neon:
+      return &neon_kernels;
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+peaking_kernels const& best_peaking_kernels() {
+  static peaking_kernels const* const best = peaking_kernels_for(best_color_kernels().level);
+  return *best;
+}
+
+void focus_peaker::process(uint8_t const* const luma, size_t const luma_stride, int const width,
+                           int const height, uint8_t const threshold, uint8_t* const edges,
+                           size_t const edges_stride, sharpness_map& map) {
+  map.scores.assign(static_cast<size_t>(map.columns) * map.rows, 0.0f);
+  if (edges) {
+    // the border pixels have no Laplacian
+    for (int y = 0; y < height; y += std::max(height - 1, 1)) memset(edges + y * edges_stride, 0, width);
+  }
+  score_rows(luma, luma_stride, width, height, threshold, edges, edges_stride, 0, map.rows, map);
+}
+
+void focus_peaker::score(uint8_t const* const luma, size_t const luma_stride, int const width,
+                         int const height, int const first_row, int const last_row, sharpness_map& map) {
+  score_rows(luma, luma_stride, width, height, 255, nullptr, 0, first_row, last_row, map);
+}
+
+void focus_peaker::score_rows(uint8_t const* const luma, size_t const luma_stride, int const width,
+                              int const height, uint8_t const threshold, uint8_t* const edges,
+                              size_t const edges_stride, int const first_row, int const last_row,
+                              sharpness_map& map) {
+  if (width < 3 || height < 3) {
+    if (edges)
+      for (int y = 0; y < height; ++y) memset(edges + y * edges_stride, 0, width);
+    return;
+  }
+  column_sums.assign(width, 0);
+  if (!edges) scratch_mask.assign(width, 0);
+  sums.resize(map.columns);
+
+  for (int band = first_row; band < last_row; ++band) {
+    std::fill(sums.begin(), sums.end(), 0);
+    // the column sums collect the rows of the band, as many at a time as
+    // they hold, then go to its regions
+    int const begin = band * height / map.rows;
+    int const end = (band + 1) * height / map.rows;
+    for (int y = std::max(begin, 1); y < std::min(end, height - 1);) {
+      int const chunk_end = std::min(std::min(end, height - 1), y + max_band_rows);
+      for (; y < chunk_end; ++y) {
+        uint8_t const* const row = luma + y * luma_stride;
+        uint8_t* const mask = edges ? edges + y * edges_stride : scratch_mask.data();
+        if (edges) mask[0] = mask[width - 1] = 0;
+        int const x = kernels->laplacian_row(row - luma_stride, row, row + luma_stride, width, threshold,
+                                             mask, column_sums.data());
+        laplacian_row_scalar(row - luma_stride, row, row + luma_stride, x, width, threshold, mask,
+                             column_sums.data());
+      }
+
+      for (int column = 0; column < map.columns; ++column) {
+        int const column_end = (column + 1) * width / map.columns;
+        for (int x = column * width / map.columns; x < column_end; ++x) sums[column] += column_sums[x];
+      }
+      std::fill(column_sums.begin(), column_sums.end(), 0);
+    }
+
+    for (int column = 0; column < map.columns; ++column) {
+      int const pixel_columns = (column + 1) * width / map.columns - column * width / map.columns;
+      size_t const pixels = static_cast<size_t>(end - begin) * pixel_columns;
+      map.scores[static_cast<size_t>(band) * map.columns + column] =
+          pixels ? static_cast<float>(sums[column]) / pixels : 0.0f;
+    }
+  }
+}
+
+}  // namespace fcwt
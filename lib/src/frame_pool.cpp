@@ -0,0 +1,175 @@
+#include "frame_pool.hpp"
+
+#include "log.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace fcwt {
+
+frame_pool::frame_pool(size_t const count, size_t const bytes)
+    : slab_bytes(bytes), memory(count * bytes), slabs(new slab[count]), slab_count(count) {
+  free_slabs.reserve(count);
+  for (size_t i = count; i > 0; --i) {
+    slab& s = slabs[i - 1];
+    s.data = memory.data() + (i - 1) * bytes;
+    s.refs = 0;
+    free_slabs.push_back(&s);
+  }
+}
+
+frame_pool::~frame_pool() {
+  if (free_slabs.size() != slab_count)
+    log(LOG_ERROR, string_format("frame_pool: %zu frames still in use", slab_count - free_slabs.size()));
+}
+
+frame frame_pool::acquire() {
+  std::lock_guard<std::mutex> const lock(free_mutex);
+  if (free_slabs.empty()) {
+    ++exhausted_;
+    return frame();
+  }
+  slab* const s = free_slabs.back();
+  free_slabs.pop_back();
+  s->size = 0;
+  s->sequence = next_sequence++;
+  s->refs = 1;
+  return frame(this, s);
+}
+
+size_t frame_pool::available() {
+  std::lock_guard<std::mutex> const lock(free_mutex);
+  return free_slabs.size();
+}
+
+uint64_t frame_pool::exhausted() {
+  std::lock_guard<std::mutex> const lock(free_mutex);
+  return exhausted_;
+}
+
+void frame_pool::release(slab* const s) {
+  std::lock_guard<std::mutex> const lock(free_mutex);
+  free_slabs.push_back(s);  // never grows past the reserved size
+}
+
+frame::frame(frame const& other) : pool(other.pool), s(other.s) {
+  if (s) ++s->refs;
+}
+
+frame::frame(frame&& other) : pool(other.pool), s(other.s) {
+  other.pool = nullptr;
+  other.s = nullptr;
+}
+
+frame& frame::operator=(frame other) {
+  swap(other);
+  return *this;
+}
+
+void frame::swap(frame& other) {
+  std::swap(pool, other.pool);
+  std::swap(s, other.s);
+}
+
+void frame::reset() {
+  if (s && --s->refs == 0) pool->release(s);
+  pool = nullptr;
+  s = nullptr;
+}
+
+void frame::set_size(size_t const size) {
+  s->size = std::min(size, pool->capacity());
+  s->received = std::chrono::steady_clock::now();
+}
+
+frame_queue::frame_queue(size_t const depth) : ring(std::max<size_t>(depth, 1)) {}
+
+void frame_queue::push(frame f) {
+  {
+    std::lock_guard<std::mutex> const lock(mutex);
+    ++pushed_;
+    if (closed) {
+      ++dropped_;
+      return;
+    }
+    if (count == ring.size()) {
+      ring[head].reset();
+      head = (head + 1) % ring.size();
+      --count;
+      ++dropped_;
+    }
+    ring[(head + count) % ring.size()] = std::move(f);
+    ++count;
+  }
+  cv.notify_one();
+}
+
+bool frame_queue::pop(frame& f) {
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [this]() { return closed || count > 0; });
+  if (count == 0) return false;
+  f = std::move(ring[head]);
+  head = (head + 1) % ring.size();
+  --count;
+  return true;
+}
+
+bool frame_queue::try_pop(frame& f) {
+  std::lock_guard<std::mutex> const lock(mutex);
+  if (count == 0) return false;
+  f = std::move(ring[head]);
+  head = (head + 1) % ring.size();
+  --count;
+  return true;
+}
+
+bool frame_queue::drop_oldest() {
+  std::lock_guard<std::mutex> const lock(mutex);
+  if (count == 0) return false;
+  ring[head].reset();
+  head = (head + 1) % ring.size();
+  --count;
+  ++dropped_;
+  return true;
+}
+
+void frame_queue::close() {
+  {
+    std::lock_guard<std::mutex> const lock(mutex);
+    closed = true;
+  }
+  cv.notify_all();
+}
+
+uint64_t frame_queue::pushed() {
+  std::lock_guard<std::mutex> const lock(mutex);
+  return pushed_;
+}
+
+uint64_t frame_queue::dropped() {
+  std::lock_guard<std::mutex> const lock(mutex);
+  return dropped_;
+}
+
+size_t receive_frame(native_socket const sockfd, frame& f) {
+  uint8_t scratch[4096];  // takes what does not go to the frame
+  uint8_t* const buffer = f ? f.buffer() : scratch;
+  size_t const capacity = f ? f.capacity() : sizeof(scratch);
+
+  size_t const size = fuji_receive(sockfd, buffer, capacity);
+  if (size > capacity) {
+    for (size_t left = size - capacity; left > 0;) {
+      size_t const n = std::min(left, sizeof(scratch));
+      receive_data(sockfd, scratch, n);
+      left -= n;
+    }
+    if (f) log(LOG_WARN, string_format("receive_frame: skipped a %zu byte frame", size));
+    return 0;
+  }
+  if (!f || size == 0) return 0;
+
+  f.set_size(size);
+  return size;
+}
+
+}  // namespace fcwt
@@ -0,0 +1,88 @@
+#include "histogram.hpp"
+
+#include "color_convert.hpp"
+
+#include <stdio.h>
+#include <algorithm>
+
+namespace fcwt {
+
+namespace {
+
+// enough to keep equal neighbours apart
+const int bank_count = 4;
+const size_t bank_bins = histogram_channels * 256;
+
+inline void count(uint32_t* bank, uint8_t const* bgr, uint8_t const luma) {
+  ++bank[bgr[0]];
+  ++bank[256 + bgr[1]];
+  ++bank[512 + bgr[2]];
+  ++bank[768 + luma];
+}
+
+}  // namespace
+
+float image_histogram::share(histogram_channel const channel, int const low, int const high) const {
+  if (pixels == 0) return 0;
+  uint64_t n = 0;
+  for (int i = std::max(low, 0); i <= std::min(high, 255); ++i) n += bins[channel][i];
+  return static_cast<float>(n) / pixels;
+}
+
+float image_histogram::mean(histogram_channel const channel) const {
+  if (pixels == 0) return 0;
+  uint64_t sum = 0;
+  for (int i = 0; i < 256; ++i) sum += static_cast<uint64_t>(i) * bins[channel][i];
+  return static_cast<float>(sum) / pixels;
+}
+
+exposure_stats exposure(image_histogram const& histogram, int const tolerance) {
+  exposure_stats stats;
+  stats.mean_luma = histogram.mean(histogram_luma);
+  stats.shadows = histogram.share(histogram_luma, 0, 16 + tolerance);
+  stats.highlights = histogram.share(histogram_luma, 235 - tolerance, 255);
+  for (int channel = histogram_blue; channel <= histogram_red; ++channel)
+    stats.clipped[channel] = histogram.share(static_cast<histogram_channel>(channel), 255 - tolerance, 255);
+  return stats;
+}
+
+void print(exposure_stats const& stats) {
+  printf("exposure:\n");
+  printf("\tmean luma  %5.1f (16 - 235)\n", stats.mean_luma);
+  printf("\tshadows    %5.1f%%\n", stats.shadows * 100);
+  printf("\thighlights %5.1f%%\n", stats.highlights * 100);
+  printf("\tclipped    red %.1f%%, green %.1f%%, blue %.1f%%\n", stats.clipped[histogram_red] * 100,
+         stats.clipped[histogram_green] * 100, stats.clipped[histogram_blue] * 100);
+}
+
+void histogram_builder::process(uint8_t const* const bgr, size_t const bgr_stride, int const width,
+                                int const height, uint8_t const* const luma, size_t const luma_stride,
+                                image_histogram& histogram) {
+  banks.assign(bank_count * bank_bins, 0);
+  if (!luma) luma_row.resize(width);
+
+  uint32_t* const bank0 = banks.data();
+  uint32_t* const bank1 = bank0 + bank_bins;
+  uint32_t* const bank2 = bank1 + bank_bins;
+  uint32_t* const bank3 = bank2 + bank_bins;
+  for (int y = 0; y < height; ++y) {
+    uint8_t const* const p = bgr + y * bgr_stride;
+    uint8_t const* l = luma ? luma + y * luma_stride : luma_row.data();
+    if (!luma) bgr_to_gray(p, bgr_stride, width, 1, luma_row.data(), width);
+
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+      count(bank0, p + x * 3, l[x]);
+      count(bank1, p + x * 3 + 3, l[x + 1]);
+      count(bank2, p + x * 3 + 6, l[x + 2]);
+      count(bank3, p + x * 3 + 9, l[x + 3]);
+    }
+    for (; x < width; ++x) count(bank0, p + x * 3, l[x]);
+  }
+
+  for (size_t i = 0; i < bank_bins; ++i)
+    histogram.bins[i / 256][i % 256] = bank0[i] + bank1[i] + bank2[i] + bank3[i];
+  histogram.pixels = static_cast<uint64_t>(width) * height;
+}
+
+}  // namespace fcwt
@@ -0,0 +1,171 @@
+#include "intervalometer.hpp"
+
+#include "camera_session.hpp"
+#include "commands.hpp"
+#include "control_channel.hpp"
+#include "log.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <thread>
+
+namespace fcwt {
+
+namespace {
+
+typedef std::chrono::steady_clock steady;
+
+// sleep coarsely until shortly before the deadline, then spin on the clock
+const std::chrono::microseconds spin_margin(2000);
+
+void wait_until(steady::time_point const deadline) {
+  if (steady::now() < deadline - spin_margin)
+    std::this_thread::sleep_until(deadline - spin_margin);
+  while (steady::now() < deadline)
+    std::this_thread::yield();
+}
+
+int64_t micros(steady::duration const d) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+}  // namespace
+
+intervalometer::intervalometer(native_socket const sockfd, native_socket const sockfd2,
+                               std::timed_mutex* const io_lock)
+    : sockfd(sockfd), sockfd2(sockfd2), io_lock(io_lock), pipeline(nullptr), session(nullptr),
+      stopped(false) {}
+
+intervalometer::intervalometer(shutter_pipeline& pipeline)
+    : sockfd(0), sockfd2(0), io_lock(nullptr), pipeline(&pipeline), session(nullptr),
+      stopped(false) {}
+
+intervalometer::intervalometer(camera_session& session)
+    : sockfd(0), sockfd2(0), io_lock(nullptr), pipeline(nullptr), session(&session),
+      stopped(false) {}
+
+void intervalometer::stop() { stopped = true; }
+
+bool intervalometer::run(intervalometer_options const& options,
+                         intervalometer_report* report, frame_callback const& on_frame) {
+  if ((sockfd <= 0 && !pipeline && !session) || options.interval.count() <= 0) return false;
+
+  stopped = false;
+  unsigned const burst = std::max(options.burst, 1u);
+  steady::duration const tolerance = options.miss_tolerance.count() > 0
+      ? steady::duration(options.miss_tolerance)
+      : steady::duration(options.interval) / 4;
+
+  intervalometer_report local;
+  if (!report) report = &local;
+  *report = intervalometer_report();
+  if (options.slots)
+    report->frames.reserve(static_cast<size_t>(options.slots) * burst);
+
+  // exponentially weighted shutter ack round trip
+  steady::duration rtt = steady::duration::zero();
+  bool have_rtt = false;
+
+  // first slot slightly in the future so it is not missed right away
+  steady::time_point const start = steady::now() + spin_margin * 2;
+  unsigned frame = 0;
+  int64_t total_abs_error = 0;
+
+  for (unsigned slot = 0; !stopped && (options.slots == 0 || slot < options.slots); ++slot) {
+    for (unsigned shot = 0; shot < burst && !stopped; ++shot) {
+      steady::time_point const scheduled = start + steady::duration(options.interval) * slot +
+                                          steady::duration(options.burst_interval) * shot;
+      steady::duration const lead = options.compensate_latency && have_rtt ? rtt / 2 : steady::duration::zero();
+      steady::time_point const send_at = scheduled - lead;
+
+      if (steady::now() > send_at + tolerance) {
+        ++report->missed;
+        log(LOG_WARN, string_format("intervalometer: missed slot %u shot %u", slot, shot));
+        continue;
+      }
+
+      std::unique_lock<std::timed_mutex> lock;
+      if (io_lock || session) wait_until(send_at - spin_margin);
+      if (io_lock) lock = std::unique_lock<std::timed_mutex>(*io_lock);
+
+      std::string thumbnail;
+      if (!options.thumbnail_pattern.empty())
+        thumbnail = string_format(options.thumbnail_pattern.c_str(), frame);
+
+      frame_timing timing;
+      timing.frame = frame;
+      timing.slot = slot;
+      timing.scheduled = micros(scheduled - start);
+      steady::time_point sent, acked;
+      auto const release = [&](native_socket control) {
+        wait_until(send_at);
+        sent = steady::now();
+        bool const success = shutter_release(control);
+        acked = steady::now();
+        return success;
+      };
+      if (session) {
+        // release and transfer are one task, nothing else may be sent in
+        // between; this thread only waits for the ack and goes on to wait for
+        // the next shot, which runs on the strand once the transfer is done
+        auto const ack = std::make_shared<std::promise<bool>>();
+        std::future<bool> acked_shot = ack->get_future();
+        session->post([&release, ack, thumbnail](camera_io& io) {
+          bool const success = release(io.control);
+          // release refers to this thread's stack, which may be gone from here on
+          ack->set_value(success);
+          if (success && !shutter_complete(io.control, io.async, thumbnail.empty() ? 0 : thumbnail.c_str()))
+            log(LOG_WARN, "intervalometer: thumbnail transfer failed");
+        }, command_priority::shutter);
+        timing.success = acked_shot.get();
+      } else if (pipeline) {
+        wait_until(send_at);
+        sent = steady::now();
+        timing.success = pipeline->release(thumbnail.empty() ? nullptr : file_sink(thumbnail));
+        acked = steady::now();
+      } else {
+        // nothing runs in the background, the transfer delays the next shot
+        timing.success = release(sockfd) &&
+                         shutter_complete(sockfd, sockfd2, thumbnail.empty() ? 0 : thumbnail.c_str());
+      }
+      if (lock.owns_lock()) lock.unlock();
+      timing.sent = micros(sent - start);
+      timing.acked = micros(acked - start);
+
+      if (timing.success) {
+        rtt = have_rtt ? (rtt * 7 + (acked - sent)) / 8 : acked - sent;
+        have_rtt = true;
+      }
+      timing.trigger_error = micros(sent + (acked - sent) / 2 - scheduled);
+
+      total_abs_error += llabs(timing.trigger_error);
+      report->max_abs_error = std::max<int64_t>(report->max_abs_error, llabs(timing.trigger_error));
+      report->frames.push_back(timing);
+      ++frame;
+
+      if (on_frame) on_frame(timing);
+    }
+  }
+
+  if (!report->frames.empty())
+    report->mean_abs_error = static_cast<double>(total_abs_error) / report->frames.size();
+
+  return !stopped;
+}
+
+void print(intervalometer_report const& report) {
+  unsigned failed = 0;
+  for (frame_timing const& f : report.frames)
+    if (!f.success) ++failed;
+
+  printf("intervalometer:\n");
+  printf("\tframes: %zu (%u failed)\n", report.frames.size(), failed);
+  printf("\tmissed slots: %u\n", report.missed);
+  printf("\ttrigger error: mean %.0f us, max %lld us\n", report.mean_abs_error,
+         static_cast<long long>(report.max_abs_error));
+}
+
+}  // namespace fcwt
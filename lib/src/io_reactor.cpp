@@ -0,0 +1,105 @@
+#include "io_reactor.hpp"
+
+#include "log.hpp"
+
+#include <algorithm>
+
+namespace fcwt {
+
+namespace {
+
+// how often the thread looks for added or removed sockets and for stop
+const int poll_timeout_ms = 20;
+
+}  // namespace
+
+io_reactor::io_reactor() : stopping(false) {
+  thread = std::thread([this]() { run(); });
+}
+
+io_reactor::~io_reactor() {
+  stopping = true;
+  changed_cv.notify_all();
+  if (thread.joinable()) thread.join();
+
+  for (auto const& w : watches)
+    if (w->on_close) w->on_close();
+}
+
+void io_reactor::add(native_socket const sockfd, read_handler on_read, close_handler on_close) {
+  auto const w = std::make_shared<watch>();
+  w->sockfd = sockfd;
+  w->on_read = std::move(on_read);
+  w->on_close = std::move(on_close);
+  {
+    std::lock_guard<std::mutex> const lock(mutex);
+    watches.push_back(w);
+  }
+  changed_cv.notify_all();
+}
+
+void io_reactor::remove(native_socket const sockfd) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto const it = std::find_if(watches.begin(), watches.end(),
+                               [sockfd](std::shared_ptr<watch> const& w) { return w->sockfd == sockfd; });
+  if (it == watches.end()) return;
+  watch const* const removed = it->get();
+  watches.erase(it);
+  // a handler may remove its own socket
+  if (!on_reactor_thread())
+    changed_cv.wait(lock, [this, removed]() { return dispatching != removed; });
+}
+
+size_t io_reactor::size() {
+  std::lock_guard<std::mutex> const lock(mutex);
+  return watches.size();
+}
+
+void io_reactor::run() {
+  std::vector<uint8_t> buffer(64 * 1024);
+  std::vector<native_socket> sockets, readable;
+  while (!stopping) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed_cv.wait(lock, [this]() { return stopping || !watches.empty(); });
+      sockets.clear();
+      for (auto const& w : watches) sockets.push_back(w->sockfd);
+    }
+    if (sockets.empty() || !wait_readable(sockets, poll_timeout_ms, readable)) continue;
+
+    for (native_socket const sockfd : readable) {
+      std::shared_ptr<watch> w;
+      {
+        std::lock_guard<std::mutex> const lock(mutex);
+        auto const it = std::find_if(
+            watches.begin(), watches.end(),
+            [sockfd](std::shared_ptr<watch> const& candidate) { return candidate->sockfd == sockfd; });
+        if (it == watches.end()) continue;  // removed meanwhile
+        w = *it;
+        dispatching = w.get();
+      }
+
+      long const receivedBytes = receive_available(sockfd, buffer.data(), buffer.size());
+      if (receivedBytes <= 0)
+        log(LOG_ERROR, "io_reactor: connection closed");
+      bool const keep = receivedBytes > 0 && w->on_read(buffer.data(), static_cast<size_t>(receivedBytes));
+
+      bool closed = false;
+      {
+        std::lock_guard<std::mutex> const lock(mutex);
+        dispatching = nullptr;
+        if (!keep) {
+          auto const it = std::find(watches.begin(), watches.end(), w);
+          if (it != watches.end()) {
+            watches.erase(it);
+            closed = true;
+          }
+        }
+      }
+      changed_cv.notify_all();
+      if (closed && w->on_close) w->on_close();
+    }
+  }
+}
+
+}  // namespace fcwt
@@ -0,0 +1,133 @@
+#include "jpeg_decoder.hpp"
+
+#include "live_view.hpp"
+#include "log.hpp"
+
+#ifdef WITH_LIBJPEG
+#include <setjmp.h>
+#include <stdio.h>
+#include <jpeglib.h>
+#endif
+
+namespace fcwt {
+
+bool jpeg_decoder::read_header(uint8_t const* const jpeg, size_t const size, int& width, int& height) {
+  return jpeg_dimensions(jpeg, size, width, height);
+}
+
+void jpeg_decoder::scaled_size(int const width, int const height, jpeg_scale const scale,
+                               int& scaled_width, int& scaled_height) {
+  int const denom = static_cast<int>(scale);
+  scaled_width = (width + denom - 1) / denom;
+  scaled_height = (height + denom - 1) / denom;
+}
+
+jpeg_scale jpeg_decoder::scale_for(int const width, int const height, int const max_width,
+                                   int const max_height) {
+  jpeg_scale const scales[] = {jpeg_scale::eighth, jpeg_scale::quarter, jpeg_scale::half};
+  for (jpeg_scale const scale : scales) {
+    int w, h;
+    scaled_size(width, height, scale, w, h);
+    if (w >= max_width && h >= max_height) return scale;
+  }
+  return jpeg_scale::full;
+}
+
+#ifdef WITH_LIBJPEG
+
+namespace {
+
+// libjpeg reports errors through a callback that must not return
+struct error_manager {
+  jpeg_error_mgr pub;  // first, libjpeg only knows this part
+  jmp_buf jump;
+};
+
+void on_error(j_common_ptr cinfo) {
+  char message[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, message);
+  log(LOG_WARN, string_format("jpeg_decoder: %s", message));
+  longjmp(reinterpret_cast<error_manager*>(cinfo->err)->jump, 1);
+}
+
+// warnings about corrupt data, the frame is still shown
+void on_message(j_common_ptr) {}
+
+}  // namespace
+
+struct jpeg_decoder::state {
+  jpeg_decompress_struct cinfo;
+  error_manager errors;
+};
+
+jpeg_decoder::jpeg_decoder() : s(new state) {
+  s->cinfo.err = jpeg_std_error(&s->errors.pub);
+  s->errors.pub.error_exit = on_error;
+  s->errors.pub.output_message = on_message;
+  jpeg_create_decompress(&s->cinfo);
+}
+
+jpeg_decoder::~jpeg_decoder() { jpeg_destroy_decompress(&s->cinfo); }
+
+bool jpeg_decoder::available() { return true; }
+
+// nothing here may need a destructor, on_error jumps back into it
+bool jpeg_decoder::decode(uint8_t const* const jpeg, size_t const size, jpeg_scale const scale,
+                          jpeg_pixel_format const format, uint8_t* const out, size_t const stride,
+                          size_t const capacity, int& width, int& height) {
+  jpeg_decompress_struct* const cinfo = &s->cinfo;
+  if (setjmp(s->errors.jump)) {
+    jpeg_abort_decompress(cinfo);
+    return false;
+  }
+
+  jpeg_mem_src(cinfo, const_cast<unsigned char*>(jpeg), static_cast<unsigned long>(size));
+  jpeg_read_header(cinfo, TRUE);
+  cinfo->scale_num = 1;
+  cinfo->scale_denom = static_cast<unsigned int>(scale);
+  cinfo->out_color_space = format == jpeg_pixel_format::gray ? JCS_GRAYSCALE : JCS_EXT_BGR;
+  jpeg_calc_output_dimensions(cinfo);
+
+  size_t const row_bytes = static_cast<size_t>(cinfo->output_width) * cinfo->output_components;
+  if (stride < row_bytes || capacity < stride * (cinfo->output_height - 1) + row_bytes) {
+    log(LOG_ERROR, string_format("jpeg_decoder: %ux%u does not fit into the buffer",
+                                 cinfo->output_width, cinfo->output_height));
+    jpeg_abort_decompress(cinfo);
+    return false;
+  }
+
+  jpeg_start_decompress(cinfo);
+  while (cinfo->output_scanline < cinfo->output_height) {
+    // as many rows as libjpeg produces at once, straight into out
+    JSAMPROW rows[8];
+    JDIMENSION count = 0;
+    while (count < 8 && cinfo->output_scanline + count < cinfo->output_height) {
+      rows[count] = out + (cinfo->output_scanline + count) * stride;
+      ++count;
+    }
+    jpeg_read_scanlines(cinfo, rows, count);
+  }
+  width = static_cast<int>(cinfo->output_width);
+  height = static_cast<int>(cinfo->output_height);
+  jpeg_finish_decompress(cinfo);
+  return true;
+}
+
+#else
+
+struct jpeg_decoder::state {};
+
+jpeg_decoder::jpeg_decoder() {}
+jpeg_decoder::~jpeg_decoder() {}
+
+bool jpeg_decoder::available() { return false; }
+
+bool jpeg_decoder::decode(uint8_t const*, size_t, jpeg_scale, jpeg_pixel_format, uint8_t*, size_t,
+                          size_t, int&, int&) {
+  log(LOG_ERROR, "jpeg_decoder: built without libjpeg");
+  return false;
+}
+
+#endif
+
+}  // namespace fcwt
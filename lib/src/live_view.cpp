@@ -0,0 +1,214 @@
+#include "live_view.hpp"
+
+#include "log.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <cmath>
+#include <utility>
+
+namespace fcwt {
+
+namespace {
+
+typedef std::chrono::steady_clock steady;
+
+void print(char const* name, latency_stats const& stats) {
+  printf("\t%-8s %8llu frames, last %6.1f ms, mean %6.1f ms, max %6.1f ms\n", name,
+         static_cast<unsigned long long>(stats.count()), stats.last().count() / 1000.0,
+         stats.mean().count() / 1000.0, stats.max().count() / 1000.0);
+}
+
+}  // namespace
+
+void latency_stats::add(steady::duration const d) {
+  int64_t const us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+  last_us = us;
+  total_us += us;
+  ++count_;
+  int64_t previous = max_us;
+  while (us > previous && !max_us.compare_exchange_weak(previous, us)) {
+  }
+}
+
+void latency_stats::reset() {
+  count_ = 0;
+  total_us = 0;
+  max_us = 0;
+  last_us = 0;
+}
+
+std::chrono::microseconds latency_stats::mean() const {
+  uint64_t const n = count_;
+  return std::chrono::microseconds(n ? total_us / static_cast<int64_t>(n) : 0);
+}
+
+void live_view_latency::reset() {
+  receive.reset();
+  decode.reset();
+  display.reset();
+  total.reset();
+}
+
+void print(live_view_latency const& latency) {
+  printf("live view latency:\n");
+  print("receive", latency.receive);
+  print("decode", latency.decode);
+  print("display", latency.display);
+  print("total", latency.total);
+}
+
+bool parse_live_view_header(uint8_t const* const data, size_t const size,
+                            live_view_header& header) {
+  if (size <= live_view_header_size) return false;
+  memcpy(&header.frame_number, data + 4, sizeof(header.frame_number));
+  return true;
+}
+
+bool jpeg_dimensions(uint8_t const* const data, size_t const size, int& width, int& height) {
+  if (size < 4 || data[0] != 0xff || data[1] != 0xd8) return false;
+
+  // segments after the start of image: ff, marker, big endian length
+  // including the length itself
+  for (size_t offset = 2; offset + 4 <= size;) {
+    if (data[offset] != 0xff) return false;
+    uint8_t const marker = data[offset + 1];
+    if (marker == 0xff) {  // fill byte
+      ++offset;
+      continue;
+    }
+    size_t const length = static_cast<size_t>(data[offset + 2]) << 8 | data[offset + 3];
+    // SOF0 to SOF15 except DHT (c4), JPG (c8) and DAC (cc)
+    bool const sof = marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+    if (sof) {
+      if (length < 7 || offset + 9 > size) return false;
+      height = data[offset + 5] << 8 | data[offset + 6];
+      width = data[offset + 7] << 8 | data[offset + 8];
+      return width > 0 && height > 0;
+    }
+    if (marker == 0xda || length < 2) return false;  // start of scan, no frame header before
+    offset += 2 + length;
+  }
+  return false;
+}
+
+void print(live_view_statistics const& stats) {
+  printf("live view stream:\n");
+  printf("\t%llu frames, %llu bytes, last frame number %u\n",
+         static_cast<unsigned long long>(stats.frames), static_cast<unsigned long long>(stats.bytes),
+         stats.last_frame_number);
+  printf("\t%.1f fps, %.1f KiB/s\n", stats.fps, stats.bytes_per_second / 1024.0);
+  printf("\tinterval %.1f ms, jitter %.1f ms\n", stats.interval_ms, stats.jitter_ms);
+  printf("\t%llu missed, %llu out of order\n", static_cast<unsigned long long>(stats.missed),
+         static_cast<unsigned long long>(stats.out_of_order));
+}
+
+void live_view_monitor::add(live_view_header const& header, size_t const bytes,
+                            steady::time_point const received) {
+  std::lock_guard<std::mutex> const lock(mutex);
+  if (stats.frames == 0) {
+    window_start = received;
+    stats.last_frame_number = header.frame_number;
+  } else {
+    uint32_t const expected = stats.last_frame_number + 1;
+    if (header.frame_number - expected < 0x80000000u) {  // wraps around
+      stats.missed += header.frame_number - expected;
+      stats.last_frame_number = header.frame_number;
+    } else {
+      ++stats.out_of_order;
+    }
+
+    // smoothed like the interarrival jitter of RFC 3550
+    double const interval =
+        std::chrono::duration<double, std::milli>(received - last_arrival).count();
+    if (stats.frames == 1) stats.interval_ms = interval;
+    stats.jitter_ms += (std::abs(interval - stats.interval_ms) - stats.jitter_ms) / 16;
+    stats.interval_ms += (interval - stats.interval_ms) / 16;
+  }
+  last_arrival = received;
+  ++stats.frames;
+  stats.bytes += bytes;
+
+  ++window_frames;
+  window_bytes += bytes;
+  double const window = std::chrono::duration<double>(received - window_start).count();
+  if (window >= 1.0) {
+    // the first frame of a window only marks its start
+    stats.fps = (window_frames - 1) / window;
+    stats.bytes_per_second = (window_bytes - bytes) / window;
+    window_start = received;
+    window_frames = 1;
+    window_bytes = bytes;
+  }
+}
+
+void live_view_monitor::reset() {
+  std::lock_guard<std::mutex> const lock(mutex);
+  stats = live_view_statistics();
+  window_frames = 0;
+  window_bytes = 0;
+}
+
+live_view_statistics live_view_monitor::statistics() const {
+  std::lock_guard<std::mutex> const lock(mutex);
+  return stats;
+}
+
+namespace {
+
+// receives one frame into f and checks its header, false if it was skipped
+bool receive_live_view_frame(native_socket const sockfd, frame& f, live_view_monitor* const monitor) {
+  if (receive_frame(sockfd, f) == 0) return false;
+
+  live_view_header header;
+  if (!parse_live_view_header(f.data(), f.size(), header)) {
+    log(LOG_DEBUG, string_format("receive_frames: skipped a %zu byte frame", f.size()));
+    return false;
+  }
+  if (monitor) monitor->add(header, f.size(), f.received());
+  return true;
+}
+
+}  // namespace
+
+uint64_t receive_frames(native_socket const sockfd, frame_pool& pool, latest_buffer<frame>& frames,
+                        std::atomic<bool> const& running, latency_stats* const latency,
+                        live_view_monitor* const monitor) {
+  uint64_t received = 0;
+  while (running) {
+    if (!wait_readable(sockfd, 100)) continue;
+
+    steady::time_point const start = steady::now();
+    // the back slot still holds the frame replaced by the last publish,
+    // its slab goes back to the pool first
+    frames.back().reset();
+    frame f = pool.acquire();
+    if (!receive_live_view_frame(sockfd, f, monitor)) continue;
+    if (latency) latency->add(f.received() - start);
+
+    frames.back() = std::move(f);
+    frames.publish();
+    ++received;
+  }
+  frames.back().reset();
+  frames.close();
+  return received;
+}
+
+uint64_t receive_frames(native_socket const sockfd, frame_pool& pool, frame_queue& queue,
+                        std::atomic<bool> const& running, live_view_monitor* const monitor) {
+  uint64_t received = 0;
+  while (running) {
+    if (!wait_readable(sockfd, 100)) continue;
+
+    frame f = pool.acquire();
+    if (!f && queue.drop_oldest()) f = pool.acquire();
+    if (!receive_live_view_frame(sockfd, f, monitor)) continue;
+
+    queue.push(std::move(f));
+    ++received;
+  }
+  return received;
+}
+
+}  // namespace fcwt
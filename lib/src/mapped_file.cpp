@@ -0,0 +1,104 @@
+#include "mapped_file.hpp"
+
+#include "log.hpp"
+
+#include <errno.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fcwt {
+
+mapped_file::~mapped_file() { close(); }
+
+#ifndef _WIN32
+
+bool mapped_file::open(char const* path, bool const writable, bool const create) {
+  close();
+  this->writable = writable || create;
+  int const flags = (this->writable ? O_RDWR : O_RDONLY) | (create ? O_CREAT : 0);
+  fd = ::open(path, flags, 0644);
+  if (fd < 0) {
+    log(LOG_ERROR, string_format("mapped_file: failed to open %s: %s", path, strerror(errno)));
+    return false;
+  }
+
+  struct stat st = {};
+  if (fstat(fd, &st) != 0) {
+    close();
+    return false;
+  }
+
+  sizeBytes = static_cast<size_t>(st.st_size);
+  if (!map()) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void mapped_file::close() {
+  unmap();
+  if (fd >= 0) ::close(fd);
+  fd = -1;
+  sizeBytes = 0;
+}
+
+bool mapped_file::resize(size_t const size) {
+  if (fd < 0 || !writable) return false;
+
+  unmap();
+  if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    log(LOG_ERROR, string_format("mapped_file: failed to resize to %zu bytes: %s", size, strerror(errno)));
+    map();
+    return false;
+  }
+  sizeBytes = size;
+  return map();
+}
+
+bool mapped_file::sync() {
+  if (!bytes) return true;
+  return msync(bytes, sizeBytes, MS_SYNC) == 0;
+}
+
+bool mapped_file::map() {
+  // mmap of an empty file fails, an empty file simply has no data
+  if (sizeBytes == 0) return true;
+
+  int const prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  void* const addr = mmap(nullptr, sizeBytes, prot, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    log(LOG_ERROR, string_format("mapped_file: mmap failed: %s", strerror(errno)));
+    return false;
+  }
+  bytes = static_cast<uint8_t*>(addr);
+  return true;
+}
+
+void mapped_file::unmap() {
+  if (bytes) munmap(bytes, sizeBytes);
+  bytes = nullptr;
+}
+
+#else
+
+bool mapped_file::open(char const*, bool, bool) {
+  log(LOG_ERROR, "mapped_file: not supported on this platform");
+  return false;
+}
+
+void mapped_file::close() {}
+bool mapped_file::resize(size_t) { return false; }
+bool mapped_file::sync() { return false; }
+bool mapped_file::map() { return false; }
+void mapped_file::unmap() {}
+
+#endif
+
+}  // namespace fcwt
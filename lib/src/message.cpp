@@ -1,5 +1,8 @@
 #include "message.hpp"
 
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
 #include <atomic>
 
 namespace fcwt {
@@ -46,6 +49,97 @@ bool fuji_message(native_socket const sockfd, uint32_t const id, void const* mes
   return true;
 }
 
+bool fuji_receive_response(native_socket const sockfd, uint32_t const id,
+                           std::vector<uint8_t>* data) {
+  std::vector<uint8_t> scratch;
+  std::vector<uint8_t>& buffer = data ? *data : scratch;
+  size_t receivedBytes = fuji_receive(sockfd, buffer);
+
+  uint16_t phase = 0;
+  if (receivedBytes >= message_header_bytes)
+    memcpy(&phase, buffer.data(), sizeof(phase));
+
+  if (phase != message_phase_data) {
+    bool const result = is_success_response(id, buffer.data(), receivedBytes);
+    buffer.clear();
+    return result;
+  }
+
+  buffer.erase(buffer.begin(), buffer.begin() + message_header_bytes);
+  receivedBytes = fuji_receive(sockfd, scratch);
+  return is_success_response(id, scratch.data(), receivedBytes);
+}
+
+bool fuji_receive_response(native_socket const sockfd, uint32_t const id,
+                           data_sink& sink) {
+  uint8_t chunk[16 * 1024];
+  for (;;) {
+    size_t const totalBytes = fuji_receive(sockfd, chunk, message_header_bytes);
+    if (totalBytes < message_header_bytes) {
+      sink.finish(false);
+      return false;
+    }
+
+    uint16_t phase = 0;
+    memcpy(&phase, chunk, sizeof(phase));
+    if (phase != message_phase_data) {
+      uint8_t response[message_header_bytes];
+      memcpy(response, chunk, sizeof(response));
+      // drain response parameters, if any
+      for (size_t remaining = totalBytes - message_header_bytes; remaining > 0;) {
+        size_t const n = std::min(remaining, sizeof(chunk));
+        receive_data(sockfd, chunk, n);
+        remaining -= n;
+      }
+      bool const result = is_success_response(id, response, totalBytes);
+      sink.finish(result);
+      return result;
+    }
+
+    for (size_t remaining = totalBytes - message_header_bytes; remaining > 0;) {
+      size_t const n = std::min(remaining, sizeof(chunk));
+      receive_data(sockfd, chunk, n);
+      sink.write(chunk, n);
+      remaining -= n;
+    }
+  }
+}
+
+namespace {
+
+class file_data_sink : public data_sink {
+  std::string path;
+  FILE* file = nullptr;
+  bool failed = false;
+
+ public:
+  explicit file_data_sink(std::string const& path) : path(path) {}
+  ~file_data_sink() { finish(false); }
+
+  void write(uint8_t const* data, size_t size) override {
+    if (!file && !failed) {
+      file = fopen(path.c_str(), "wb");
+      failed = !file;
+      if (failed) log(LOG_ERROR, string_format("failed to create %s", path.c_str()));
+    }
+    if (file && fwrite(data, 1, size, file) != size) failed = true;
+  }
+
+  void finish(bool success) override {
+    if (!file) return;
+    fclose(file);
+    file = nullptr;
+    if (!success || failed) remove(path.c_str());
+    else log(LOG_INFO, string_format("wrote %s", path.c_str()));
+  }
+};
+
+}  // namespace
+
+std::shared_ptr<data_sink> file_sink(std::string const& path) {
+  return std::make_shared<file_data_sink>(path);
+}
+
 bool is_success_response(uint32_t const id, void const* buffer,
                          size_t const size) {
   if (size != 8) return false;
@@ -0,0 +1,314 @@
+#include "mjpeg_recorder.hpp"
+
+#include "live_view.hpp"
+#include "log.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace fcwt {
+
+namespace {
+
+char const segment_magic[8] = "FCWTREC";
+
+uint64_t align8(uint64_t const offset) { return (offset + 7) & ~uint64_t(7); }
+
+#ifndef _WIN32
+
+// creates path with bytes allocated up front, so appending frames does not
+// have to allocate blocks and the file ends up contiguous
+int create_preallocated(char const* path, uint64_t const bytes) {
+  int const fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    log(LOG_ERROR, string_format("mjpeg_recorder: failed to create %s: %s", path, strerror(errno)));
+    return -1;
+  }
+#ifdef __linux__
+  int const error = fallocate(fd, 0, 0, static_cast<off_t>(bytes)) == 0 ? 0 : errno;
+#else
+  int const error = posix_fallocate(fd, 0, static_cast<off_t>(bytes));
+#endif
+  // not every file system can, the segment still works without
+  if (error != 0)
+    log(LOG_DEBUG, string_format("mjpeg_recorder: no preallocation for %s: %s", path, strerror(error)));
+  return fd;
+}
+
+bool write_at(int const fd, iovec* iov, int count, uint64_t offset) {
+  while (count > 0) {
+    ssize_t n = pwritev(fd, iov, count, static_cast<off_t>(offset));
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      log(LOG_ERROR, string_format("mjpeg_recorder: write failed: %s", strerror(errno)));
+      return false;
+    }
+    offset += static_cast<uint64_t>(n);
+    // skip what was written, a short write leaves the rest for the next call
+    while (count > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+      n -= static_cast<ssize_t>(iov->iov_len);
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + n;
+      iov->iov_len -= static_cast<size_t>(n);
+    }
+  }
+  return true;
+}
+
+bool write_at(int const fd, void const* data, size_t const size, uint64_t const offset) {
+  iovec iov = {const_cast<void*>(data), size};
+  return write_at(fd, &iov, 1, offset);
+}
+
+bool sync_file(int const fd) {
+#ifdef __linux__
+  return fdatasync(fd) == 0;
+#else
+  return fsync(fd) == 0;
+#endif
+}
+
+// drops the unused part of the preallocation
+bool truncate_file(int const fd, uint64_t const size) {
+  return ftruncate(fd, static_cast<off_t>(size)) == 0;
+}
+
+void close_file(int const fd) { ::close(fd); }
+
+#else
+
+struct iovec {
+  void* iov_base;
+  size_t iov_len;
+};
+
+int create_preallocated(char const*, uint64_t) {
+  log(LOG_ERROR, "mjpeg_recorder: not supported on this platform");
+  return -1;
+}
+
+bool write_at(int, iovec*, int, uint64_t) { return false; }
+bool write_at(int, void const*, size_t, uint64_t) { return false; }
+bool sync_file(int) { return false; }
+bool truncate_file(int, uint64_t) { return false; }
+void close_file(int) {}
+
+#endif
+
+}  // namespace
+
+mjpeg_recorder::mjpeg_recorder(mjpeg_recorder_options const& options)
+    : options(options), queue(options.queue_frames), written_(0), bytes_(0), segments_(0) {}
+
+mjpeg_recorder::~mjpeg_recorder() { stop(); }
+
+bool mjpeg_recorder::start() {
+  if (writer.joinable() || failed) return false;
+  if (!open_segment()) {
+    failed = true;
+    return false;
+  }
+  writer = std::thread([this]() { run(); });
+  return true;
+}
+
+void mjpeg_recorder::stop() {
+  queue.close();
+  if (writer.joinable()) writer.join();
+}
+
+void mjpeg_recorder::run() {
+  frame f;
+  while (queue.pop(f)) {
+    if (!failed && !append(f)) failed = true;
+    f.reset();
+  }
+  finish_segment();
+}
+
+bool mjpeg_recorder::append(frame const& f) {
+  live_view_header header;
+  if (!parse_live_view_header(f.data(), f.size(), header)) return true;
+
+  uint8_t const* const jpeg = f.data() + live_view_header_size;
+  size_t const size = f.size() - live_view_header_size;
+  uint64_t const record_bytes = sizeof(mjpeg_record_header) + size;
+  if (!entries.empty() && offset + record_bytes > options.segment_bytes) {
+    finish_segment();
+    ++segment;
+    if (!open_segment()) return false;
+  }
+
+  if (written_ == 0) first_frame = f.received();
+  mjpeg_record_header record = {};
+  record.size = static_cast<uint32_t>(size);
+  record.frame_number = header.frame_number;
+  record.timestamp_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(f.received() - first_frame).count();
+
+  // one syscall for the record header and the JPEG, straight from the slab
+  iovec iov[2] = {{&record, sizeof(record)}, {const_cast<uint8_t*>(jpeg), size}};
+  if (!write_at(fd, iov, 2, offset)) return false;
+
+  mjpeg_frame_entry entry = {};
+  entry.offset = offset + sizeof(record);
+  entry.timestamp_us = record.timestamp_us;
+  entry.size = record.size;
+  entry.frame_number = record.frame_number;
+  entries.push_back(entry);
+  offset += record_bytes;
+  ++written_;
+  bytes_ += size;
+
+  steady::time_point const now = steady::now();
+  if (options.sync == sync_policy::frame ||
+      (options.sync == sync_policy::interval && now - last_sync >= options.sync_interval)) {
+    sync_file(fd);
+    last_sync = now;
+  }
+  return true;
+}
+
+bool mjpeg_recorder::open_segment() {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s_%04u.fcwtrec", options.path_prefix.c_str(), segment);
+  fd = create_preallocated(path, options.segment_bytes);
+  if (fd < 0) return false;
+
+  // an unfinished header, readers scan the records until it is rewritten;
+  // the zeros of the preallocation end them
+  mjpeg_segment_header header = {};
+  memcpy(header.magic, segment_magic, sizeof(header.magic));
+  header.version = mjpeg_segment_version;
+  header.entry_bytes = sizeof(mjpeg_frame_entry);
+  header.segment = segment;
+  if (!write_at(fd, &header, sizeof(header), 0)) {
+    close_file(fd);
+    fd = -1;
+    return false;
+  }
+
+  offset = sizeof(header);
+  entries.clear();
+  entries.reserve(static_cast<size_t>(options.segment_bytes / (64 * 1024)));
+  last_sync = steady::now();
+  ++segments_;
+  log(LOG_INFO, string_format("mjpeg_recorder: recording to %s", path));
+  return true;
+}
+
+void mjpeg_recorder::finish_segment() {
+  if (fd < 0) return;
+
+  mjpeg_segment_header header = {};
+  memcpy(header.magic, segment_magic, sizeof(header.magic));
+  header.version = mjpeg_segment_version;
+  header.entry_bytes = sizeof(mjpeg_frame_entry);
+  header.entries_offset = align8(offset);
+  header.count = entries.size();
+  header.segment = segment;
+
+  // the table 8 byte aligned so it can be used in place when mapped
+  size_t const table_bytes = entries.size() * sizeof(mjpeg_frame_entry);
+  bool success = table_bytes == 0 || write_at(fd, entries.data(), table_bytes, header.entries_offset);
+  success = success && truncate_file(fd, header.entries_offset + table_bytes);
+  // the table must be on disk before the header points to it
+  if (options.sync != sync_policy::never) success = success && sync_file(fd);
+  success = success && write_at(fd, &header, sizeof(header), 0);
+  if (options.sync != sync_policy::never) success = success && sync_file(fd);
+  close_file(fd);
+  fd = -1;
+
+  if (!success)
+    log(LOG_ERROR, string_format("mjpeg_recorder: failed to finish segment %u", segment));
+}
+
+bool mjpeg_segment::open(char const* path) {
+  scanned.clear();
+  entries = nullptr;
+  count = 0;
+  if (!file.open(path, false)) return false;
+
+  mjpeg_segment_header header;
+  if (file.size() < sizeof(header)) {
+    log(LOG_ERROR, string_format("mjpeg_segment: %s is too small", path));
+    return false;
+  }
+  memcpy(&header, file.data(), sizeof(header));
+
+  if (memcmp(header.magic, segment_magic, sizeof(header.magic)) != 0 ||
+      header.version != mjpeg_segment_version ||
+      header.entry_bytes != sizeof(mjpeg_frame_entry) ||
+      header.entries_offset % 8 != 0 ||
+      header.entries_offset > file.size() ||
+      header.count > (file.size() - header.entries_offset) / sizeof(mjpeg_frame_entry)) {
+    log(LOG_ERROR, string_format("mjpeg_segment: %s is not a valid segment", path));
+    return false;
+  }
+  segment_ = header.segment;
+
+  if (header.entries_offset != 0) {
+    entries = reinterpret_cast<mjpeg_frame_entry const*>(file.data() + header.entries_offset);
+    count = static_cast<size_t>(header.count);
+    // the index is trusted no more than the records: every frame has to lie
+    // in the file before the index and start like a JPEG
+    for (size_t i = 0; i < count; ++i) {
+      mjpeg_frame_entry const& entry = entries[i];
+      if (entry.offset < sizeof(header) + sizeof(mjpeg_record_header) || entry.size < 2 ||
+          entry.offset > header.entries_offset || entry.size > header.entries_offset - entry.offset ||
+          file.data()[entry.offset] != 0xff || file.data()[entry.offset + 1] != 0xd8) {
+        log(LOG_ERROR, string_format("mjpeg_segment: %s has an invalid index entry %zu", path, i));
+        entries = nullptr;
+        count = 0;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // the recorder did not finish it, the records are intact up to the last
+  // one that was written completely
+  for (uint64_t offset = sizeof(header); offset + sizeof(mjpeg_record_header) <= file.size();) {
+    mjpeg_record_header record;
+    memcpy(&record, file.data() + offset, sizeof(record));
+    offset += sizeof(record);
+    if (record.size < 2 || record.size > file.size() - offset) break;
+    uint8_t const* const jpeg = file.data() + offset;
+    if (jpeg[0] != 0xff || jpeg[1] != 0xd8) break;  // no JPEG start of image
+
+    mjpeg_frame_entry entry = {};
+    entry.offset = offset;
+    entry.timestamp_us = record.timestamp_us;
+    entry.size = record.size;
+    entry.frame_number = record.frame_number;
+    scanned.push_back(entry);
+    offset += record.size;
+  }
+  log(LOG_WARN, string_format("mjpeg_segment: %s was not finished, found %zu frames", path, scanned.size()));
+  entries = scanned.data();
+  count = scanned.size();
+  return true;
+}
+
+size_t mjpeg_segment::seek(std::chrono::microseconds const timestamp) const {
+  if (count == 0) return count;
+  mjpeg_frame_entry const* const end = entries + count;
+  // timestamps only grow within a recording
+  mjpeg_frame_entry const* const after = std::upper_bound(
+      entries, end, timestamp.count(),
+      [](int64_t t, mjpeg_frame_entry const& e) { return t < e.timestamp_us; });
+  return after == entries ? 0 : static_cast<size_t>(after - entries) - 1;
+}
+
+}  // namespace fcwt
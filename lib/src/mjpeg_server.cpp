@@ -0,0 +1,341 @@
+#include "mjpeg_server.hpp"
+
+#include "live_view.hpp"
+#include "log.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#if FCWT_USE_BSD_SOCKETS
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace fcwt {
+
+namespace {
+
+char const stream_response[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Cache-Control: no-cache, no-store\r\n"
+    "Pragma: no-cache\r\n"
+    "Connection: close\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=fcwtframe\r\n"
+    "\r\n";
+
+char const not_allowed_response[] =
+    "HTTP/1.0 405 Method Not Allowed\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+char const busy_response[] =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+char const part_trailer[] = "\r\n";
+
+const size_t max_request_bytes = 8 * 1024;
+
+}  // namespace
+
+struct mjpeg_server::client {
+  native_socket sockfd = -1;
+  std::string request;  // until the end of its headers
+  bool streaming = false;
+  bool close_when_sent = false;
+
+  // pending output: head, then the JPEG of current and the part trailer
+  std::string head;
+  frame current;
+  size_t offset = 0;  // of the pending output written so far
+  uint64_t last_number = 0;
+
+  size_t jpeg_size() const { return current ? current.size() - live_view_header_size : 0; }
+  size_t pending_size() const {
+    return head.size() + (current ? jpeg_size() + sizeof(part_trailer) - 1 : 0);
+  }
+  bool pending() const { return offset < pending_size(); }
+};
+
+mjpeg_server::mjpeg_server() : stopping(false), connected(0), sent(0), skipped(0) {}
+
+mjpeg_server::~mjpeg_server() { stop(); }
+
+#if FCWT_USE_BSD_SOCKETS
+
+namespace {
+
+#ifdef MSG_NOSIGNAL
+const int send_flags = MSG_NOSIGNAL;
+#else
+const int send_flags = 0;
+#endif
+
+bool set_nonblocking(int const fd) {
+  int const flags = fcntl(fd, F_GETFL, 0);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// a disconnected client must not kill the tool with SIGPIPE
+void prepare_client_socket(int const fd) {
+  set_nonblocking(fd);
+#ifdef SO_NOSIGPIPE
+  int const on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+// a full pipe already wakes the server thread
+void wake(int const fd) {
+  char const byte = 0;
+  if (write(fd, &byte, 1) < 0 && errno != EAGAIN)
+    log(LOG_WARN, string_format("mjpeg_server: wake failed: %s", strerror(errno)));
+}
+
+void close_fd(int& fd) {
+  if (fd >= 0) ::close(fd);
+  fd = -1;
+}
+
+}  // namespace
+
+bool mjpeg_server::start(mjpeg_server_options const& opts) {
+  if (thread.joinable()) return false;
+  options = opts;
+
+  sockaddr_in sa = {};
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(options.port);
+  if (inet_pton(AF_INET, options.address, &sa.sin_addr) != 1) {
+    log(LOG_ERROR, string_format("mjpeg_server: invalid address %s", options.address));
+    return false;
+  }
+
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  int const on = 1;
+  if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+      bind(listener, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0 ||
+      listen(listener, 16) != 0 || !set_nonblocking(listener)) {
+    log(LOG_ERROR, string_format("mjpeg_server: failed to listen on %s:%u: %s", options.address,
+                                 options.port, strerror(errno)));
+    close_fd(listener);
+    return false;
+  }
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    close_fd(listener);
+    return false;
+  }
+  wake_read = fds[0];
+  wake_write = fds[1];
+  set_nonblocking(wake_read);
+  set_nonblocking(wake_write);
+
+  stopping = false;
+  thread = std::thread([this]() { run(); });
+  log(LOG_INFO, string_format("mjpeg_server: serving on http://%s:%u/", options.address, options.port));
+  return true;
+}
+
+void mjpeg_server::stop() {
+  if (!thread.joinable()) return;
+  stopping = true;
+  wake(wake_write);
+  thread.join();
+
+  close_fd(listener);
+  close_fd(wake_read);
+  close_fd(wake_write);
+  std::lock_guard<std::mutex> const lock(latest_mutex);
+  latest.reset();
+}
+
+void mjpeg_server::publish(frame const& f) {
+  if (!thread.joinable() || !f || f.size() <= live_view_header_size) return;
+  {
+    std::lock_guard<std::mutex> const lock(latest_mutex);
+    latest = f;
+    ++latest_number;
+  }
+  wake(wake_write);
+}
+
+void mjpeg_server::run() {
+  while (!stopping) {
+    fd_set readable;
+    fd_set writable;
+    FD_ZERO(&readable);
+    FD_ZERO(&writable);
+    FD_SET(listener, &readable);
+    FD_SET(wake_read, &readable);
+    int highest = std::max(listener, wake_read);
+    for (auto const& c : clients) {
+      // streaming clients are read too, to notice when they disconnect
+      FD_SET(c->sockfd, &readable);
+      if (c->pending()) FD_SET(c->sockfd, &writable);
+      highest = std::max(highest, c->sockfd);
+    }
+
+    struct timeval tv = {};
+    tv.tv_usec = 100 * 1000;
+    int const ready = select(highest + 1, &readable, &writable, nullptr, &tv);
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      log(LOG_ERROR, string_format("mjpeg_server: select failed: %s", strerror(errno)));
+      break;
+    }
+    if (ready > 0 && FD_ISSET(wake_read, &readable)) {
+      char drain[64];
+      while (read(wake_read, drain, sizeof(drain)) > 0) {
+      }
+    }
+
+    frame newest;
+    uint64_t number;
+    {
+      std::lock_guard<std::mutex> const lock(latest_mutex);
+      newest = latest;
+      number = latest_number;
+    }
+
+    for (auto& c : clients) {
+      bool keep = !(ready > 0 && FD_ISSET(c->sockfd, &readable)) || read_request(*c);
+      if (keep && c->pending()) keep = write_pending(*c);
+      // an idle client starts on the newest frame, whatever it missed while
+      // it was busy is skipped
+      while (keep && c->streaming && !c->pending() && newest && number > c->last_number) {
+        if (c->last_number != 0) skipped += number - c->last_number - 1;
+        c->last_number = number;
+        c->current = newest;
+        char part[128];
+        int const n = snprintf(part, sizeof(part),
+                               "--fcwtframe\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n",
+                               c->jpeg_size());
+        c->head.assign(part, static_cast<size_t>(n));
+        c->offset = 0;
+        keep = write_pending(*c);
+      }
+      if (!keep) close_fd(c->sockfd);
+    }
+    size_t const before = clients.size();
+    clients.erase(std::remove_if(clients.begin(), clients.end(),
+                                 [](std::unique_ptr<client> const& c) { return c->sockfd < 0; }),
+                  clients.end());
+    if (clients.size() != before)
+      log(LOG_INFO, string_format("mjpeg_server: %zu clients", clients.size()));
+
+    if (ready > 0 && FD_ISSET(listener, &readable)) accept_clients();
+    connected = clients.size();
+  }
+
+  for (auto& c : clients) close_fd(c->sockfd);
+  clients.clear();
+  connected = 0;
+}
+
+void mjpeg_server::accept_clients() {
+  for (;;) {
+    int const fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) return;  // EAGAIN once all pending connections are taken
+    prepare_client_socket(fd);
+
+    if (clients.size() >= options.max_clients) {
+      send(fd, busy_response, sizeof(busy_response) - 1, send_flags);  // best effort
+      ::close(fd);
+      log(LOG_WARN, "mjpeg_server: too many clients, turned one away");
+      continue;
+    }
+    std::unique_ptr<client> c(new client);
+    c->sockfd = fd;
+    clients.push_back(std::move(c));
+    log(LOG_INFO, string_format("mjpeg_server: %zu clients", clients.size()));
+  }
+}
+
+bool mjpeg_server::read_request(client& c) {
+  char buffer[1024];
+  ssize_t const n = recv(c.sockfd, buffer, sizeof(buffer), 0);
+  if (n == 0) return false;
+  if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  if (c.streaming || c.close_when_sent) return true;  // nothing else is expected
+
+  c.request.append(buffer, static_cast<size_t>(n));
+  if (c.request.find("\r\n\r\n") == std::string::npos)
+    return c.request.size() <= max_request_bytes;
+
+  // every path gets the stream
+  if (c.request.compare(0, 4, "GET ") == 0) {
+    c.streaming = true;
+    c.head = stream_response;
+  } else {
+    c.close_when_sent = true;
+    c.head = not_allowed_response;
+  }
+  c.offset = 0;
+  c.request.clear();
+  c.request.shrink_to_fit();
+  return true;
+}
+
+bool mjpeg_server::write_pending(client& c) {
+  while (c.pending()) {
+    // what is left of head, JPEG and trailer in one call
+    iovec iov[3];
+    int count = 0;
+    size_t skip = c.offset;
+    auto const add = [&](void const* data, size_t size) {
+      if (skip >= size) {
+        skip -= size;
+        return;
+      }
+      iov[count].iov_base = const_cast<uint8_t*>(static_cast<uint8_t const*>(data) + skip);
+      iov[count].iov_len = size - skip;
+      ++count;
+      skip = 0;
+    };
+    add(c.head.data(), c.head.size());
+    if (c.current) {
+      add(c.current.data() + live_view_header_size, c.jpeg_size());
+      add(part_trailer, sizeof(part_trailer) - 1);
+    }
+
+    msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t const n = sendmsg(c.sockfd, &msg, send_flags);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK;  // the rest goes once it is writable
+    }
+    c.offset += static_cast<size_t>(n);
+  }
+
+  if (c.current) ++sent;
+  c.current.reset();  // the slab can go back to the pool
+  c.head.clear();
+  c.offset = 0;
+  return !c.close_when_sent;
+}
+
+#else
+
+bool mjpeg_server::start(mjpeg_server_options const&) {
+  log(LOG_ERROR, "mjpeg_server: not supported on this platform");
+  return false;
+}
+
+void mjpeg_server::stop() {}
+void mjpeg_server::publish(frame const&) {}
+
+#endif
+
+}  // namespace fcwt
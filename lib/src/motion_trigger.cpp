@@ -0,0 +1,349 @@
+#include "motion_trigger.hpp"
+
+#include "camera_session.hpp"
+#include "commands.hpp"
+#include "log.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FCWT_MOTION_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FCWT_MOTION_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace fcwt {
+
+namespace {
+
+typedef std::chrono::steady_clock steady;
+
+#if FCWT_MOTION_X86
+// sum of the two 64 bit lanes, without the 64 bit only extracts
+__attribute__((target("sse4.1"))) inline uint64_t add_lanes(__m128i v) {
+  uint64_t lanes[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), v);
+  return lanes[0] + lanes[1];
+}
+#endif
+
+std::chrono::microseconds micros(steady::duration const d) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(d);
+}
+
+// pixels from x to width - 1 of one row
+void difference_row_scalar(uint8_t const* a, uint8_t const* b, int x, int width, uint8_t threshold,
+                           uint64_t& difference, uint64_t& changed) {
+  for (; x < width; ++x) {
+    int const d = std::abs(a[x] - b[x]);
+    difference += d;
+    changed += d > threshold;
+  }
+}
+
+int difference_row_none(uint8_t const*, uint8_t const*, int, uint8_t, uint64_t&, uint64_t&) { return 0; }
+
+#if FCWT_MOTION_X86
+
+// |a - b| from two saturating differences; psadbw sums it, and the pixels
+// above the threshold as ones, into 64 bit lanes that cannot overflow
+__attribute__((target("sse4.1"))) int difference_row_sse41(uint8_t const* a, uint8_t const* b, int width,
+                                                           uint8_t threshold, uint64_t& difference,
+                                                           uint64_t& changed) {
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const one = _mm_set1_epi8(1);
+  __m128i const limit = _mm_set1_epi8(static_cast<char>(threshold));
+  __m128i sums = zero;
+  __m128i counts = zero;
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i const va = _mm_loadu_si128(reinterpret_cast<__m128i const*>(a + x));
+    __m128i const vb = _mm_loadu_si128(reinterpret_cast<__m128i const*>(b + x));
+    __m128i const d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+    sums = _mm_add_epi64(sums, _mm_sad_epu8(d, zero));
+    counts = _mm_add_epi64(counts, _mm_sad_epu8(_mm_min_epu8(_mm_subs_epu8(d, limit), one), zero));
+  }
+  difference += add_lanes(sums);
+  changed += add_lanes(counts);
+  return x;
+}
+
+__attribute__((target("avx2"))) int difference_row_avx2(uint8_t const* a, uint8_t const* b, int width,
+                                                        uint8_t threshold, uint64_t& difference,
+                                                        uint64_t& changed) {
+  __m256i const zero = _mm256_setzero_si256();
+  __m256i const one = _mm256_set1_epi8(1);
+  __m256i const limit = _mm256_set1_epi8(static_cast<char>(threshold));
+  __m256i sums = zero;
+  __m256i counts = zero;
+  int x = 0;
+  for (; x + 32 <= width; x += 32) {
+    __m256i const va = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(a + x));
+    __m256i const vb = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(b + x));
+    __m256i const d = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+    sums = _mm256_add_epi64(sums, _mm256_sad_epu8(d, zero));
+    counts = _mm256_add_epi64(counts, _mm256_sad_epu8(_mm256_min_epu8(_mm256_subs_epu8(d, limit), one), zero));
+  }
+  __m128i const s = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+  __m128i const c = _mm_add_epi64(_mm256_castsi256_si128(counts), _mm256_extracti128_si256(counts, 1));
+  difference += add_lanes(s);
+  changed += add_lanes(c);
+  // the SSE code is not VEX encoded, it would stall on the dirty upper halves
+  _mm256_zeroupper();
+  return x + difference_row_sse41(a + x, b + x, width - x, threshold, difference, changed);
+}
+
+#elif FCWT_MOTION_NEON
+
+// 32 bit lanes hold the sums of 2^24 / 255 pixels, far more than a row
+int difference_row_neon(uint8_t const* a, uint8_t const* b, int width, uint8_t threshold,
+                        uint64_t& difference, uint64_t& changed) {
+  uint8x16_t const limit = vdupq_n_u8(threshold);
+  uint32x4_t sums = vdupq_n_u32(0);
+  uint32x4_t counts = vdupq_n_u32(0);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    uint8x16_t const d = vabdq_u8(vld1q_u8(a + x), vld1q_u8(b + x));
+    sums = vpadalq_u16(sums, vpaddlq_u8(d));
+    counts = vpadalq_u16(counts, vpaddlq_u8(vshrq_n_u8(vcgtq_u8(d, limit), 7)));
+  }
+  uint64x2_t const s = vpaddlq_u32(sums);
+  uint64x2_t const c = vpaddlq_u32(counts);
+  difference += vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1);
+  changed += vgetq_lane_u64(c, 0) + vgetq_lane_u64(c, 1);
+  return x;
+}
+
+#endif
+
+motion_kernels const scalar_kernels = {simd_level::scalar, difference_row_none};
+#if FCWT_MOTION_X86
+motion_kernels const sse41_kernels = {simd_level::sse41, difference_row_sse41};
+motion_kernels const avx2_kernels = {simd_level::avx2, difference_row_avx2};
+#elif FCWT_MOTION_NEON
+motion_kernels const neon_kernels = {simd_level::neon, difference_row_neon};
+#endif
+
+}  // namespace
+
+motion_kernels const* motion_kernels_for(simd_level const level) {
+  switch (level) {
+    case simd_level::scalar:
+      return &scalar_kernels;
+#if FCWT_MOTION_X86
+    case simd_level::sse41:
+      return __builtin_cpu_supports("sse4.1") ? &sse41_kernels : nullptr;
+    case simd_level::avx2:
+      return __builtin_cpu_supports("avx2") ? &avx2_kernels : nullptr;
+#elif FCWT_MOTION_NEON
+    case simd_level::neon:
+      return &neon_kernels;
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+motion_kernels const& best_motion_kernels() {
+  static motion_kernels const* const best = motion_kernels_for(best_color_kernels().level);
+  return *best;
+}
+
+motion_detector::motion_detector(motion_options const& options, motion_kernels const& kernels)
+    : kernels(&kernels), options(options) {}
+
+void motion_detector::reset() {
+  previous.clear();
+  image_width = image_height = 0;
+  frames_over = 0;
+}
+
+bool motion_detector::process(uint8_t const* const luma, size_t const luma_stride, int const width,
+                              int const height, motion_sample* const sample) {
+  if (sample) *sample = motion_sample();
+  if (width <= 0 || height <= 0) return false;
+
+  // at least one pixel, within the image
+  motion_region const& r = options.region;
+  int const left = std::min(std::max(static_cast<int>(std::lround(r.x * width)), 0), width - 1);
+  int const top = std::min(std::max(static_cast<int>(std::lround(r.y * height)), 0), height - 1);
+  int const columns = std::min(std::max(static_cast<int>(std::lround(r.width * width)), 1), width - left);
+  int const rows = std::min(std::max(static_cast<int>(std::lround(r.height * height)), 1), height - top);
+  uint8_t const* const region = luma + top * luma_stride + left;
+
+  bool const reference = width != image_width || height != image_height;
+  if (reference) {
+    image_width = width;
+    image_height = height;
+    frames_over = 0;
+    previous.resize(static_cast<size_t>(columns) * rows);
+  }
+
+  uint64_t difference = 0;
+  uint64_t changed = 0;
+  for (int y = 0; y < rows; ++y) {
+    uint8_t const* const row = region + y * luma_stride;
+    uint8_t* const last = previous.data() + static_cast<size_t>(y) * columns;
+    if (!reference) {
+      int const x = kernels->difference_row(last, row, columns, options.pixel_threshold, difference, changed);
+      difference_row_scalar(last, row, x, columns, options.pixel_threshold, difference, changed);
+    }
+    memcpy(last, row, columns);
+  }
+  if (reference) return false;
+
+  float const pixels = static_cast<float>(columns) * rows;
+  float const share = changed / pixels;
+  if (sample) {
+    sample->changed = share;
+    sample->mean_difference = difference / pixels;
+  }
+  frames_over = share >= options.trigger_share ? frames_over + 1 : 0;
+  if (frames_over < std::max(options.frames, 1u)) return false;
+  frames_over = 0;
+  return true;
+}
+
+void print(motion_shot_report const& report) {
+  printf("motion shot: %s\n", report.acked ? "acked" : "not acked");
+  printf("\tframe received to detected: %8.3f ms\n", report.detect.count() / 1000.0);
+  printf("\tdetected to sent:           %8.3f ms\n", report.send.count() / 1000.0);
+  printf("\tsent to acked:              %8.3f ms\n", report.ack.count() / 1000.0);
+  printf("\ttrigger to ack:             %8.3f ms\n", report.trigger_to_ack.count() / 1000.0);
+  printf("\tthumbnail:                  %8zu bytes\n", report.thumbnail_bytes);
+}
+
+const std::chrono::milliseconds motion_shutter::park_slice(100);
+
+motion_shutter::motion_shutter(camera_session& session) : session(session) {}
+
+motion_shutter::~motion_shutter() { disarm(); }
+
+bool motion_shutter::arm(std::string const& thumbnail_path) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (state_ != state::idle) return state_ == state::armed || state_ == state::yielding;
+    state_ = state::arming;
+  }
+  if (!session.is_connected()) {
+    log(LOG_ERROR, "motion shutter: not connected");
+    std::lock_guard<std::mutex> lock(mutex);
+    state_ = state::idle;
+    return false;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  thumbnail = thumbnail_path;
+  report = motion_shot_report();
+  // posted under the lock, the task cannot yield and replace parked before
+  parked = session.post([this](camera_io& io) { park(io); }, command_priority::shutter);
+  cv.wait(lock, [this]() { return state_ != state::arming; });
+  return state_ == state::armed;
+}
+
+void motion_shutter::park(camera_io& io) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (state_ == state::disarming || io.control <= 0) {
+    state_ = state::idle;
+    cv.notify_all();
+    return;
+  }
+  // everything fire() needs is ready before it may be called
+  set_no_delay(io.control, true);
+  release = make_static_message(message_type::shutter, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
+  control = io.control;
+  state_ = state::armed;
+  cv.notify_all();
+  auto const woken = [this]() { return state_ == state::fired || state_ == state::disarming; };
+  while (!cv.wait_for(lock, park_slice, woken)) {
+    // fire() may be sending, only an idle park yields
+    if (state_ != state::armed || session.queued() == 0) continue;
+    // parks again once the queued commands (and polls) ran
+    state_ = state::yielding;
+    control = 0;
+    set_no_delay(io.control, false);
+    parked = session.post([this](camera_io& io) { park(io); }, command_priority::poll);
+    return;
+  }
+  bool const fired = state_ == state::fired;
+  lock.unlock();
+
+  motion_shot_report shot;
+  if (fired) {
+    shot.acked = fuji_receive_response(io.control, release.id, nullptr);
+    steady::time_point const acked = steady::now();
+    lock.lock();
+    shot.detect = micros(detected - received);
+    shot.send = micros(sent - detected);
+    shot.ack = micros(acked - sent);
+    shot.trigger_to_ack = micros(acked - detected);
+    lock.unlock();
+
+    counting_sink sink(thumbnail.empty() ? nullptr : file_sink(thumbnail));
+    if (shot.acked && shutter_complete(io.control, io.async, sink)) shot.thumbnail_bytes = sink.bytes;
+  }
+  set_no_delay(io.control, false);
+
+  lock.lock();
+  report = shot;
+  control = 0;
+  state_ = state::idle;
+  cv.notify_all();
+}
+
+void motion_shutter::disarm() {
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [this]() { return state_ != state::arming; });
+  if (state_ == state::armed || state_ == state::yielding) {
+    state_ = state::disarming;
+    cv.notify_all();
+  }
+  // a shot in progress completes first
+  cv.wait(lock, [this]() { return state_ == state::idle; });
+  std::future<void> last = std::move(parked);
+  lock.unlock();
+  if (last.valid()) last.get();
+}
+
+bool motion_shutter::armed() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return state_ == state::armed || state_ == state::yielding;
+}
+
+bool motion_shutter::fire(steady::time_point const frame_received, steady::time_point const motion_detected) {
+  std::unique_lock<std::mutex> lock(mutex);
+  // a park that yielded is back once the commands queued before it ran
+  cv.wait(lock, [this]() { return state_ != state::yielding; });
+  if (state_ != state::armed) return false;
+  state_ = state::firing;
+  received = frame_received;
+  detected = motion_detected;
+  lock.unlock();
+
+  // the parked strand leaves this thread the only user of the socket
+  steady::time_point const now = steady::now();
+  fuji_send(control, &release, release.size());
+
+  lock.lock();
+  sent = now;
+  state_ = state::fired;
+  cv.notify_all();
+  lock.unlock();
+  log(LOG_INFO, "motion shutter: released");
+  return true;
+}
+
+motion_shot_report motion_shutter::wait() {
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [this]() { return state_ != state::firing && state_ != state::fired; });
+  if (state_ != state::idle) return motion_shot_report();  // armed, nothing fired
+  return report;
+}
+
+}  // namespace fcwt
@@ -0,0 +1,218 @@
+#include "scheduled_shutter.hpp"
+
+#include "camera_session.hpp"
+#include "commands.hpp"
+#include "control_channel.hpp"
+#include "log.hpp"
+#include "message.hpp"
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace fcwt {
+
+namespace {
+
+typedef std::chrono::steady_clock steady;
+typedef std::chrono::system_clock realtime;
+
+// coarse sleeps end this long before a deadline, the rest is spun
+const std::chrono::microseconds spin_margin(2000);
+
+std::chrono::microseconds micros(steady::duration const d) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(d);
+}
+
+// the realtime clock can be stepped (NTP), so the target is mapped to the
+// steady clock again after every sleep
+steady::time_point to_steady(realtime::time_point const at) {
+  realtime::time_point const now_real = realtime::now();
+  steady::time_point const now = steady::now();
+  return now + std::chrono::duration_cast<steady::duration>(at - now_real);
+}
+
+void sleep_until(steady::time_point const deadline) {
+  if (steady::now() < deadline - spin_margin)
+    std::this_thread::sleep_until(deadline - spin_margin);
+}
+
+// sleeps in slices that end early once cancelled is set, then spins; false
+// if cancelled
+bool wait_until(steady::time_point const deadline, std::atomic<bool> const& cancelled) {
+  steady::duration const slice = std::chrono::milliseconds(10);
+  while (!cancelled && steady::now() < deadline - spin_margin)
+    std::this_thread::sleep_until(std::min(steady::now() + slice, deadline - spin_margin));
+  while (!cancelled && steady::now() < deadline) {
+  }
+  return !cancelled;
+}
+
+}  // namespace
+
+const size_t rtt_estimator::window;
+
+void rtt_estimator::add(duration const rtt) {
+  samples[next] = rtt;
+  next = (next + 1) % window;
+  count = std::min(count + 1, window);
+}
+
+rtt_estimator::duration rtt_estimator::min() const {
+  if (count == 0) return duration::zero();
+  return *std::min_element(samples.begin(), samples.begin() + count);
+}
+
+rtt_estimator::duration rtt_estimator::max() const {
+  if (count == 0) return duration::zero();
+  return *std::max_element(samples.begin(), samples.begin() + count);
+}
+
+rtt_estimator::duration rtt_estimator::median() const {
+  if (count == 0) return duration::zero();
+  std::array<duration, window> sorted = samples;
+  std::nth_element(sorted.begin(), sorted.begin() + count / 2, sorted.begin() + count);
+  return sorted[count / 2];
+}
+
+scheduled_shutter::scheduled_shutter(native_socket const sockfd, native_socket const sockfd2,
+                                     std::timed_mutex* const io_lock)
+    : sockfd(sockfd), sockfd2(sockfd2), io_lock(io_lock), channel(nullptr), pipeline(nullptr),
+      session(nullptr), cancelled(false) {}
+
+scheduled_shutter::scheduled_shutter(control_channel& channel, shutter_pipeline& pipeline)
+    : sockfd(0), sockfd2(0), io_lock(nullptr), channel(&channel), pipeline(&pipeline),
+      session(nullptr), cancelled(false) {}
+
+scheduled_shutter::scheduled_shutter(camera_session& session)
+    : sockfd(0), sockfd2(0), io_lock(nullptr), channel(nullptr), pipeline(nullptr),
+      session(&session), cancelled(false) {}
+
+void scheduled_shutter::cancel() { cancelled = true; }
+
+bool scheduled_shutter::probe() {
+  if (channel) {
+    response const r = channel->request(generate<status_request_message>()).get();
+    if (r.success) rtt.add(r.completed - r.sent);
+    return r.success;
+  }
+  if (session)
+    return session->execute([this](camera_io& io) { return probe(io.control); },
+                            command_priority::poll);
+
+  std::unique_lock<std::timed_mutex> lock;
+  if (io_lock) lock = std::unique_lock<std::timed_mutex>(*io_lock);
+  return probe(sockfd);
+}
+
+bool scheduled_shutter::probe(native_socket const control) {
+  auto const msg = generate<status_request_message>();
+  std::vector<uint8_t> data;
+  steady::time_point const sent = steady::now();
+  fuji_send(control, msg);
+  bool const success = fuji_receive_response(control, msg.id, &data);
+  if (success) rtt.add(steady::now() - sent);
+  return success;
+}
+
+bool scheduled_shutter::release(native_socket const control, steady::time_point& sent,
+                                steady::time_point& acked) {
+  auto const msg = make_static_message(message_type::shutter, 0x00, 0x00, 0x00, 0x00,
+                                       0x00, 0x00, 0x00, 0x00);
+  sent = steady::now();
+  fuji_send(control, &msg, msg.size());
+  bool const success = fuji_receive_response(control, msg.id, nullptr);
+  acked = steady::now();
+  return success;
+}
+
+bool scheduled_shutter::fire_at(scheduled_shutter_options const& options,
+                                scheduled_shutter_report* report) {
+  if (sockfd <= 0 && !channel && !session) return false;
+
+  cancelled = false;
+  scheduled_shutter_report local;
+  if (!report) report = &local;
+  *report = scheduled_shutter_report();
+
+  // keep the estimate fresh until the guard time, the last probes are
+  // taken back to back
+  steady::duration const probe_block = rtt.max() * options.probes + options.guard;
+  while (!cancelled) {
+    steady::time_point const guard_start = to_steady(options.at) - options.guard;
+    steady::time_point const now = steady::now();
+    if (now >= guard_start - probe_block) break;
+    probe();
+    sleep_until(std::min(now + options.probe_interval, guard_start - probe_block));
+  }
+  for (unsigned i = 0; i < options.probes && !cancelled; ++i) {
+    if (steady::now() >= to_steady(options.at) - options.guard) break;
+    probe();
+  }
+  if (cancelled) return false;
+
+  // exclusive from here on
+  std::unique_lock<std::timed_mutex> lock;
+  if (io_lock) lock = std::unique_lock<std::timed_mutex>(*io_lock);
+  if (channel) channel->wait_idle();
+
+  steady::duration const lead = rtt.one_way();
+  steady::time_point send_at, sent, acked;
+  // the thumbnail transfer happens after the shot; a cancel is honoured up to
+  // the send
+  auto const shoot = [&](native_socket control, native_socket async) -> bool {
+    send_at = to_steady(options.at) - lead;
+    if (!wait_until(send_at, cancelled)) return false;
+    if (pipeline) {
+      response const r = pipeline->release_async(
+          options.thumbnail.empty() ? nullptr : file_sink(options.thumbnail)).get();
+      sent = r.sent;
+      acked = r.completed;
+      return r.success;
+    }
+    if (!release(control, sent, acked)) return false;
+    rtt.add(acked - sent);
+    return shutter_complete(control, async,
+                            options.thumbnail.empty() ? nullptr : options.thumbnail.c_str());
+  };
+  if (session)
+    report->success = session->execute(
+        [&](camera_io& io) { return shoot(io.control, io.async); }, command_priority::shutter);
+  else
+    report->success = shoot(sockfd, sockfd2);
+  if (cancelled && sent == steady::time_point()) {
+    log(LOG_INFO, "scheduled shutter cancelled");
+    return false;
+  }
+  if (report->success && pipeline) rtt.add(acked - sent);
+
+  report->rtt_samples = rtt.size();
+  report->rtt_min = micros(rtt.min());
+  report->rtt_median = micros(rtt.median());
+  report->rtt_max = micros(rtt.max());
+  report->lead = micros(lead);
+  report->send_error = micros(sent - send_at);
+  report->shutter_rtt = micros(acked - sent);
+  report->trigger_error = micros(sent + (acked - sent) / 2 - send_at - lead);
+  report->uncertainty = (report->rtt_max - report->rtt_min) / 2;
+  return report->success;
+}
+
+void print(scheduled_shutter_report const& report) {
+  printf("scheduled shutter%s:\n", report.success ? "" : " (FAILED)");
+  printf("\trtt: %zu samples, min %lld us, median %lld us, max %lld us\n", report.rtt_samples,
+         static_cast<long long>(report.rtt_min.count()),
+         static_cast<long long>(report.rtt_median.count()),
+         static_cast<long long>(report.rtt_max.count()));
+  printf("\tsent %lld us early, %lld us after the planned send\n",
+         static_cast<long long>(report.lead.count()),
+         static_cast<long long>(report.send_error.count()));
+  printf("\tshutter rtt %lld us, estimated trigger error %lld us (+/- %lld us)\n",
+         static_cast<long long>(report.shutter_rtt.count()),
+         static_cast<long long>(report.trigger_error.count()),
+         static_cast<long long>(report.uncertainty.count()));
+}
+
+}  // namespace fcwt
@@ -0,0 +1,288 @@
+#include "shm_export.hpp"
+
+#include "live_view.hpp"
+#include "log.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+namespace fcwt {
+
+static_assert(sizeof(shm_ring_header) == 64, "shm_ring_header is part of the shared layout");
+static_assert(sizeof(shm_slot_header) == 64, "shm_slot_header is part of the shared layout");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the ring needs address-free 64 bit atomics");
+
+namespace {
+
+size_t align64(size_t const size) { return (size + 63) & ~size_t(63); }
+
+#ifdef __linux__
+
+// futexes on a shared mapping work across processes
+void wake_readers(std::atomic<uint32_t>& word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+void wait_for_change(std::atomic<uint32_t> const& word, uint32_t const value,
+                     std::chrono::milliseconds const timeout) {
+  timespec ts;
+  ts.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+  ts.tv_nsec = static_cast<long>(timeout.count() % 1000) * 1000000;
+  syscall(SYS_futex, reinterpret_cast<uint32_t const*>(&word), FUTEX_WAIT, value, &ts, nullptr, 0);
+}
+
+#else
+
+void wake_readers(std::atomic<uint32_t>&) {}
+
+void wait_for_change(std::atomic<uint32_t> const&, uint32_t, std::chrono::milliseconds const timeout) {
+  std::this_thread::sleep_for(std::min(timeout, std::chrono::milliseconds(1)));
+}
+
+#endif
+
+}  // namespace
+
+#ifndef _WIN32
+
+shm_exporter::~shm_exporter() { close(); }
+
+bool shm_exporter::open(shm_export_options const& opts) {
+  close();
+  if (opts.slots == 0 || opts.slot_bytes == 0 || opts.slot_bytes > UINT32_MAX) {
+    log(LOG_ERROR, "shm_exporter: invalid ring size");
+    return false;
+  }
+  options = opts;
+
+  // readers of a leftover object keep it, they never see the new one
+  shm_unlink(options.name.c_str());
+  fd = shm_open(options.name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    log(LOG_ERROR, string_format("shm_exporter: failed to create %s: %s", options.name.c_str(),
+                                 strerror(errno)));
+    return false;
+  }
+
+  size_t const slot_stride = align64(sizeof(shm_slot_header) + options.slot_bytes);
+  memory_bytes = sizeof(shm_ring_header) + options.slots * slot_stride;
+  void* const mapped = ftruncate(fd, static_cast<off_t>(memory_bytes)) == 0
+                           ? mmap(nullptr, memory_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                           : MAP_FAILED;
+  if (mapped == MAP_FAILED) {
+    log(LOG_ERROR, string_format("shm_exporter: failed to map %s: %s", options.name.c_str(),
+                                 strerror(errno)));
+    ::close(fd);
+    fd = -1;
+    shm_unlink(options.name.c_str());
+    return false;
+  }
+
+  // the new object is zero filled: nothing published, every slot empty
+  memory = static_cast<uint8_t*>(mapped);
+  shm_ring_header* const header = reinterpret_cast<shm_ring_header*>(memory);
+  header->version = shm_ring_version;
+  header->slot_count = static_cast<uint32_t>(options.slots);
+  header->slot_bytes = options.slot_bytes;
+  header->slot_stride = slot_stride;
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(header->magic, shm_ring_magic, sizeof(header->magic));
+  published_ = 0;
+  oversized_ = 0;
+  log(LOG_INFO, string_format("shm_exporter: exporting the live view as %s", options.name.c_str()));
+  return true;
+}
+
+void shm_exporter::close() {
+  if (!memory) return;
+
+  shm_ring_header* const header = reinterpret_cast<shm_ring_header*>(memory);
+  header->closed.store(1, std::memory_order_release);
+  header->wake.fetch_add(1, std::memory_order_release);
+  wake_readers(header->wake);
+  munmap(memory, memory_bytes);
+  ::close(fd);
+  shm_unlink(options.name.c_str());
+  memory = nullptr;
+  fd = -1;
+}
+
+void shm_exporter::publish(frame const& f) {
+  if (!memory || f.size() <= live_view_header_size) return;
+
+  size_t const size = f.size() - live_view_header_size;
+  if (size > options.slot_bytes) {
+    ++oversized_;
+    return;
+  }
+  live_view_header frame_header;
+  parse_live_view_header(f.data(), f.size(), frame_header);
+
+  shm_ring_header* const header = reinterpret_cast<shm_ring_header*>(memory);
+  uint64_t const index = published_;
+  shm_slot_header* const slot = reinterpret_cast<shm_slot_header*>(
+      memory + sizeof(shm_ring_header) + (index % options.slots) * header->slot_stride);
+
+  // odd: readers that started on the previous frame of this slot fail
+  // their check from here on
+  slot->sequence.store(2 * index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->received_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              f.received().time_since_epoch()).count(),
+                          std::memory_order_relaxed);
+  slot->size.store(static_cast<uint32_t>(size), std::memory_order_relaxed);
+  slot->frame_number.store(frame_header.frame_number, std::memory_order_relaxed);
+  memcpy(reinterpret_cast<uint8_t*>(slot + 1), f.data() + live_view_header_size, size);
+  slot->sequence.store(2 * (index + 1), std::memory_order_release);
+
+  published_ = index + 1;
+  header->published.store(published_, std::memory_order_release);
+  header->wake.fetch_add(1, std::memory_order_release);
+  wake_readers(header->wake);
+}
+
+shm_reader::~shm_reader() { detach(); }
+
+bool shm_reader::attach(char const* const name) {
+  detach();
+  fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    log(LOG_DEBUG, string_format("shm_reader: no export %s: %s", name, strerror(errno)));
+    return false;
+  }
+
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(shm_ring_header);
+  void* mapped = MAP_FAILED;
+  if (ok) {
+    memory_bytes = static_cast<size_t>(st.st_size);
+    mapped = mmap(nullptr, memory_bytes, PROT_READ, MAP_SHARED, fd, 0);
+    ok = mapped != MAP_FAILED;
+  }
+  if (ok) {
+    memory = static_cast<uint8_t const*>(mapped);
+    shm_ring_header const* const h = header();
+    ok = memcmp(h->magic, shm_ring_magic, sizeof(h->magic)) == 0;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    ok = ok && h->version == shm_ring_version && h->slot_count > 0 &&
+         h->slot_stride >= sizeof(shm_slot_header) + h->slot_bytes &&
+         sizeof(shm_ring_header) + h->slot_count * h->slot_stride <= memory_bytes;
+  }
+  if (!ok) {
+    log(LOG_DEBUG, string_format("shm_reader: %s is not a live view export (yet)", name));
+    detach();
+    return false;
+  }
+  return true;
+}
+
+void shm_reader::detach() {
+  if (memory) munmap(const_cast<uint8_t*>(memory), memory_bytes);
+  if (fd >= 0) ::close(fd);
+  memory = nullptr;
+  fd = -1;
+}
+
+#else
+
+shm_exporter::~shm_exporter() {}
+
+bool shm_exporter::open(shm_export_options const&) {
+  log(LOG_ERROR, "shm_exporter: not supported on this platform");
+  return false;
+}
+
+void shm_exporter::close() {}
+void shm_exporter::publish(frame const&) {}
+
+shm_reader::~shm_reader() {}
+
+bool shm_reader::attach(char const*) {
+  log(LOG_ERROR, "shm_reader: not supported on this platform");
+  return false;
+}
+
+void shm_reader::detach() {}
+
+#endif
+
+shm_slot_header const* shm_reader::slot(uint64_t const index) const {
+  shm_ring_header const* const h = header();
+  return reinterpret_cast<shm_slot_header const*>(memory + sizeof(shm_ring_header) +
+                                                  (index % h->slot_count) * h->slot_stride);
+}
+
+uint64_t shm_reader::published() const {
+  return memory ? header()->published.load(std::memory_order_acquire) : 0;
+}
+
+bool shm_reader::closed() const {
+  return !memory || header()->closed.load(std::memory_order_acquire) != 0;
+}
+
+bool shm_reader::wait(uint64_t const index, std::chrono::milliseconds const timeout) const {
+  if (!memory) return false;
+
+  auto const deadline = std::chrono::steady_clock::now() + timeout;
+  shm_ring_header const* const h = header();
+  for (;;) {
+    // read before checking, a frame published in between changes it
+    uint32_t const wake = h->wake.load(std::memory_order_acquire);
+    if (h->published.load(std::memory_order_acquire) > index) return true;
+    if (h->closed.load(std::memory_order_acquire)) return false;
+
+    auto const left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    if (left.count() <= 0) return false;
+    wait_for_change(h->wake, wake, left);
+  }
+}
+
+bool shm_reader::acquire(uint64_t const index, shm_frame_view& view) const {
+  if (!memory) return false;
+
+  shm_slot_header const* const s = slot(index);
+  uint64_t const sequence = s->sequence.load(std::memory_order_acquire);
+  if (sequence != 2 * (index + 1)) return false;
+
+  view.index = index;
+  view.sequence = sequence;
+  view.jpeg = reinterpret_cast<uint8_t const*>(s + 1);
+  view.size = s->size.load(std::memory_order_relaxed);
+  view.frame_number = s->frame_number.load(std::memory_order_relaxed);
+  std::chrono::nanoseconds const received(s->received_ns.load(std::memory_order_relaxed));
+  view.received = std::chrono::steady_clock::time_point(
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(received));
+  // a size torn by the exporter must not point past the slot
+  if (view.size > header()->slot_bytes) view.size = 0;
+  return valid(view);
+}
+
+bool shm_reader::acquire_latest(shm_frame_view& view) const {
+  uint64_t const count = published();
+  return count > 0 && acquire(count - 1, view);
+}
+
+bool shm_reader::valid(shm_frame_view const& view) const {
+  if (!memory) return false;
+  // orders the reads of the frame before the check
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot(view.index)->sequence.load(std::memory_order_relaxed) == view.sequence;
+}
+
+}  // namespace fcwt
@@ -0,0 +1,277 @@
+#include "thumbnail_cache.hpp"
+
+#include "log.hpp"
+
+#include <string.h>
+#include <algorithm>
+
+namespace fcwt {
+
+namespace {
+
+const uint32_t thumbnail_cache_version = 1;
+const uint64_t initial_capacity = 256;
+
+int seek64(FILE* file, uint64_t offset, int whence) {
+#ifdef _WIN32
+  return _fseeki64(file, static_cast<__int64>(offset), whence);
+#else
+  return fseeko(file, static_cast<off_t>(offset), whence);
+#endif
+}
+
+uint64_t tell64(FILE* file) {
+#ifdef _WIN32
+  return static_cast<uint64_t>(_ftelli64(file));
+#else
+  return static_cast<uint64_t>(ftello(file));
+#endif
+}
+
+thumbnail_key key_of(thumbnail_cache::record const& rec) {
+  thumbnail_key key;
+  key.camera = rec.camera;
+  key.index = rec.index;
+  key.size = rec.size;
+  return key;
+}
+
+}  // namespace
+
+bool operator==(thumbnail_key const& a, thumbnail_key const& b) {
+  return a.camera == b.camera && a.index == b.index && a.size == b.size;
+}
+
+uint64_t camera_key(std::string const& camera) {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : camera) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+size_t thumbnail_key_hash::operator()(thumbnail_key const& key) const {
+  uint64_t const h = key.camera ^ (static_cast<uint64_t>(key.index) << 32 | key.size) * 0x9e3779b97f4a7c15ull;
+  return static_cast<size_t>(h ^ (h >> 32));
+}
+
+thumbnail_cache::~thumbnail_cache() { close(); }
+
+std::string thumbnail_cache::path(char const* name) const {
+  return directory + "/" + name;
+}
+
+thumbnail_cache::index_header& thumbnail_cache::header() {
+  return *reinterpret_cast<index_header*>(index_file.data());
+}
+
+thumbnail_cache::record* thumbnail_cache::records() {
+  return reinterpret_cast<record*>(index_file.data() + sizeof(index_header));
+}
+
+bool thumbnail_cache::open(char const* dir, uint64_t const budget_bytes) {
+  close();
+  directory = dir;
+  budget = budget_bytes;
+
+  if (!index_file.open(path("thumbnails.idx").c_str(), true, true))
+    return false;
+
+  index_header const* const existing = index_file.size() >= sizeof(index_header)
+      ? reinterpret_cast<index_header const*>(index_file.data()) : nullptr;
+  bool const valid = existing && memcmp(existing->magic, "FCWTTHC", 8) == 0 &&
+      existing->version == thumbnail_cache_version &&
+      existing->count <= existing->capacity &&
+      sizeof(index_header) + existing->capacity * sizeof(record) <= index_file.size();
+
+  pack = valid ? fopen(path("thumbnails.pack").c_str(), "r+b") : nullptr;
+  if (!pack) {
+    pack = fopen(path("thumbnails.pack").c_str(), "w+b");
+    if (!pack || !init_index()) {
+      log(LOG_ERROR, string_format("thumbnail_cache: failed to create cache in %s", dir));
+      close();
+      return false;
+    }
+  }
+
+  // drop records pointing past the end of the pack, e.g. after a crash
+  seek64(pack, 0, SEEK_END);
+  uint64_t const packSize = tell64(pack);
+  index_header& hdr = header();
+  record* const recs = records();
+  size_t live = 0;
+  for (size_t i = 0; i < hdr.count; ++i) {
+    if (recs[i].offset + recs[i].length > packSize) continue;
+    recs[live] = recs[i];
+    slots[key_of(recs[live])] = live;
+    ++live;
+  }
+  hdr.count = live;
+  hdr.pack_bytes = packSize;
+
+  log(LOG_INFO, string_format("thumbnail_cache: %zu thumbnails, %llu bytes", live,
+                              static_cast<unsigned long long>(packSize)));
+  return true;
+}
+
+void thumbnail_cache::close() {
+  if (pack) fclose(pack);
+  pack = nullptr;
+  index_file.sync();
+  index_file.close();
+  slots.clear();
+}
+
+bool thumbnail_cache::init_index() {
+  if (!index_file.resize(sizeof(index_header) + initial_capacity * sizeof(record)))
+    return false;
+
+  index_header& hdr = header();
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, "FCWTTHC", 8);
+  hdr.version = thumbnail_cache_version;
+  hdr.capacity = initial_capacity;
+  return true;
+}
+
+bool thumbnail_cache::reserve(uint64_t const capacity) {
+  if (capacity <= header().capacity) return true;
+
+  uint64_t const newCapacity = std::max(capacity, header().capacity * 2);
+  if (!index_file.resize(sizeof(index_header) + newCapacity * sizeof(record)))
+    return false;
+  header().capacity = newCapacity;
+  return true;
+}
+
+size_t thumbnail_cache::count() const {
+  return slots.size();
+}
+
+uint64_t thumbnail_cache::pack_bytes() const {
+  return index_file.size() >= sizeof(index_header)
+      ? reinterpret_cast<index_header const*>(index_file.data())->pack_bytes : 0;
+}
+
+bool thumbnail_cache::find(thumbnail_key const& key, std::vector<uint8_t>& jpeg) {
+  if (!pack) return false;
+
+  auto const it = slots.find(key);
+  if (it == slots.end()) return false;
+
+  record& rec = records()[it->second];
+  jpeg.resize(rec.length);
+  if (seek64(pack, rec.offset, SEEK_SET) != 0 ||
+      fread(jpeg.data(), 1, rec.length, pack) != rec.length) {
+    log(LOG_WARN, string_format("thumbnail_cache: failed to read thumbnail %u", key.index));
+    return false;
+  }
+
+  rec.last_used = ++header().use_counter;
+  return true;
+}
+
+bool thumbnail_cache::insert(thumbnail_key const& key, uint8_t const* jpeg, size_t const size) {
+  if (!pack || !jpeg || size == 0) return false;
+
+  if (seek64(pack, 0, SEEK_END) != 0) return false;
+  uint64_t const offset = tell64(pack);
+  if (fwrite(jpeg, 1, size, pack) != size || fflush(pack) != 0) {
+    log(LOG_ERROR, "thumbnail_cache: failed to append to pack");
+    return false;
+  }
+
+  // a replaced thumbnail stays in the pack until the next eviction
+  auto it = slots.find(key);
+  if (it == slots.end()) {
+    if (!reserve(header().count + 1)) return false;
+    it = slots.insert(std::make_pair(key, static_cast<size_t>(header().count))).first;
+  }
+
+  record& rec = records()[it->second];
+  rec.camera = key.camera;
+  rec.index = key.index;
+  rec.size = key.size;
+  rec.offset = offset;
+  rec.length = static_cast<uint32_t>(size);
+  rec.last_used = ++header().use_counter;
+
+  // count is only bumped once the record is complete
+  index_header& hdr = header();
+  hdr.count = std::max<uint64_t>(hdr.count, it->second + 1);
+  hdr.pack_bytes = offset + size;
+
+  if (budget > 0 && hdr.pack_bytes > budget)
+    return evict();
+  return true;
+}
+
+bool thumbnail_cache::evict() {
+  index_header& hdr = header();
+  record* const recs = records();
+
+  // keep the most recently used thumbnails up to 3/4 of the budget so the
+  // pack is not rewritten on every insert
+  std::vector<record> kept(recs, recs + hdr.count);
+  std::sort(kept.begin(), kept.end(), [](record const& a, record const& b) {
+    return a.last_used > b.last_used;
+  });
+
+  uint64_t const target = budget / 4 * 3;
+  uint64_t total = 0;
+  size_t keep = 0;
+  while (keep < kept.size() && total + kept[keep].length <= target)
+    total += kept[keep++].length;
+  kept.resize(keep);
+
+  std::string const tmpPath = path("thumbnails.pack.tmp");
+  FILE* const out = fopen(tmpPath.c_str(), "w+b");
+  if (!out) {
+    log(LOG_ERROR, "thumbnail_cache: failed to create new pack");
+    return false;
+  }
+
+  bool success = true;
+  std::vector<uint8_t> buffer;
+  uint64_t offset = 0;
+  for (record& rec : kept) {
+    buffer.resize(rec.length);
+    success = seek64(pack, rec.offset, SEEK_SET) == 0 &&
+              fread(buffer.data(), 1, rec.length, pack) == rec.length &&
+              fwrite(buffer.data(), 1, rec.length, out) == rec.length;
+    if (!success) break;
+    rec.offset = offset;
+    offset += rec.length;
+  }
+
+  success = fflush(out) == 0 && success;
+  fclose(out);
+  fclose(pack);
+  pack = nullptr;
+
+  std::string const packPath = path("thumbnails.pack");
+  if (!success || rename(tmpPath.c_str(), packPath.c_str()) != 0) {
+    log(LOG_ERROR, "thumbnail_cache: failed to rewrite pack, keeping the old one");
+    remove(tmpPath.c_str());
+    pack = fopen(packPath.c_str(), "r+b");
+    return false;
+  }
+
+  pack = fopen(packPath.c_str(), "r+b");
+  slots.clear();
+  for (size_t i = 0; i < kept.size(); ++i) {
+    recs[i] = kept[i];
+    slots[key_of(kept[i])] = i;
+  }
+  hdr.count = kept.size();
+  hdr.pack_bytes = offset;
+  index_file.sync();
+
+  log(LOG_INFO, string_format("thumbnail_cache: evicted down to %zu thumbnails, %llu bytes",
+                              kept.size(), static_cast<unsigned long long>(offset)));
+  return pack != nullptr;
+}
+
+}  // namespace fcwt
@@ -0,0 +1,179 @@
+#include "v4l2_output.hpp"
+
+#include "color_convert.hpp"
+#include "log.hpp"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+namespace fcwt {
+
+size_t frame_size(v4l2_pixel_format const format, int const width, int const height) {
+  size_t const pixels = static_cast<size_t>(width) * static_cast<size_t>(height);
+  switch (format) {
+    case v4l2_pixel_format::mjpeg:
+      return 0;
+    case v4l2_pixel_format::bgr24:
+      return pixels * 3;
+    case v4l2_pixel_format::yuyv:
+      return pixels * 2;
+    case v4l2_pixel_format::nv12:
+      return pixels * 3 / 2;
+  }
+  FCWT_UNREACHABLE;
+}
+
+v4l2_output::~v4l2_output() { close(); }
+
+bool v4l2_output::write_bgr(uint8_t const* const bgr, size_t const stride) {
+  size_t const pixels = static_cast<size_t>(width_) * static_cast<size_t>(height_);
+  switch (format_) {
+    case v4l2_pixel_format::mjpeg:
+      log(LOG_ERROR, "v4l2_output: the device takes JPEGs");
+      return false;
+    case v4l2_pixel_format::bgr24:
+      if (stride == static_cast<size_t>(width_) * 3) return write(bgr, pixels * 3);
+      converted.resize(pixels * 3);
+      for (int row = 0; row < height_; ++row)
+        memcpy(&converted[row * width_ * 3], bgr + row * stride, width_ * 3);
+      break;
+    case v4l2_pixel_format::yuyv:
+      converted.resize(pixels * 2);
+      bgr_to_yuyv(bgr, stride, width_, height_, converted.data(), width_ * 2);
+      break;
+    case v4l2_pixel_format::nv12:
+      converted.resize(pixels * 3 / 2);
+      bgr_to_nv12(bgr, stride, width_, height_, converted.data(), width_, converted.data() + pixels, width_);
+      break;
+  }
+  return write(converted.data(), converted.size());
+}
+
+#ifdef __linux__
+
+namespace {
+
+uint32_t fourcc(v4l2_pixel_format const format) {
+  switch (format) {
+    case v4l2_pixel_format::mjpeg:
+      return V4L2_PIX_FMT_MJPEG;
+    case v4l2_pixel_format::bgr24:
+      return V4L2_PIX_FMT_BGR24;
+    case v4l2_pixel_format::yuyv:
+      return V4L2_PIX_FMT_YUYV;
+    case v4l2_pixel_format::nv12:
+      return V4L2_PIX_FMT_NV12;
+  }
+  FCWT_UNREACHABLE;
+}
+
+uint32_t bytes_per_line(v4l2_pixel_format const format, int const width) {
+  switch (format) {
+    case v4l2_pixel_format::mjpeg:
+      return 0;
+    case v4l2_pixel_format::bgr24:
+      return static_cast<uint32_t>(width) * 3;
+    case v4l2_pixel_format::yuyv:
+      return static_cast<uint32_t>(width) * 2;
+    case v4l2_pixel_format::nv12:
+      return static_cast<uint32_t>(width);  // of the Y plane
+  }
+  FCWT_UNREACHABLE;
+}
+
+}  // namespace
+
+bool v4l2_output::open(char const* const device, v4l2_pixel_format const format, int const width,
+                       int const height, size_t const frame_bytes) {
+  close();
+  if (format != v4l2_pixel_format::mjpeg && format != v4l2_pixel_format::bgr24 &&
+      (width % 2 != 0 || height % 2 != 0)) {
+    log(LOG_ERROR, string_format("v4l2_output: %dx%d can't be subsampled", width, height));
+    return false;
+  }
+  fd = ::open(device, O_WRONLY);
+  if (fd < 0) {
+    log(LOG_ERROR, string_format("Error opening v4l2l device: %s", strerror(errno)));
+    return false;
+  }
+
+  struct v4l2_format v = {};
+  v.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+  if (ioctl(fd, VIDIOC_G_FMT, &v) < 0) {
+    log(LOG_ERROR, string_format("ioctl error with setting up v4l2l device: %s", strerror(errno)));
+    close();
+    return false;
+  }
+
+  v.fmt.pix.width = static_cast<uint32_t>(width);
+  v.fmt.pix.height = static_cast<uint32_t>(height);
+  v.fmt.pix.pixelformat = fourcc(format);
+  v.fmt.pix.field = V4L2_FIELD_NONE;
+  v.fmt.pix.bytesperline = bytes_per_line(format, width);
+  v.fmt.pix.sizeimage = static_cast<uint32_t>(format == v4l2_pixel_format::mjpeg ? frame_bytes
+                                                                                 : frame_size(format, width, height));
+  switch (format) {
+    case v4l2_pixel_format::mjpeg:
+      v.fmt.pix.colorspace = V4L2_COLORSPACE_JPEG;
+      break;
+    case v4l2_pixel_format::bgr24:
+      v.fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
+      break;
+    case v4l2_pixel_format::yuyv:
+    case v4l2_pixel_format::nv12:
+      v.fmt.pix.colorspace = V4L2_COLORSPACE_SMPTE170M;  // BT.601
+      break;
+  }
+  if (ioctl(fd, VIDIOC_S_FMT, &v) < 0) {
+    log(LOG_ERROR, string_format("ioctl error with v4l2l device format: %s", strerror(errno)));
+    close();
+    return false;
+  }
+
+  format_ = format;
+  width_ = width;
+  height_ = height;
+  log(LOG_INFO, string_format("v4l2 output %s: %dx%d", device, width, height));
+  return true;
+}
+
+void v4l2_output::close() {
+  if (fd >= 0) ::close(fd);
+  fd = -1;
+}
+
+bool v4l2_output::write(void const* const data, size_t const size) {
+  if (fd < 0) return false;
+  ssize_t written;
+  do {
+    written = ::write(fd, data, size);
+  } while (written < 0 && errno == EINTR);
+
+  if (written < 0) {
+    log(LOG_ERROR, string_format("error writing data to v4l2l: %s", strerror(errno)));
+    close();
+    return false;
+  }
+  return true;
+}
+
+#else
+
+bool v4l2_output::open(char const*, v4l2_pixel_format, int, int, size_t) {
+  log(LOG_ERROR, "v4l2_output: not supported on this platform");
+  return false;
+}
+
+void v4l2_output::close() {}
+bool v4l2_output::write(void const*, size_t) { return false; }
+
+#endif
+
+}  // namespace fcwt
@@ -4,10 +4,31 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "log.hpp"
 #include "comm.hpp"
 #include "commands.hpp"
+#include "browse.hpp"
+#include "thumbnail_cache.hpp"
+#include "capability_cache.hpp"
+#include "intervalometer.hpp"
+#include "control_channel.hpp"
+#include "bracketing.hpp"
+#include "camera_session.hpp"
+#include "scheduled_shutter.hpp"
+#include "frame_pool.hpp"
+#include "live_view.hpp"
+#include "mjpeg_recorder.hpp"
+#include "mjpeg_server.hpp"
+#include "v4l2_output.hpp"
+#include "color_convert.hpp"
+#include "jpeg_decoder.hpp"
+#include "shm_export.hpp"
+#include "focus_peaking.hpp"
+#include "histogram.hpp"
+#include "auto_focus.hpp"
+#include "motion_trigger.hpp"
 
 #include "linenoise.h"
 
@@ -17,26 +38,38 @@
 #include <string>
 #include <atomic>
 #include <algorithm>
+#include <cmath>
 #include <mutex>
+#include <memory>
 
 #ifdef WITH_OPENCV
 #include <opencv2/opencv.hpp>
-#include <sys/ioctl.h>
-#include <linux/videodev2.h>
-#include <fcntl.h>
-#include <unistd.h>
 
 using namespace cv;
 #endif
 
 namespace fcwt {
 
-sock sockfd;
-
 log_settings log_conf;
 
-current_properties settings;
-std::timed_mutex g_comm_lock;
+// the camera of the single camera commands; its strand serializes the control
+// traffic of the REPL, the display thread and the timelapse
+camera_session session;
+
+// thumbnails of browsed images, kept in the working directory
+thumbnail_cache thumb_cache;
+const uint64_t thumb_cache_budget = 256 * 1024 * 1024;
+capability_cache caps_cache;
+std::string camera_name = "camera";  // identity of the connected camera
+
+// live view frames are received into a fixed pool: the queue to the consumer,
+// the frame it works on and the one being received
+const size_t live_view_frame_bytes = 1024 * 1024;
+const size_t live_view_queue_depth = 2;
+const size_t live_view_pool_frames = live_view_queue_depth + 2;
+const size_t live_view_record_depth = 8;  // frames waiting for the disk
+live_view_latency live_view_timing;  // of stream_cv
+live_view_monitor live_view_link;    // of the last stream or stream_cv
 
 // On X-T100 at least the auto-focus points are specified with these ranges.
 // Not sure how we get the ranges from the camera..
@@ -47,6 +80,13 @@ std::timed_mutex g_comm_lock;
 #define POINTS_X 0xd
 #define POINTS_Y 0x7
 
+// focus peaking scores the cells of the focus point grid, cell x, y is
+// focus point x, y
+const uint8_t focus_peaking_threshold = 48;
+std::mutex live_view_analysis_mutex;  // guards the members below
+sharpness_map live_view_sharpness;  // of the last image stream_cv decoded
+exposure_stats live_view_exposure;  // ditto
+
 auto_focus_point requested_focus_point = 0;
 bool set_focus(int x, int y) {
     if( x < 1 || x > POINTS_X || y < 1 || y > POINTS_Y )
@@ -59,15 +99,166 @@ bool set_focus(int x, int y) {
 
     log(LOG_DEBUG, string_format("Set focus point %d x %d", x, y));
 
-    if (update_setting(sockfd, requested_focus_point)) {
+    // queued ahead of settings and polls, so a tap is never dropped
+    auto_focus_point const point = requested_focus_point;
+    session.post([point](camera_io& io) {
         // TODO: Decode if it got focused or not successfully (red/green bracket)
-        if (current_settings(sockfd, settings))
-          print(settings);
+        if (update_setting(io.control, point) && io.refresh_settings())
+          print(io.settings);
+        else
+          log(LOG_ERROR, string_format("Failed to adjust focus point"));
+    }, command_priority::focus);
+    return true;
+}
+
+// the luma of a live view frame: libjpeg decodes only that, OpenCV the
+// whole image; both scale while decoding
+bool decode_luma(jpeg_decoder& decoder, uint8_t const* jpeg, size_t size, std::vector<uint8_t>& luma,
+                 int& width, int& height, jpeg_scale const scale = jpeg_scale::full) {
+  if (jpeg_decoder::available()) {
+    if (!jpeg_decoder::read_header(jpeg, size, width, height)) return false;
+    jpeg_decoder::scaled_size(width, height, scale, width, height);
+    luma.resize(static_cast<size_t>(width) * height);  // only grows
+    return decoder.decode(jpeg, size, scale, jpeg_pixel_format::gray, luma.data(), width,
+                          luma.size(), width, height);
+  }
+#ifdef WITH_OPENCV
+  int const flags = scale == jpeg_scale::half      ? cv::IMREAD_REDUCED_GRAYSCALE_2
+                    : scale == jpeg_scale::quarter ? cv::IMREAD_REDUCED_GRAYSCALE_4
+                    : scale == jpeg_scale::eighth  ? cv::IMREAD_REDUCED_GRAYSCALE_8
+                                                   : cv::IMREAD_GRAYSCALE;
+  Mat const rawData(1, static_cast<int>(size), CV_8UC1, const_cast<uint8_t*>(jpeg));
+  Mat const gray = imdecode(rawData, flags);
+  if (gray.empty() || !gray.isContinuous()) return false;
+  width = gray.cols;
+  height = gray.rows;
+  luma.assign(gray.data, gray.data + gray.total());
+  return true;
+#else
+  log(LOG_ERROR, "decoding live view images needs libjpeg or OpenCV");
+  return false;
+#endif
+}
+
+// Scores every AF point on live view frames, focuses on the one the rule
+// picks and scores again once the lens has settled
+void auto_focus_main(std::atomic<bool>& flag, focus_rule const rule, std::chrono::milliseconds const settle) {
+  typedef std::chrono::steady_clock steady;
+  if (!session.open_stream()) return;
+
+  frame_pool pool(live_view_pool_frames, live_view_frame_bytes);
+  latest_buffer<frame> frames;
+  std::atomic<bool> running(true);
+  std::thread receiver([&]() { receive_frames(session.stream_socket(), pool, frames, running); });
+
+  focus_grid_scorer scorer(POINTS_X, POINTS_Y);
+  jpeg_decoder decoder;
+  std::vector<uint8_t> luma;
+  // the mean of a few frames received after start, against noise
+  auto const score_frames = [&](steady::time_point const start, sharpness_map& points) -> bool {
+    int const count = 3;
+    int scored = 0;
+    sharpness_map frame_points;
+    steady::time_point const timeout = std::max(start, steady::now()) + std::chrono::seconds(5);
+    while (scored < count && flag && steady::now() < timeout && !frames.is_closed()) {
+      if (!frames.wait(std::chrono::milliseconds(100))) continue;
+      frame& f = frames.front();
+      int width, height;
+      bool const ok = f.received() >= start &&
+                      decode_luma(decoder, f.data() + live_view_header_size,
+                                  f.size() - live_view_header_size, luma, width, height);
+      f.reset();
+      if (!ok) continue;
+
+      scorer.score(luma.data(), width, width, height, frame_points);
+      if (scored++ == 0)
+        points = frame_points;
+      else
+        for (size_t i = 0; i < points.scores.size(); ++i) points.scores[i] += frame_points.scores[i];
+    }
+    for (float& score : points.scores) score /= std::max(scored, 1);
+    return scored == count;
+  };
+
+  sharpness_map before;
+  sharpness_map after;
+  if (!score_frames(steady::now(), before)) {
+    log(LOG_ERROR, "auto focus: no live view images");
+  } else {
+    print(before);
+    auto_focus_point const point = choose_focus_point(before, rule, session.setting(property_focus_point));
+    requested_focus_point = point;
+    if (!session.focus(point).get()) {
+      log(LOG_ERROR, "auto focus: failed to set the focus point");
+    } else if (!score_frames(steady::now() + settle, after)) {
+      log(LOG_ERROR, "auto focus: no live view images after focusing");
     } else {
-        log(LOG_ERROR, string_format("Failed to adjust focus point"));
-        return false;
+      print(after);
+      print(confirm_focus_point(before, after, point, rule));
     }
-    return true;
+  }
+
+  running = false;
+  receiver.join();
+  session.close_stream();
+}
+
+// Releases the shutter when the live view shows motion in the region: frames
+// are decoded at a quarter of their size and compared with the previous one,
+// the armed trigger sends the release right from this thread. After a shot
+// the trigger is armed again and the frames shown during the capture become
+// the new reference.
+void motion_trigger_main(std::atomic<bool>& flag, motion_options const options, unsigned const shots) {
+  log(LOG_INFO, "motion_trigger_main");
+  if (!session.open_stream()) return;
+  live_view_link.reset();
+
+  frame_pool pool(live_view_pool_frames, live_view_frame_bytes);
+  latest_buffer<frame> frames;
+  std::atomic<bool> running(true);  // until the shots are taken or flag is cleared
+  std::thread receiver([&]() {
+    receive_frames(session.stream_socket(), pool, frames, running, nullptr, &live_view_link);
+  });
+
+  motion_shutter trigger(session);
+  motion_detector detector(options);
+  jpeg_decoder decoder;
+  std::vector<uint8_t> luma;
+  unsigned taken = 0;
+  latency_stats trigger_to_ack;
+  std::chrono::steady_clock::time_point armed = std::chrono::steady_clock::now();
+  bool ok = trigger.arm(string_format("motion_%03u.jpg", taken));
+  while (ok && flag && !frames.is_closed() && (shots == 0 || taken < shots)) {
+    if (!frames.wait(std::chrono::milliseconds(100))) continue;
+    frame& f = frames.front();
+    std::chrono::steady_clock::time_point const received = f.received();
+    int width, height;
+    bool const decoded = received >= armed &&
+                         decode_luma(decoder, f.data() + live_view_header_size,
+                                     f.size() - live_view_header_size, luma, width, height,
+                                     jpeg_scale::quarter);
+    f.reset();
+    if (!decoded || !detector.process(luma.data(), width, width, height)) continue;
+
+    if (!trigger.fire(received, std::chrono::steady_clock::now())) break;
+    motion_shot_report const report = trigger.wait();
+    print(report);
+    if (report.acked) trigger_to_ack.add(report.trigger_to_ack);
+    ++taken;
+
+    detector.reset();
+    armed = std::chrono::steady_clock::now();
+    if (shots == 0 || taken < shots) ok = trigger.arm(string_format("motion_%03u.jpg", taken));
+  }
+  trigger.disarm();
+  running = false;
+  receiver.join();
+  printf("motion trigger: %u shots\n", taken);
+  if (trigger_to_ack.count() > 0)
+    printf("\ttrigger to ack: mean %lld us, max %lld us\n",
+           static_cast<long long>(trigger_to_ack.mean().count()),
+           static_cast<long long>(trigger_to_ack.max().count()));
+  session.close_stream();
 }
 
 #ifdef WITH_OPENCV
@@ -82,48 +273,12 @@ static void onMouse( int event, int x, int y, int, void* )
     float x_perc = (float)x / win_size.width;
     float y_perc = (float)y / win_size.height;
 
-    // We are running on display thread
-    if(g_comm_lock.try_lock_for(std::chrono::milliseconds(10))) {
-        set_focus(x_perc * (2+POINTS_X), y_perc * (2+POINTS_Y));
-        g_comm_lock.unlock();
-    } else {
-        log(LOG_ERROR, string_format("Failed to get control mutex"));
-    }
+    // We are running on display thread, set_focus only queues the update
+    set_focus(x_perc * (2+POINTS_X), y_perc * (2+POINTS_Y));
 }
 
 //#define CV_TEST
 
-int setup_v4l2(std::string v4l2lo_dev, Mat image) {
-    int v4l2lo = open(v4l2lo_dev.c_str(), O_WRONLY);
-    if(v4l2lo < 0) {
-        log(LOG_ERROR, string_format("Error opening v4l2l device: %s", strerror(errno)));
-        return v4l2lo;
-    }
-
-    struct v4l2_format v;
-    int t;
-    v.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    t = ioctl(v4l2lo, VIDIOC_G_FMT, &v);
-    if( t < 0 ) {
-        log(LOG_ERROR, string_format("ioctl error with setting up v4l2l device: %d", t));
-        close(v4l2lo);
-        return -1;
-    }
-
-    v.fmt.pix.width = image.cols;
-    v.fmt.pix.height = image.rows;
-    v.fmt.pix.pixelformat = V4L2_PIX_FMT_BGR24;
-    v.fmt.pix.sizeimage = image.total() * image.elemSize();
-    t = ioctl(v4l2lo, VIDIOC_S_FMT, &v);
-    if( t < 0 ) {
-        log(LOG_ERROR, string_format("ioctl error with v4l2l device format: %d", t));
-        close(v4l2lo);
-        return -1;
-    }
-
-    return v4l2lo;
-}
-
 void draw_focus_point(Mat &displayImage, auto_focus_point focus_point, Scalar color) {
     if( focus_point.x > 0 && focus_point.y > 0 ) {
         Rect win_size = getWindowImageRect(WIN_NAME);
@@ -138,17 +293,168 @@ void draw_focus_point(Mat &displayImage, auto_focus_point focus_point, Scalar co
     }
 }
 
-void image_stream_cv_main(std::atomic<bool>& flag, std::string v4l2lo_dev = "") {
-  log(LOG_INFO, "image_stream_cv_main");
-#ifndef CV_TEST
-  sock const sockfd3 = connect_to_camera(jpg_stream_server_port);
+// a decoded live view image and when its frame was received and decoded,
+// with the focus peaking edges and the histogram if enabled
+struct decoded_image {
+  Mat image;
+  Mat edges;
+  sharpness_map sharpness;
+  image_histogram histogram;
+  exposure_stats exposure;
+  std::chrono::steady_clock::time_point received;
+  std::chrono::steady_clock::time_point decoded;
+};
+
+// the edges of the luma and the sharpness of every focus point cell
+void find_edges(focus_peaker& peaker, Mat const& luma, decoded_image& out) {
+  out.edges.create(luma.rows, luma.cols, CV_8UC1);
+  out.sharpness.columns = 2 + POINTS_X;
+  out.sharpness.rows = 2 + POINTS_Y;
+  peaker.process(luma.data, luma.step[0], luma.cols, luma.rows, focus_peaking_threshold,
+                 out.edges.data, out.edges.step[0], out.sharpness);
+  std::lock_guard<std::mutex> lock(live_view_analysis_mutex);
+  live_view_sharpness = out.sharpness;
+}
+
+void find_exposure(histogram_builder& histograms, Mat const& luma, decoded_image& out) {
+  histograms.process(out.image.data, out.image.step[0], out.image.cols, out.image.rows, luma.data,
+                     luma.step[0], out.histogram);
+  out.exposure = exposure(out.histogram);
+  std::lock_guard<std::mutex> lock(live_view_analysis_mutex);
+  live_view_exposure = out.exposure;
+}
+
+// the histograms in 64 buckets in the lower left corner, and how much
+// clips
+void draw_histogram(Mat& displayImage, image_histogram const& histogram, exposure_stats const& stats) {
+  int const buckets = 64;
+  int const height = 80;
+  Rect const area(8, displayImage.rows - height - 28, buckets * 3, height);
+  rectangle(displayImage, area, Scalar(0, 0, 0), FILLED);
+
+  Scalar const colors[histogram_channels] = {Scalar(255, 0, 0), Scalar(0, 255, 0), Scalar(0, 0, 255),
+                                             Scalar(255, 255, 255)};
+  for (int channel = 0; channel < histogram_channels; ++channel) {
+    uint32_t counts[buckets] = {};
+    uint32_t highest = 1;
+    for (int i = 0; i < 256; ++i) {
+      counts[i * buckets / 256] += histogram.bins[channel][i];
+      highest = std::max(highest, counts[i * buckets / 256]);
+    }
+    Point previous;
+    for (int i = 0; i < buckets; ++i) {
+      Point const p(area.x + i * 3, area.y + area.height - static_cast<int>(int64_t(counts[i]) * area.height / highest));
+      if (i > 0) line(displayImage, previous, p, colors[channel]);
+      previous = p;
+    }
+  }
+
+  putText(displayImage,
+          string_format("clip R %.1f%% G %.1f%% B %.1f%%  dark %.1f%%", stats.clipped[histogram_red] * 100,
+                        stats.clipped[histogram_green] * 100, stats.clipped[histogram_blue] * 100,
+                        stats.shadows * 100),
+          Point(area.x, area.y + area.height + 16), FONT_HERSHEY_SIMPLEX, 0.4, Scalar(255, 255, 255));
+}
+
+// the focus point whose cell is sharpest, with its score
+void draw_sharpest_point(Mat& displayImage, sharpness_map const& map) {
+  auto_focus_point best = 0;
+  float best_score = -1;
+  for (int y = 1; y <= POINTS_Y; ++y) {
+    for (int x = 1; x <= POINTS_X; ++x) {
+      if (map.score(x, y) > best_score) {
+        best_score = map.score(x, y);
+        best.x = x;
+        best.y = y;
+      }
+    }
+  }
+  draw_focus_point(displayImage, best, Scalar(0, 255, 0));
 
-  std::vector<uint8_t> buffer(1024 * 1024);
+  Rect const win_size = getWindowImageRect(WIN_NAME);
+  Point const label(best.x * win_size.width / (2+POINTS_X), best.y * win_size.height / (2+POINTS_Y) - 4);
+  putText(displayImage, string_format("%.1f", best_score), label, FONT_HERSHEY_SIMPLEX, 0.4, Scalar(0, 255, 0));
+}
+
+// libjpeg decodes straight into the image at the requested scale, without
+// it OpenCV decodes at full size
+bool decode_live_view(jpeg_decoder& decoder, uint8_t const* jpeg, size_t size, jpeg_scale scale, Mat& image) {
+  if (!jpeg_decoder::available()) {
+    Mat const rawData(1, static_cast<int>(size), CV_8UC1, const_cast<uint8_t*>(jpeg));
+    imdecode(rawData, cv::IMREAD_COLOR, &image);  // reuses image
+    return !image.empty();
+  }
+
+  int width, height;
+  if (!jpeg_decoder::read_header(jpeg, size, width, height)) return false;
+  jpeg_decoder::scaled_size(width, height, scale, width, height);
+  image.create(height, width, CV_8UC3);  // only reallocates when the size changes
+  return decoder.decode(jpeg, size, scale, jpeg_pixel_format::bgr, image.data, image.step[0],
+                        image.step[0] * image.rows, width, height);
+}
 
-  if (sockfd3 <= 0) return;
+void image_stream_cv_main(std::atomic<bool>& flag, std::string v4l2lo_dev = "",
+                          v4l2_pixel_format v4l2lo_format = v4l2_pixel_format::bgr24,
+                          jpeg_scale scale = jpeg_scale::full, bool peaking = false,
+                          bool histogram = false) {
+  typedef std::chrono::steady_clock steady;
+  log(LOG_INFO, "image_stream_cv_main");
+  live_view_timing.reset();
+  live_view_link.reset();
+
+  // receive, decode and display run on their own threads connected by
+  // latest_buffers: a stage that falls behind only gets the newest frame, so
+  // the socket is read even while the display stalls
+  std::atomic<bool> running(true);  // also stops when the window is closed
+  latest_buffer<decoded_image> decoded;
+#ifndef CV_TEST
+  if (!session.open_stream()) return;
+
+  frame_pool pool(live_view_pool_frames, live_view_frame_bytes);
+  latest_buffer<frame> frames;
+  std::thread receiver([&]() {
+    receive_frames(session.stream_socket(), pool, frames, running, &live_view_timing.receive,
+                   &live_view_link);
+  });
+  std::thread decoder([&]() {
+    jpeg_decoder jpeg;
+    focus_peaker peaker;
+    histogram_builder histograms;
+    Mat luma;
+    while (!frames.is_closed()) {
+      if (!frames.wait(std::chrono::milliseconds(100))) continue;
+
+      frame& f = frames.front();
+      decoded_image& out = decoded.back();  // its image is reused
+      bool const ok = decode_live_view(jpeg, f.data() + live_view_header_size,
+                                       f.size() - live_view_header_size, scale, out.image);
+      out.received = f.received();
+      f.reset();  // the slab goes back to the receiver right away
+
+      if (!ok) {
+        log(LOG_WARN, "couldn't decode image");
+        continue;
+      }
+      if (peaking || histogram) {
+        luma.create(out.image.rows, out.image.cols, CV_8UC1);
+        bgr_to_gray(out.image.data, out.image.step[0], out.image.cols, out.image.rows, luma.data,
+                    luma.step[0]);
+      }
+      if (peaking)
+        find_edges(peaker, luma, out);
+      if (histogram)
+        find_exposure(histograms, luma, out);
+      out.decoded = steady::now();
+      live_view_timing.decode.add(out.decoded - out.received);
+      decoded.publish();
+    }
+  });
 #endif
 
-  int v4l2lo = 0;
+  v4l2_output v4l2lo;
+  bool v4l2lo_failed = false;
+  // reused for every frame, only reallocated when the image size changes
+  Mat displayImage;
 
   namedWindow( WIN_NAME, WINDOW_AUTOSIZE );// Create a window for display.
   setMouseCallback(WIN_NAME, onMouse);
@@ -157,77 +463,429 @@ void image_stream_cv_main(std::atomic<bool>& flag, std::string v4l2lo_dev = "")
         break;
 
 #ifdef CV_TEST
-    Mat decodedImage = Mat::zeros( 480, 640, CV_8UC3 );
-#else
-    size_t receivedBytes =
-        fuji_receive(sockfd3, buffer.data(), buffer.size());
-
-
-    int const header = 14;  // not sure what's in the first 14 bytes
-    Mat rawData = Mat( 1, receivedBytes, CV_8UC1, &buffer[header]);
-    Mat decodedImage  =  imdecode( rawData , cv::IMREAD_COLOR );
+    decoded.back().image = Mat::zeros( 480, 640, CV_8UC3 );
+    decoded.back().received = decoded.back().decoded = steady::now();
+    decoded.publish();
 #endif
-
-    if ( decodedImage.data == NULL )
-    {
-        log(LOG_WARN, "couldn't decode image");
+    if (!decoded.acquire()) {
+        waitKey(1);
+        continue;
     }
-    Mat displayImage = decodedImage.clone();
+    decoded_image const& current = decoded.front();
+    current.image.copyTo(displayImage);
+    if( peaking ) {
+        displayImage.setTo(Scalar(0, 0, 255), current.edges);
+        draw_sharpest_point(displayImage, current.sharpness);
+    }
+    if( histogram )
+        draw_histogram(displayImage, current.histogram, current.exposure);
 
-    if( settings.values[property_focus_lock] == FOCUS_LOCK_ON ) {
+    if( session.setting(property_focus_lock) == FOCUS_LOCK_ON ) {
         draw_focus_point(displayImage, requested_focus_point, Scalar(128, 128, 128));
-        draw_focus_point(displayImage, settings.values[property_focus_point], Scalar(255, 255, 255));
+        draw_focus_point(displayImage, session.setting(property_focus_point), Scalar(255, 255, 255));
     }
 
     imshow( WIN_NAME, displayImage );
 
-    // Maybe copy to v4l2lo device
-    if( v4l2lo_dev.length() > 0 && v4l2lo == 0 )
-        v4l2lo = setup_v4l2(v4l2lo_dev, decodedImage);
+    // Maybe copy to v4l2lo device, converted into a buffer of its own
+    if( v4l2lo_dev.length() > 0 && !v4l2lo.is_open() && !v4l2lo_failed )
+        v4l2lo_failed = !v4l2lo.open(v4l2lo_dev.c_str(), v4l2lo_format,
+                                     current.image.cols, current.image.rows);
 
-    if(v4l2lo > 0) {
-        size_t written = write(v4l2lo, decodedImage.data, decodedImage.total() * decodedImage.elemSize());
-        if( written < 0 ) {
-            log(LOG_ERROR, string_format("error writing data to v4l2l: %ld", written));
-            close(v4l2lo);
-            v4l2lo = -1;
-        }
-    }
+    if( v4l2lo.is_open() && !v4l2lo.write_bgr(current.image.data, current.image.step[0]) )
+        v4l2lo_failed = true;
 
-    waitKey(1);
+    waitKey(1);  // the window is only repainted here
+    steady::time_point const shown = steady::now();
+    live_view_timing.display.add(shown - current.decoded);
+    live_view_timing.total.add(shown - current.received);
   }
 
   destroyAllWindows();
+  running = false;
+#ifndef CV_TEST
+  receiver.join();
+  decoder.join();
+  log(LOG_INFO, string_format("live view: %llu frames, %llu not decoded, %llu not shown",
+                              static_cast<unsigned long long>(frames.published()),
+                              static_cast<unsigned long long>(frames.dropped()),
+                              static_cast<unsigned long long>(decoded.dropped())));
+  print(live_view_link.statistics());
+  session.close_stream();
+#endif
 }
 #endif
 
 void image_stream_main(std::atomic<bool>& flag) {
   log(LOG_INFO, "image_stream_main");
-  sock const sockfd3 = connect_to_camera(jpg_stream_server_port);
+  if (!session.open_stream()) return;
+  live_view_link.reset();
+
+  // one recording per stream command, frames the disk cannot keep up with
+  // are dropped, oldest first
+  mjpeg_recorder_options options;
+  char prefix[64];
+  time_t const now = time(nullptr);
+  strftime(prefix, sizeof(prefix), "out/live_view_%Y%m%d_%H%M%S", localtime(&now));
+  options.path_prefix = prefix;
+  options.queue_frames = live_view_record_depth;
+
+  frame_pool pool(options.queue_frames + 2, live_view_frame_bytes);
+  mjpeg_recorder recorder(options);
+  if (recorder.start()) {
+    receive_frames(session.stream_socket(), pool, recorder.input(), flag, &live_view_link);
+    recorder.stop();
+    log(LOG_INFO, string_format("live view: %llu frames in %u segments, %llu dropped",
+                                static_cast<unsigned long long>(recorder.written()), recorder.segments(),
+                                static_cast<unsigned long long>(recorder.dropped())));
+    print(live_view_link.statistics());
+  }
+  session.close_stream();
+}
+
+void image_serve_main(std::atomic<bool>& flag, uint16_t const port) {
+  log(LOG_INFO, "image_serve_main");
+  if (!session.open_stream()) return;
+  live_view_link.reset();
+
+  mjpeg_server_options options;
+  options.port = port;
+  mjpeg_server server;
+  if (server.start(options)) {
+    // clients hold on to the frame they are sending, beyond what the
+    // receiver needs
+    frame_pool pool(live_view_pool_frames + options.max_clients, live_view_frame_bytes);
+    latest_buffer<frame> frames;
+    std::thread receiver([&]() {
+      receive_frames(session.stream_socket(), pool, frames, flag, nullptr, &live_view_link);
+    });
+    while (!frames.is_closed()) {
+      if (!frames.wait(std::chrono::milliseconds(100))) continue;
+      server.publish(frames.front());
+      frames.front().reset();
+    }
+    receiver.join();
+    server.stop();
+    log(LOG_INFO, string_format("live view: %llu frames sent, %llu skipped by slow clients",
+                                static_cast<unsigned long long>(server.frames_sent()),
+                                static_cast<unsigned long long>(server.frames_skipped())));
+  }
+  session.close_stream();
+}
 
-  std::vector<uint8_t> buffer(1024 * 1024);
+void image_export_main(std::atomic<bool>& flag, std::string const& name) {
+  log(LOG_INFO, "image_export_main");
+  if (!session.open_stream()) return;
+  live_view_link.reset();
+
+  shm_export_options options;
+  options.name = name;
+  options.slot_bytes = live_view_frame_bytes;
+  shm_exporter exporter;
+  if (exporter.open(options)) {
+    frame_pool pool(live_view_pool_frames, live_view_frame_bytes);
+    latest_buffer<frame> frames;
+    std::thread receiver([&]() {
+      receive_frames(session.stream_socket(), pool, frames, flag, nullptr, &live_view_link);
+    });
+    while (!frames.is_closed()) {
+      if (!frames.wait(std::chrono::milliseconds(100))) continue;
+      exporter.publish(frames.front());
+      frames.front().reset();
+    }
+    receiver.join();
+    exporter.close();
+    log(LOG_INFO, string_format("live view: %llu frames exported, %llu too large",
+                                static_cast<unsigned long long>(exporter.published()),
+                                static_cast<unsigned long long>(exporter.oversized())));
+  }
+  session.close_stream();
+}
 
-  if (sockfd3 <= 0) return;
+// follows an export (of this or another process) the way an analytics
+// process would
+void read_export(char const* name, int const seconds) {
+  shm_reader reader;
+  if (!reader.attach(name)) {
+    log(LOG_ERROR, string_format("no live view export %s", name));
+    return;
+  }
 
-  unsigned int image = 0;
-  while (flag) {
-    size_t receivedBytes =
-        fuji_receive(sockfd3, buffer.data(), buffer.size());
-    log(LOG_DEBUG, string_format("image_stream_main received %zd bytes", receivedBytes));
-
-    char filename[1024];
-    snprintf(filename, sizeof(filename), "out/img_%d.jpg", image++);
-    FILE* file = fopen(filename, "wb");
-    if (file) {
-      // First 14 bytes like:
-      // uint32_t 0
-      // uint32_t frame_no (increments one each time a frame is sent)
-      // rest are 0s
-      int const header = 14;  // not sure what's in the first 14 bytes
-      fwrite(&buffer[header], receivedBytes, 1, file);
-      fclose(file);
-    } else {
-      log(LOG_WARN, string_format("image_stream_main Failed to create file %s", filename));
+  uint64_t next = reader.published();
+  uint64_t read = 0;
+  uint64_t missed = 0;
+  uint64_t torn = 0;
+  latency_stats latency;
+  auto const end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+  while (std::chrono::steady_clock::now() < end) {
+    if (!reader.wait(next, std::chrono::milliseconds(100))) {
+      if (reader.closed()) break;
+      continue;
+    }
+    // a reader that fell behind skips to the newest frame, analytics wants
+    // the current image rather than every one; the skipped frames count as
+    // missed
+    uint64_t const published = reader.published();
+    if (published - next > 1) {
+      missed += published - 1 - next;
+      next = published - 1;
+    }
+    shm_frame_view view;
+    if (!reader.acquire(next++, view)) {
+      ++missed;
+      continue;
+    }
+    int width, height;
+    bool const ok = jpeg_dimensions(view.jpeg, view.size, width, height);  // uses the frame in place
+    if (!reader.valid(view)) {
+      ++torn;
+      continue;
+    }
+    if (ok) ++read;
+    latency.add(std::chrono::steady_clock::now() - view.received);
+  }
+  printf("%s: %llu frames read, %llu missed, %llu overwritten while reading\n", name,
+         static_cast<unsigned long long>(read), static_cast<unsigned long long>(missed),
+         static_cast<unsigned long long>(torn));
+  printf("\treceived to read: mean %lld us, max %lld us\n",
+         static_cast<long long>(latency.mean().count()), static_cast<long long>(latency.max().count()));
+}
+
+// the camera's JPEGs go to the device as they are, nothing is decoded
+void image_stream_v4l2_main(std::atomic<bool>& flag, std::string const& device) {
+  log(LOG_INFO, "image_stream_v4l2_main");
+  if (!session.open_stream()) return;
+  live_view_link.reset();
+
+  frame_pool pool(live_view_pool_frames, live_view_frame_bytes);
+  latest_buffer<frame> frames;
+  std::atomic<bool> running(true);  // also stops when the device fails
+  std::thread receiver([&]() {
+    receive_frames(session.stream_socket(), pool, frames, running, nullptr, &live_view_link);
+  });
+
+  v4l2_output v4l2lo;
+  while (flag && !frames.is_closed()) {
+    if (!frames.wait(std::chrono::milliseconds(100))) continue;
+
+    frame& f = frames.front();
+    uint8_t const* const jpeg = f.data() + live_view_header_size;
+    size_t const size = f.size() - live_view_header_size;
+    int width = 0;
+    int height = 0;
+    if (!jpeg_dimensions(jpeg, size, width, height)) {
+      log(LOG_WARN, "live view frame without a JPEG frame header");
+    } else if (!v4l2lo.is_open() &&
+               !v4l2lo.open(device.c_str(), v4l2_pixel_format::mjpeg, width, height, live_view_frame_bytes)) {
+      break;
+    } else if (width != v4l2lo.width() || height != v4l2lo.height()) {
+      // readers of the device have the format already, they get no frames
+      // of another size
+      log(LOG_WARN, string_format("live view size changed to %dx%d", width, height));
+    } else if (!v4l2lo.write(jpeg, size)) {
+      break;
+    }
+    f.reset();
+  }
+  running = false;
+  receiver.join();
+  frames.front().reset();
+  session.close_stream();
+}
+
+// converts a synthetic image with every colour kernel the CPU runs, checks
+// the result against a floating point BT.601 conversion and the scalar
+// kernels, and prints the throughput
+void bench_color(int const width, int const height, int const iterations) {
+  std::vector<uint8_t> bgr(static_cast<size_t>(width) * height * 3);
+  uint32_t seed = 1;
+  for (size_t i = 0; i < bgr.size(); ++i) {
+    // gradients with some noise, so neighbouring pixels differ
+    seed = seed * 1664525 + 1013904223;
+    bgr[i] = static_cast<uint8_t>((i / 3 % width) * 255 / width + (seed >> 29));
+  }
+
+  size_t const pixels = static_cast<size_t>(width) * height;
+  std::vector<uint8_t> reference_yuyv(pixels * 2);
+  std::vector<uint8_t> reference_nv12(pixels * 3 / 2);
+  color_kernels_for(simd_level::scalar)->bgr_to_yuyv(bgr.data(), width * 3, width, height,
+                                                     reference_yuyv.data(), width * 2);
+  color_kernels_for(simd_level::scalar)->bgr_to_nv12(bgr.data(), width * 3, width, height,
+                                                     reference_nv12.data(), width,
+                                                     reference_nv12.data() + pixels, width);
+
+  // the scalar kernels against the real numbers: within rounding
+  int max_error = 0;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      uint8_t const* const p = &bgr[(y * width + x) * 3];
+      double const luma = 16 + (65.738 * p[2] + 129.057 * p[1] + 25.064 * p[0]) / 256;
+      max_error = std::max(max_error, std::abs(reference_yuyv[(y * width + x) * 2] - static_cast<int>(luma + 0.5)));
+      if (x % 2 == 0) {
+        double b = 0, g = 0, r = 0;
+        for (int i = 0; i < 2; ++i) {
+          b += p[i * 3] / 2.0;
+          g += p[i * 3 + 1] / 2.0;
+          r += p[i * 3 + 2] / 2.0;
+        }
+        double const u = 128 + (-37.945 * r - 74.494 * g + 112.439 * b) / 256;
+        double const v = 128 + (112.439 * r - 94.154 * g - 18.285 * b) / 256;
+        max_error = std::max(max_error, std::abs(reference_yuyv[(y * width + x) * 2 + 1] - static_cast<int>(std::floor(u + 0.5))));
+        max_error = std::max(max_error, std::abs(reference_yuyv[(y * width + x) * 2 + 3] - static_cast<int>(std::floor(v + 0.5))));
+      }
+    }
+  }
+  printf("%dx%d, scalar vs floating point: max error %d\n", width, height, max_error);
+
+  simd_level const levels[] = {simd_level::scalar, simd_level::sse41, simd_level::avx2, simd_level::neon};
+  std::vector<uint8_t> yuyv(reference_yuyv.size());
+  std::vector<uint8_t> nv12(reference_nv12.size());
+  std::vector<uint8_t> gray(pixels);
+  for (simd_level const level : levels) {
+    color_kernels const* const kernels = color_kernels_for(level);
+    if (!kernels) continue;
+
+    auto const start_yuyv = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+      kernels->bgr_to_yuyv(bgr.data(), width * 3, width, height, yuyv.data(), width * 2);
+    auto const start_nv12 = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+      kernels->bgr_to_nv12(bgr.data(), width * 3, width, height, nv12.data(), width, nv12.data() + pixels, width);
+    auto const start_gray = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+      kernels->bgr_to_gray(bgr.data(), width * 3, width, height, gray.data(), width);
+    auto const end = std::chrono::steady_clock::now();
+
+    double const yuyv_s = std::chrono::duration<double>(start_nv12 - start_yuyv).count();
+    double const nv12_s = std::chrono::duration<double>(start_gray - start_nv12).count();
+    double const gray_s = std::chrono::duration<double>(end - start_gray).count();
+    // gray is the Y plane of NV12
+    bool const gray_ok = std::equal(gray.begin(), gray.end(), reference_nv12.begin());
+    printf("\t%-7s yuyv %7.1f Mpixel/s %s, nv12 %7.1f Mpixel/s %s, gray %7.1f Mpixel/s %s\n",
+           to_string(level), pixels * iterations / yuyv_s / 1e6, yuyv == reference_yuyv ? "ok" : "MISMATCH",
+           pixels * iterations / nv12_s / 1e6, nv12 == reference_nv12 ? "ok" : "MISMATCH",
+           pixels * iterations / gray_s / 1e6, gray_ok ? "ok" : "MISMATCH");
+  }
+}
+
+// runs the focus peaking kernels of every level on a synthetic luma image
+// with edges of all strengths, checks them against the scalar code and
+// prints the throughput
+void bench_peaking(int const width, int const height, int const iterations) {
+  std::vector<uint8_t> luma(static_cast<size_t>(width) * height);
+  uint32_t seed = 1;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      // blocks of growing contrast with some noise
+      seed = seed * 1664525 + 1013904223;
+      int const block = (x / 16 + y / 16) % 2 ? x * 255 / width : 0;
+      luma[y * width + x] = static_cast<uint8_t>(std::min(255, block + static_cast<int>(seed >> 28)));
+    }
+  }
+
+  sharpness_map reference;
+  reference.columns = 2 + POINTS_X;
+  reference.rows = 2 + POINTS_Y;
+  std::vector<uint8_t> reference_edges(luma.size());
+  focus_peaker(*peaking_kernels_for(simd_level::scalar))
+      .process(luma.data(), width, width, height, focus_peaking_threshold, reference_edges.data(), width,
+               reference);
+
+  simd_level const levels[] = {simd_level::scalar, simd_level::sse41, simd_level::avx2, simd_level::neon};
+  std::vector<uint8_t> edges(luma.size());
+  for (simd_level const level : levels) {
+    peaking_kernels const* const kernels = peaking_kernels_for(level);
+    if (!kernels) continue;
+
+    focus_peaker peaker(*kernels);
+    sharpness_map map = reference;
+    auto const start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+      peaker.process(luma.data(), width, width, height, focus_peaking_threshold, edges.data(), width, map);
+    double const s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    bool const ok = edges == reference_edges && map.scores == reference.scores;
+    printf("\t%-7s %7.1f Mpixel/s, %6.3f ms/frame %s\n", to_string(level),
+           static_cast<double>(luma.size()) * iterations / s / 1e6, s * 1e3 / iterations,
+           ok ? "ok" : "MISMATCH");
+  }
+}
+
+// histograms of a synthetic image with large flat areas, as live view
+// frames have them, against counting every pixel into one set of bins
+void bench_histogram(int const width, int const height, int const iterations) {
+  std::vector<uint8_t> bgr(static_cast<size_t>(width) * height * 3);
+  uint32_t seed = 1;
+  for (size_t i = 0; i < bgr.size(); ++i) {
+    seed = seed * 1664525 + 1013904223;
+    bgr[i] = (i / 3 % width) < static_cast<size_t>(width / 2) ? 255 : static_cast<uint8_t>(seed >> 24);
+  }
+  std::vector<uint8_t> luma(static_cast<size_t>(width) * height);
+  bgr_to_gray(bgr.data(), width * 3, width, height, luma.data(), width);
+
+  image_histogram reference;
+  auto const start_plain = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    reference = image_histogram();
+    for (size_t p = 0; p < luma.size(); ++p) {
+      for (int channel = 0; channel < 3; ++channel) ++reference.bins[channel][bgr[p * 3 + channel]];
+      ++reference.bins[histogram_luma][luma[p]];
+    }
+  }
+  reference.pixels = luma.size();
+  double const plain_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_plain).count();
+
+  histogram_builder builder;
+  image_histogram histogram;
+  auto const start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    builder.process(bgr.data(), width * 3, width, height, nullptr, 0, histogram);
+  double const s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  bool const ok = memcmp(histogram.bins, reference.bins, sizeof(histogram.bins)) == 0;
+  printf("%dx%d: one bank %.3f ms/frame, with luma and banks %.3f ms/frame %s\n", width, height,
+         plain_s * 1e3 / iterations, s * 1e3 / iterations, ok ? "ok" : "MISMATCH");
+  print(exposure(histogram));
+}
+
+// decodes every frame of a recorded segment at each scale
+void bench_jpeg(char const* path) {
+  mjpeg_segment segment;
+  if (!segment.open(path) || segment.size() == 0) return;
+
+  auto const start = std::chrono::steady_clock::now();
+  int width = 0;
+  int height = 0;
+  for (size_t i = 0; i < segment.size(); ++i)
+    jpeg_decoder::read_header(segment.image(i), segment[i].size, width, height);
+  double const header_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%zu frames of %dx%d, header only %.2f us/frame\n", segment.size(), width, height,
+         header_s * 1e6 / segment.size());
+  if (!jpeg_decoder::available()) {
+    log(LOG_ERROR, "built without libjpeg");
+    return;
+  }
+
+  jpeg_decoder decoder;
+  std::vector<uint8_t> image(static_cast<size_t>(width) * height * 3);  // reused for every frame
+  jpeg_scale const scales[] = {jpeg_scale::full, jpeg_scale::half, jpeg_scale::quarter, jpeg_scale::eighth};
+  jpeg_pixel_format const formats[] = {jpeg_pixel_format::bgr, jpeg_pixel_format::gray};
+  for (jpeg_pixel_format const format : formats) {
+    for (jpeg_scale const scale : scales) {
+      size_t failed = 0;
+      int w = 0;
+      int h = 0;
+      auto const begin = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < segment.size(); ++i) {
+        int const channels = format == jpeg_pixel_format::bgr ? 3 : 1;
+        int sw, sh;
+        jpeg_decoder::scaled_size(width, height, scale, sw, sh);
+        if (!decoder.decode(segment.image(i), segment[i].size, scale, format, image.data(),
+                            static_cast<size_t>(sw) * channels, image.size(), w, h))
+          ++failed;
+      }
+      double const s = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+      printf("\t%-4s 1/%d %4dx%-4d %7.2f ms/frame%s\n", format == jpeg_pixel_format::bgr ? "bgr" : "gray",
+             static_cast<int>(scale), w, h, s * 1e3 / segment.size(), failed ? " (some failed)" : "");
     }
   }
 }
@@ -240,6 +898,12 @@ char const* commandStrings[] = {"connect", "shutter", "stream",
                                 "exposure_compensation", "set_exposure_compensation",
                                 "focus_point", "unlock_focus",
                                 "start_record", "stop_record",
+                                "browse", "timelapse", "bracket", "cameras",
+                                "shutter_at", "queue_stats", "stream_stats",
+                                "recording", "serve", "stream_v4l2",
+                                "bench_color", "bench_jpeg", "export", "export_read",
+                                "sharpness", "bench_peaking", "exposure", "bench_histogram",
+                                "auto_focus", "motion_trigger",
 #ifdef WITH_OPENCV
                                 "stream_cv",
 #endif
@@ -266,6 +930,26 @@ enum class command {
   unlock_focus,
   start_record,
   stop_record,
+  browse,
+  timelapse,
+  bracket,
+  cameras,
+  shutter_at,
+  queue_stats,
+  stream_stats,
+  recording,
+  serve,
+  stream_v4l2,
+  bench_color,
+  bench_jpeg,
+  export_shm,
+  export_read,
+  sharpness,
+  bench_peaking,
+  exposure,
+  bench_histogram,
+  auto_focus,
+  motion_trigger,
 #ifdef WITH_OPENCV
   stream_cv,
 #endif
@@ -313,6 +997,33 @@ std::vector<std::string> split(std::string const& str,
   return result;
 }
 
+// A thread reading the live view. The camera has a single live view socket,
+// so one consumer runs at a time; one that ended by itself (the stream
+// closed) is joined when the next one asks.
+class stream_consumer {
+  std::thread thread;
+  std::atomic<bool> done{false};
+
+ public:
+  bool busy() {
+    if (thread.joinable() && done) thread.join();
+    return thread.joinable();
+  }
+
+  template <typename F>
+  void start(F f) {
+    done = false;
+    thread = std::thread([this, f]() {
+      f();
+      done = true;
+    });
+  }
+
+  void join() {
+    if (thread.joinable()) thread.join();
+  }
+};
+
 int main(int const argc, char const* argv[]) {
   uint8_t log_level = LOG_DEBUG;
   uint32_t cur_record_id = 0;
@@ -329,13 +1040,32 @@ int main(int const argc, char const* argv[]) {
    * user uses the <tab> key. */
   linenoiseSetCompletionCallback(completion);
 
-  sock sockfd2;
   std::atomic<bool> imageStreamFlag(true);
-  std::thread imageStreamThread;
+  stream_consumer imageStreamThread;
+#ifdef WITH_OPENCV
+  stream_consumer imageStreamCVThread;
+#endif
+  // every live view command checks both consumers
+  auto const streamInUse = [&]() {
+    bool busy = imageStreamThread.busy();
 #ifdef WITH_OPENCV
-  std::thread imageStreamCVThread;
+    if (imageStreamCVThread.busy()) busy = true;
 #endif
-  std::vector<capability> caps;
+    if (busy) log(LOG_ERROR, "the stream is already in use");
+    return busy;
+  };
+  // the session was given the cached capabilities, the parsed reply replaces
+  // them once it turns out they changed
+  caps_cache.open(".", [](std::string const& camera, std::vector<capability> const& fresh) {
+    log(LOG_INFO, "Camera capabilities changed");
+    if (camera == session.profile().camera.key()) session.set_caps(fresh);
+    print(fresh);
+  });
+  std::unique_ptr<intervalometer> timelapse;
+  std::thread timelapseThread;
+  camera_manager cameras;  // independent of the single camera commands
+  std::unique_ptr<scheduled_shutter> scheduled;
+  std::thread scheduledThread;
 
   std::string line;
   while (getline(line)) {
@@ -345,95 +1075,225 @@ int main(int const argc, char const* argv[]) {
 
     command cmd = parse_command(splitLine[0]);
 
-    const std::lock_guard<std::timed_mutex> lock(g_comm_lock);
     switch (cmd) {
       case command::connect: {
-        if (sockfd <= 0) {
-          sockfd = connect_to_camera(control_server_port);
-          if (!init_control_connection(sockfd, "HackedClient", &caps))
+        if (!session.is_connected()) {
+          connection_mode mode = connection_mode_remote;
+          bool pipeline = true;
+          for (size_t i = 1; i < splitLine.size(); ++i) {
+            if (splitLine[i] == "browse") mode = connection_mode_browse;
+            else if (splitLine[i] == "sequential") pipeline = false;
+          }
+          bool const connected = session.connect("HackedClient", &caps_cache, mode, pipeline);
+          connect_profile const profile = session.profile();
+          print(profile);
+          if (!profile.camera.key().empty()) camera_name = profile.camera.key();
+          if (!connected)
             log(LOG_ERROR, "failure\n");
-          else {
+          else if (mode == connection_mode_browse) {
+            log(LOG_INFO, "Connected in browse mode");
+          } else {
             log(LOG_INFO, "Received camera capabilities");
-            print(caps);
-            if (current_settings(sockfd, settings)) {
-              log(LOG_INFO, "Received camera settings");
-              print(settings);
-            }
-            sockfd2 = connect_to_camera(async_response_server_port);
+            print(session.caps());
+            current_properties settings = session.settings();
+            log(LOG_INFO, "Received camera settings");
+            print(settings);
           }
         } else {
           log(LOG_INFO, "already connected\n");
         }
       } break;
       case command::shutter: {
-        if (!shutter(sockfd, sockfd2, "thumb.jpg")) log(LOG_ERROR, "failure\n");
+        if (!session.shutter("thumb.jpg").get()) log(LOG_ERROR, "failure\n");
 
       } break;
 
       case command::stream: {
-        imageStreamThread =
-            std::thread(([&]() { image_stream_main(imageStreamFlag); }));
+        if (streamInUse()) break;
+        imageStreamThread.start([&]() { image_stream_main(imageStreamFlag); });
+      } break;
+
+      // parameter: port (default 8080); the live view for any number of
+      // local viewers, e.g. vlc http://127.0.0.1:8080/
+      case command::serve: {
+        if (streamInUse()) break;
+        uint16_t const port = splitLine.size() > 1 ? static_cast<uint16_t>(std::stoul(splitLine[1], 0, 0)) : 8080;
+        imageStreamThread.start([&, port]() { image_serve_main(imageStreamFlag, port); });
+      } break;
+
+      // parameter: shared memory name, /fcwt_live_view by default
+      case command::export_shm: {
+        if (streamInUse()) break;
+        std::string const name = splitLine.size() > 1 ? splitLine[1] : "/fcwt_live_view";
+        imageStreamThread.start([&, name]() { image_export_main(imageStreamFlag, name); });
+      } break;
+
+      // parameters: shared memory name, seconds (10 by default)
+      case command::export_read: {
+        std::string const name = splitLine.size() > 1 ? splitLine[1] : "/fcwt_live_view";
+        read_export(name.c_str(), splitLine.size() > 2 ? std::stoi(splitLine[2]) : 10);
+      } break;
+
+      // focus point cells of the last image stream_cv decoded with peaking
+      case command::sharpness: {
+        std::lock_guard<std::mutex> lock(live_view_analysis_mutex);
+        print(live_view_sharpness);
+      } break;
+
+      // parameters: rule (sharpest, or nearest: the high contrast point
+      // closest to the current one), lens settle time in ms (500); runs as the
+      // live view consumer, so not while stream_cv or another one reads it
+      case command::auto_focus: {
+        if (streamInUse()) break;
+        focus_rule const rule = splitLine.size() > 1 && splitLine[1] == "nearest" ? focus_rule::nearest
+                                                                                 : focus_rule::sharpest;
+        std::chrono::milliseconds const settle(splitLine.size() > 2 ? std::stoi(splitLine[2]) : 500);
+        imageStreamThread.start(
+            [&, rule, settle]() { auto_focus_main(imageStreamFlag, rule, settle); });
+      } break;
+
+      // parameters: share of the region's pixels that must change in % (2),
+      // region x y width height in % of the image (whole image), number of
+      // shots (0 until the stream ends); thumbnails go to motion_NNN.jpg
+      case command::motion_trigger: {
+        if (streamInUse()) break;
+        motion_options options;
+        if (splitLine.size() > 1) options.trigger_share = std::stof(splitLine[1]) / 100;
+        if (splitLine.size() > 5) {
+          options.region.x = std::stof(splitLine[2]) / 100;
+          options.region.y = std::stof(splitLine[3]) / 100;
+          options.region.width = std::stof(splitLine[4]) / 100;
+          options.region.height = std::stof(splitLine[5]) / 100;
+        }
+        unsigned const shots = splitLine.size() > 6 ? std::stoul(splitLine[6]) : 0;
+        imageStreamThread.start(
+            [&, options, shots]() { motion_trigger_main(imageStreamFlag, options, shots); });
+      } break;
+
+      // histogram of the last image stream_cv decoded
+      case command::exposure: {
+        std::lock_guard<std::mutex> lock(live_view_analysis_mutex);
+        print(live_view_exposure);
+      } break;
+
+      // parameters: width, height (default 640x480), iterations
+      case command::bench_histogram: {
+        int const width = splitLine.size() > 2 ? std::stoi(splitLine[1]) : 640;
+        int const height = splitLine.size() > 2 ? std::stoi(splitLine[2]) : 480;
+        int const iterations = splitLine.size() > 3 ? std::stoi(splitLine[3]) : 300;
+        if (width > 0 && height > 0 && iterations > 0)
+          bench_histogram(width, height, iterations);
+      } break;
+
+      // parameters: width, height (default 640x480), iterations
+      case command::bench_peaking: {
+        int const width = splitLine.size() > 2 ? std::stoi(splitLine[1]) : 640;
+        int const height = splitLine.size() > 2 ? std::stoi(splitLine[2]) : 480;
+        int const iterations = splitLine.size() > 3 ? std::stoi(splitLine[3]) : 300;
+        if (width > 0 && height > 0 && iterations > 0)
+          bench_peaking(width, height, iterations);
+      } break;
+
+      // parameter: v4l2loopback device, e.g. /dev/video2
+      case command::stream_v4l2: {
+        if (splitLine.size() < 2) break;
+        if (streamInUse()) break;
+        std::string const device = splitLine[1];
+        imageStreamThread.start([&, device]() { image_stream_v4l2_main(imageStreamFlag, device); });
       } break;
 
 #ifdef WITH_OPENCV
+      // parameters in any order: v4l2loopback device, its format (bgr24,
+      // yuyv or nv12), decoded size (1/2, 1/4 or 1/8, needs libjpeg),
+      // "peaking" to mark sharp edges red, "histogram" to show the exposure
       case command::stream_cv: {
         std::string v4l2lo_dev = "";
-        if( splitLine.size() > 1 )
-            v4l2lo_dev = splitLine[1];
-        imageStreamCVThread =
-            std::thread(([&]() { image_stream_cv_main(imageStreamFlag, v4l2lo_dev); }));
+        v4l2_pixel_format v4l2lo_format = v4l2_pixel_format::bgr24;
+        jpeg_scale scale = jpeg_scale::full;
+        bool peaking = false;
+        bool histogram = false;
+        for (size_t i = 1; i < splitLine.size(); ++i) {
+            if( splitLine[i] == "peaking" )
+                peaking = true;
+            else if( splitLine[i] == "histogram" )
+                histogram = true;
+            else if( splitLine[i] == "yuyv" )
+                v4l2lo_format = v4l2_pixel_format::yuyv;
+            else if( splitLine[i] == "nv12" )
+                v4l2lo_format = v4l2_pixel_format::nv12;
+            else if( splitLine[i] == "bgr24" )
+                v4l2lo_format = v4l2_pixel_format::bgr24;
+            else if( splitLine[i] == "1/2" )
+                scale = jpeg_scale::half;
+            else if( splitLine[i] == "1/4" )
+                scale = jpeg_scale::quarter;
+            else if( splitLine[i] == "1/8" )
+                scale = jpeg_scale::eighth;
+            else
+                v4l2lo_dev = splitLine[i];
+        }
+        if (streamInUse()) break;
+        imageStreamCVThread.start([&, v4l2lo_dev, v4l2lo_format, scale, peaking, histogram]() {
+          image_stream_cv_main(imageStreamFlag, v4l2lo_dev, v4l2lo_format, scale, peaking, histogram);
+        });
       } break;
 #endif
 
       case command::info: {
-        if (current_settings(sockfd, settings))
+        if (session.refresh_settings().get()) {
+          current_properties settings = session.settings();
           print(settings);
+        }
       } break;
 
       case command::set_iso: {
-        if (splitLine.size() > 1) {
-          unsigned long iso = std::stoul(splitLine[1], 0, 0);
-          log(LOG_DEBUG, string_format("%s(%lu)", splitLine[0].c_str(), iso));
-          if (update_setting(sockfd, property_iso, iso)) {
-            if (current_settings(sockfd, settings))
-              print(settings);
-          } else {
-            log(LOG_ERROR, string_format("Failed to set ISO %lu", iso));
+        session.execute([&](camera_io& io) {
+          if (splitLine.size() > 1) {
+            unsigned long iso = std::stoul(splitLine[1], 0, 0);
+            log(LOG_DEBUG, string_format("%s(%lu)", splitLine[0].c_str(), iso));
+            if (update_setting(io.control, property_iso, iso)) {
+              if (io.refresh_settings())
+                print(io.settings);
+            } else {
+              log(LOG_ERROR, string_format("Failed to set ISO %lu", iso));
+            }
           }
-        }
+        });
       } break;
 
       // this doesnt seem to work on x-t100
       case command::set_aperture: {
-        if (splitLine.size() > 1) {
-          uint32_t const aperture = static_cast<uint32_t>(std::stod(splitLine[1]) * 100.0);
-          if (aperture > 0 && aperture < 6400 && 
-              current_settings(sockfd, settings) && settings.values[property_aperture] > 0 &&
-              aperture != settings.values[property_aperture]) {
-            const fnumber_update_direction direction = aperture < settings.values[property_aperture] ? fnumber_decrement : fnumber_increment;
-            uint32_t last_aperture = 0;
-            do {
-              last_aperture = settings.values[property_aperture];
-              if (!update_setting(sockfd, direction))
-                break;
-            } while(current_settings(sockfd, settings) && 
-                    settings.values[property_aperture] != last_aperture && 
-                    aperture != settings.values[property_aperture] &&
-                    direction == (aperture < settings.values[property_aperture] ? fnumber_decrement : fnumber_increment));
-            print(settings);
-          } 
-        }
+        session.execute([&](camera_io& io) {
+          if (splitLine.size() > 1) {
+            uint32_t const aperture = static_cast<uint32_t>(std::stod(splitLine[1]) * 100.0);
+            if (aperture > 0 && aperture < 6400 && 
+                io.refresh_settings() && io.settings.values[property_aperture] > 0 &&
+                aperture != io.settings.values[property_aperture]) {
+              const fnumber_update_direction direction = aperture < io.settings.values[property_aperture] ? fnumber_decrement : fnumber_increment;
+              uint32_t last_aperture = 0;
+              do {
+                last_aperture = io.settings.values[property_aperture];
+                if (!update_setting(io.control, direction))
+                  break;
+              } while(io.refresh_settings() && 
+                      io.settings.values[property_aperture] != last_aperture && 
+                      aperture != io.settings.values[property_aperture] &&
+                      direction == (aperture < io.settings.values[property_aperture] ? fnumber_decrement : fnumber_increment));
+              print(io.settings);
+            } 
+          }
+        });
       } break;
 
-      // parameter 1 / -1 to say in/out
+      // parameter: steps, negative to step down (-1 / 1 to say in/out)
       case command::aperture: {
         if (splitLine.size() > 1) {
           int aperture_stops = std::stoi(splitLine[1], 0, 0);
           log(LOG_DEBUG, string_format("%s(%i)", splitLine[0].c_str(), aperture_stops));
           if (aperture_stops != 0) {
-            if (update_setting(sockfd, aperture_stops < 0 ? fnumber_decrement : fnumber_increment)) {
-              if (current_settings(sockfd, settings))
-                print(settings);
+            if (session.step(property_aperture, aperture_stops).get()) {
+              current_properties settings = session.settings();
+              print(settings);
             } else {
               log(LOG_ERROR, string_format("Failed to adjust aperture %i", aperture_stops));
             }
@@ -446,9 +1306,9 @@ int main(int const argc, char const* argv[]) {
           int shutter_stops = std::stoi(splitLine[1], 0, 0);
           log(LOG_DEBUG, string_format("%s(%i)", splitLine[0].c_str(), shutter_stops));
           if (shutter_stops != 0) {
-            if (update_setting(sockfd, shutter_stops < 0 ? ss_decrement : ss_increment)) {
-              if (current_settings(sockfd, settings))
-                print(settings);
+            if (session.step(property_shutter_speed, shutter_stops).get()) {
+              current_properties settings = session.settings();
+              print(settings);
             } else {
               log(LOG_ERROR, string_format("Failed to adjust shutter speed %i", shutter_stops));
             }
@@ -457,27 +1317,29 @@ int main(int const argc, char const* argv[]) {
       } break;
 
       case command::set_shutter_speed: {
-        if (splitLine.size() > 1) {
-          double nom, denom;
-          int res = std::sscanf(splitLine[1].c_str(), "%lf/%lf", &nom, &denom);
-          if (res > 0) {
-            double new_speed = (res == 1 ? nom : nom / denom) * 1000000.0;
-            if (current_settings(sockfd, settings) && settings.values[property_shutter_speed] > 0 &&
-                new_speed != ss_to_microsec(settings.values[property_shutter_speed])) {
-              const ss_update_direction direction = new_speed < ss_to_microsec(settings.values[property_shutter_speed]) ? ss_increment : ss_decrement;
-              uint64_t last_speed = 0;
-              do {
-                last_speed = ss_to_microsec(settings.values[property_shutter_speed]);
-                if (!update_setting(sockfd, direction))
-                  break;
-              } while(current_settings(sockfd, settings) &&
-                      ss_to_microsec(settings.values[property_shutter_speed]) != last_speed &&
-                      new_speed != ss_to_microsec(settings.values[property_shutter_speed]) &&
-                      direction == (new_speed < ss_to_microsec(settings.values[property_shutter_speed]) ? ss_increment : ss_decrement));
-              print(settings);
+        session.execute([&](camera_io& io) {
+          if (splitLine.size() > 1) {
+            double nom, denom;
+            int res = std::sscanf(splitLine[1].c_str(), "%lf/%lf", &nom, &denom);
+            if (res > 0) {
+              double new_speed = (res == 1 ? nom : nom / denom) * 1000000.0;
+              if (io.refresh_settings() && io.settings.values[property_shutter_speed] > 0 &&
+                  new_speed != ss_to_microsec(io.settings.values[property_shutter_speed])) {
+                const ss_update_direction direction = new_speed < ss_to_microsec(io.settings.values[property_shutter_speed]) ? ss_increment : ss_decrement;
+                uint64_t last_speed = 0;
+                do {
+                  last_speed = ss_to_microsec(io.settings.values[property_shutter_speed]);
+                  if (!update_setting(io.control, direction))
+                    break;
+                } while(io.refresh_settings() &&
+                        ss_to_microsec(io.settings.values[property_shutter_speed]) != last_speed &&
+                        new_speed != ss_to_microsec(io.settings.values[property_shutter_speed]) &&
+                        direction == (new_speed < ss_to_microsec(io.settings.values[property_shutter_speed]) ? ss_increment : ss_decrement));
+                print(io.settings);
+              }
             }
           }
-        }
+        });
       } break;
 
       case command::exposure_compensation: {
@@ -485,9 +1347,9 @@ int main(int const argc, char const* argv[]) {
           int direction = std::stoi(splitLine[1], 0, 0);
           log(LOG_DEBUG, string_format("%s(%i)", splitLine[0].c_str(), direction));
           if (direction != 0) {
-            if (update_setting(sockfd, direction < 0 ? exp_decrement : exp_increment)) {
-              if (current_settings(sockfd, settings))
-                print(settings);
+            if (session.step(property_exposure_compensation, direction).get()) {
+              current_properties settings = session.settings();
+              print(settings);
             } else {
               log(LOG_ERROR, string_format("Failed to adjust exposure correction %i", direction));
             }
@@ -496,77 +1358,87 @@ int main(int const argc, char const* argv[]) {
       } break;
 
       case command::set_exposure_compensation: {
-        if (splitLine.size() > 1) {
-          uint32_t const exp = static_cast<uint32_t>(std::stod(splitLine[1]) * 1000.0);
-          if (current_settings(sockfd, settings) && exp != settings.values[property_exposure_compensation]) {
-            const exp_update_direction direction = exp < settings.values[property_exposure_compensation] ? exp_decrement : exp_increment;
-            uint32_t last_exp = 0;
-            do {
-              last_exp = settings.values[property_exposure_compensation];
-              if (!update_setting(sockfd, direction))
-                break;
-            } while(current_settings(sockfd, settings) && 
-                    settings.values[property_exposure_compensation] != last_exp && 
-                    exp != settings.values[property_exposure_compensation] &&
-                    direction == (exp < settings.values[property_exposure_compensation] ? exp_decrement : exp_increment));
-            print(settings);
-          } 
-        }
+        session.execute([&](camera_io& io) {
+          if (splitLine.size() > 1) {
+            uint32_t const exp = static_cast<uint32_t>(std::stod(splitLine[1]) * 1000.0);
+            if (io.refresh_settings() && exp != io.settings.values[property_exposure_compensation]) {
+              const exp_update_direction direction = exp < io.settings.values[property_exposure_compensation] ? exp_decrement : exp_increment;
+              uint32_t last_exp = 0;
+              do {
+                last_exp = io.settings.values[property_exposure_compensation];
+                if (!update_setting(io.control, direction))
+                  break;
+              } while(io.refresh_settings() && 
+                      io.settings.values[property_exposure_compensation] != last_exp && 
+                      exp != io.settings.values[property_exposure_compensation] &&
+                      direction == (exp < io.settings.values[property_exposure_compensation] ? exp_decrement : exp_increment));
+              print(io.settings);
+            } 
+          }
+        });
       } break;
 
       case command::white_balance: {
-        if (splitLine.size() > 1) {
-          uint32_t const value = std::stoi(splitLine[1], 0, 0);
-          log(LOG_DEBUG, string_format("%s(%d)", splitLine[0].c_str(), value));
-          if (is_known_property_value(property_white_balance, value) && update_setting(sockfd, property_white_balance, value)) {
-            if (current_settings(sockfd, settings))
-              print(settings);
-          } else {
-            log(LOG_ERROR, string_format("Failed to set white_balance %d", value));
+        session.execute([&](camera_io& io) {
+          if (splitLine.size() > 1) {
+            uint32_t const value = std::stoi(splitLine[1], 0, 0);
+            log(LOG_DEBUG, string_format("%s(%d)", splitLine[0].c_str(), value));
+            if (is_known_property_value(property_white_balance, value) && update_setting(io.control, property_white_balance, value)) {
+              if (io.refresh_settings())
+                print(io.settings);
+            } else {
+              log(LOG_ERROR, string_format("Failed to set white_balance %d", value));
+            }
           }
-        }
+        });
       } break;
 
       case command::film_simulation: {
-        if (splitLine.size() > 1) {
-          uint32_t const value = std::stoi(splitLine[1], 0, 0);
-          log(LOG_DEBUG, string_format("%s (%d)", splitLine[0].c_str(), value));
-
-          if (is_known_property_value(property_film_simulation, value) && update_setting(sockfd, property_film_simulation, value)) {
-            if (current_settings(sockfd, settings))
-              print(settings);
-          } else {
-            log(LOG_ERROR, string_format("Failed to set film simulation %d", value));
+        session.execute([&](camera_io& io) {
+          if (splitLine.size() > 1) {
+            uint32_t const value = std::stoi(splitLine[1], 0, 0);
+            log(LOG_DEBUG, string_format("%s (%d)", splitLine[0].c_str(), value));
+
+            if (is_known_property_value(property_film_simulation, value) && update_setting(io.control, property_film_simulation, value)) {
+              if (io.refresh_settings())
+                print(io.settings);
+            } else {
+              log(LOG_ERROR, string_format("Failed to set film simulation %d", value));
+            }
           }
-        }
+        });
       } break;
 
       case command::flash: {
-        if (splitLine.size() > 1) {
-          uint32_t const value = std::stoi(splitLine[1], 0, 0);
-          log(LOG_DEBUG, string_format("%s (%d)", splitLine[0].c_str(), value));
-
-          if (is_known_property_value(property_flash, value) && update_setting(sockfd, property_flash, value)) {
-            if (current_settings(sockfd, settings))
-              print(settings);
-          } else {
-            log(LOG_ERROR, string_format("Failed to set flash mode  %d", value));
+        session.execute([&](camera_io& io) {
+          if (splitLine.size() > 1) {
+            uint32_t const value = std::stoi(splitLine[1], 0, 0);
+            log(LOG_DEBUG, string_format("%s (%d)", splitLine[0].c_str(), value));
+
+            if (is_known_property_value(property_flash, value) && update_setting(io.control, property_flash, value)) {
+              if (io.refresh_settings())
+                print(io.settings);
+            } else {
+              log(LOG_ERROR, string_format("Failed to set flash mode  %d", value));
+            }
           }
-        }
+        });
       } break;
 
       case command::timer: {
-        if (splitLine.size() > 1) {
-          uint32_t const value = std::stoi(splitLine[1], 0, 0);
-          log(LOG_DEBUG, string_format("%s (%d)", splitLine[0].c_str(), value));
-
-          if (is_known_property_value(property_self_timer, value) && update_setting(sockfd, property_self_timer, value)) {
-            if (current_settings(sockfd, settings))
-              print(settings);
-          } else {
-            log(LOG_ERROR, string_format("Failed to set timer %d", value));
+        session.execute([&](camera_io& io) {
+          if (splitLine.size() > 1) {
+            uint32_t const value = std::stoi(splitLine[1], 0, 0);
+            log(LOG_DEBUG, string_format("%s (%d)", splitLine[0].c_str(), value));
+
+            if (is_known_property_value(property_self_timer, value) && update_setting(io.control, property_self_timer, value)) {
+              if (io.refresh_settings())
+                print(io.settings);
+            } else {
+              log(LOG_ERROR, string_format("Failed to set timer %d", value));
+            }
           }
-        }
+        });
       } break;
 
       case command::focus_point: {
@@ -576,70 +1448,293 @@ int main(int const argc, char const* argv[]) {
       } break;
 
       case command::unlock_focus: {
-        if (splitLine.size() == 1) {
-          if (unlock_focus(sockfd)) {
-            if (current_settings(sockfd, settings))
-              print(settings);
+        session.execute([&](camera_io& io) {
+          if (splitLine.size() == 1) {
+            if (unlock_focus(io.control)) {
+              if (io.refresh_settings())
+                print(io.settings);
+            } else {
+              log(LOG_ERROR, string_format("Failed to unlock focus"));
+            }
+          }
+        });
+      } break;
+
+      case command::start_record: {
+        session.execute([&](camera_io& io) {
+          if( cur_record_id ) {
+              log(LOG_ERROR, string_format("Already recording, issue stop_record first"));
+              return;
+          }
+
+          cur_record_id = start_record(io.control);
+          if (cur_record_id) {
+            if (io.refresh_settings())
+                print(io.settings);
+          } else {
+              log(LOG_ERROR, string_format("Failed to start recording"));
+          }
+        });
+      } break;
+
+      case command::stop_record: {
+        session.execute([&](camera_io& io) {
+          if( !cur_record_id ) {
+              log(LOG_ERROR, string_format("Not recording, issue start_record first"));
+              return;
+          }
+
+          if(stop_record(io.control, cur_record_id)) {
+            cur_record_id = 0;
+            if (io.refresh_settings())
+                print(io.settings);
           } else {
-            log(LOG_ERROR, string_format("Failed to unlock focus"));
+              log(LOG_ERROR, string_format("Failed to stop recording"));
+          }
+        });
+      } break;
+
+      // needs "connect browse", parameters: index file, pipeline depth, camera name
+      case command::browse: {
+        session.execute([&](camera_io& io) {
+          if (splitLine.size() > 1) {
+            card_index_writer index;
+            if (!index.open(splitLine[1].c_str()))
+              return;
+
+            if (!thumb_cache.is_open())
+              thumb_cache.open(".", thumb_cache_budget);
+
+            browse_options options;
+            if (splitLine.size() > 2)
+              options.pipeline_depth = std::stoi(splitLine[2], 0, 0);
+            options.cache = &thumb_cache;
+            options.camera = camera_key(splitLine.size() > 3 ? splitLine[3] : camera_name);
+
+            auto const start = std::chrono::steady_clock::now();
+            size_t const count = browse_card(io.control, options,
+                [&](image_info const& info, uint8_t const* thumbnail, size_t thumbnail_size) {
+                  log(LOG_INFO, string_format("%5u %s %04d-%02d-%02d %02d:%02d:%02d %u bytes",
+                      info.index, info.filename.c_str(), info.date.year, info.date.month,
+                      info.date.day, info.date.hour, info.date.minute, info.date.second, info.size));
+                  index.add(info, thumbnail, thumbnail_size);
+                });
+            index.finish();
+            auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start);
+            log(LOG_INFO, string_format("Indexed %zu images in %lld ms", count,
+                                        static_cast<long long>(elapsed.count())));
           }
+        });
+      } break;
+
+      // parameters: interval in seconds, number of slots (0: until stopped),
+      // shots per slot, seconds between burst shots; or "stop"
+      case command::timelapse: {
+        if (splitLine.size() > 1 && splitLine[1] == "stop") {
+          if (timelapse) timelapse->stop();
+          break;
         }
+        if (splitLine.size() < 3) break;
+        if (timelapseThread.joinable()) {
+          if (timelapse) timelapse->stop();
+          timelapseThread.join();
+        }
+
+        intervalometer_options options;
+        options.interval = std::chrono::microseconds(static_cast<int64_t>(std::stod(splitLine[1]) * 1e6));
+        options.slots = std::stoul(splitLine[2], 0, 0);
+        if (splitLine.size() > 3)
+          options.burst = std::stoul(splitLine[3], 0, 0);
+        if (splitLine.size() > 4)
+          options.burst_interval = std::chrono::microseconds(static_cast<int64_t>(std::stod(splitLine[4]) * 1e6));
+        options.thumbnail_pattern = "timelapse_%05u.jpg";
+
+        timelapse.reset(new intervalometer(session));
+        timelapseThread = std::thread([&timelapse, options]() {
+          intervalometer_report report;
+          timelapse->run(options, &report, [](frame_timing const& f) {
+            log(LOG_INFO, string_format("frame %u slot %u error %lld us%s", f.frame, f.slot,
+                                        static_cast<long long>(f.trigger_error), f.success ? "" : " FAILED"));
+          });
+          print(report);
+        });
       } break;
 
-      case command::start_record: {
-        if( cur_record_id ) {
-            log(LOG_ERROR, string_format("Already recording, issue stop_record first"));
+      // "bracket ev <range> <step>" e.g. "bracket ev 2 0.333", or "bracket focus"
+      // to sweep the AF grid
+      case command::bracket: {
+        session.execute([&](camera_io& io) {
+          bracket_plan plan;
+          if (splitLine.size() > 3 && splitLine[1] == "ev")
+            plan = exposure_bracket(std::stod(splitLine[2]), std::stod(splitLine[3]));
+          else if (splitLine.size() > 1 && splitLine[1] == "focus")
+            plan = focus_grid_sweep(POINTS_X, POINTS_Y);
+          else
+            return;
+          plan.thumbnail_pattern = "bracket_%02u.jpg";
+
+          bracket_report report;
+          {
+            std::unique_ptr<control_channel> const channel = io.open_channel();
+            shutter_pipeline pipeline(*channel, io.async);
+            if (!run_bracket(*channel, pipeline, plan, &report))
+              log(LOG_ERROR, "bracket failed");
+          }
+          print(report);
+        });
+      } break;
+
+      // several cameras, e.g. one per interface: "cameras add <address> [interface]",
+      // "cameras connect", "cameras shutter", "cameras bracket ev <range> <step>",
+      // "cameras bracket focus", "cameras list", "cameras disconnect"
+      case command::cameras: {
+        if (splitLine.size() > 2 && splitLine[1] == "add") {
+          camera_endpoint endpoint;
+          endpoint.address = splitLine[2];
+          if (splitLine.size() > 3) endpoint.device = splitLine[3];
+          cameras.add(endpoint);
+        } else if (splitLine.size() > 1 && splitLine[1] == "connect") {
+          size_t const connected = cameras.connect_all("HackedClient", &caps_cache);
+          log(LOG_INFO, string_format("%zu of %zu cameras connected", connected, cameras.size()));
+        } else if (splitLine.size() > 1 && splitLine[1] == "shutter") {
+          sync_shutter_report report;
+          if (!cameras.shutter("camera_%02u.jpg", &report))
+            log(LOG_ERROR, "failure\n");
+          print(report);
+        } else if (splitLine.size() > 2 && splitLine[1] == "bracket") {
+          bracket_plan plan;
+          if (splitLine.size() > 4 && splitLine[2] == "ev")
+            plan = exposure_bracket(std::stod(splitLine[3]), std::stod(splitLine[4]));
+          else if (splitLine[2] == "focus")
+            plan = focus_grid_sweep(POINTS_X, POINTS_Y);
+          else
             break;
-        }
+          plan.thumbnail_pattern = "bracket_%02u.jpg";
 
-        cur_record_id = start_record(sockfd);
-        if (cur_record_id) {
-          if (current_settings(sockfd, settings))
-              print(settings);
+          std::vector<bracket_report> reports;
+          if (!cameras.bracket(plan, &reports))
+            log(LOG_ERROR, "failure\n");
+          for (bracket_report const& report : reports) print(report);
+        } else if (splitLine.size() > 1 && splitLine[1] == "disconnect") {
+          cameras.disconnect_all();
         } else {
-            log(LOG_ERROR, string_format("Failed to start recording"));
+          for (size_t i = 0; i < cameras.size(); ++i) {
+            camera_session& camera = cameras[i];
+            log(LOG_INFO, string_format("%2zu %s %s %s (%s)", i, camera.endpoint().address.c_str(),
+                                        camera.endpoint().device.c_str(),
+                                        camera.profile().camera.name.c_str(),
+                                        camera.is_connected() ? "connected" : "not connected"));
+          }
         }
       } break;
 
-      case command::stop_record: {
-        if( !cur_record_id ) {
-            log(LOG_ERROR, string_format("Not recording, issue start_record first"));
-            break;
+      // "shutter_at <unix time>" or "shutter_at +<seconds>", "shutter_at cancel"
+      case command::shutter_at: {
+        if (splitLine.size() < 2) break;
+        if (splitLine[1] == "cancel") {
+          if (scheduled) scheduled->cancel();
+          break;
         }
-
-        if(stop_record(sockfd, cur_record_id)) {
-          cur_record_id = 0;
-          if (current_settings(sockfd, settings))
-              print(settings);
-        } else {
-            log(LOG_ERROR, string_format("Failed to stop recording"));
+        if (scheduledThread.joinable()) {
+          if (scheduled) scheduled->cancel();
+          scheduledThread.join();
         }
+
+        scheduled_shutter_options options;
+        std::string const& when = splitLine[1];
+        std::chrono::duration<double> const seconds(std::stod(when[0] == '+' ? when.substr(1) : when));
+        auto const offset = std::chrono::duration_cast<std::chrono::system_clock::duration>(seconds);
+        options.at = when[0] == '+' ? std::chrono::system_clock::now() + offset
+                                    : std::chrono::system_clock::time_point(offset);
+        options.thumbnail = "scheduled.jpg";
+
+        scheduled.reset(new scheduled_shutter(session));
+        scheduledThread = std::thread([&scheduled, options]() {
+          scheduled_shutter_report report;
+          scheduled->fire_at(options, &report);
+          print(report);
+        });
       } break;
 
       case command::current_settings: {
-        if (current_settings(sockfd, settings))
+        if (session.refresh_settings().get()) {
+          current_properties settings = session.settings();
           print(settings);
-        else
+        } else {
           log(LOG_ERROR, "fail");
+        }
+      } break;
+
+      // frame rate and gaps of the stream, latency of the stream_cv stages
+      case command::stream_stats: {
+        print(live_view_link.statistics());
+        print(live_view_timing);
+      } break;
+
+      // parameters: segment file of a stream recording, seconds from its
+      // start; prints the frame there and saves it to out/frame.jpg
+      case command::recording: {
+        if (splitLine.size() < 2) break;
+        mjpeg_segment segment;
+        if (!segment.open(splitLine[1].c_str()) || segment.size() == 0) break;
+
+        mjpeg_frame_entry const& last = segment[segment.size() - 1];
+        printf("segment %u: %zu frames, %.3f to %.3f s\n", segment.segment(), segment.size(),
+               segment[0].timestamp_us / 1e6, last.timestamp_us / 1e6);
+        if (splitLine.size() < 3) break;
+
+        size_t const i = segment.seek(std::chrono::microseconds(
+            static_cast<int64_t>(std::stod(splitLine[2]) * 1e6)));
+        printf("frame %u at %.3f s, %u bytes\n", segment[i].frame_number,
+               segment[i].timestamp_us / 1e6, segment[i].size);
+        FILE* const file = fopen("out/frame.jpg", "wb");
+        if (file) {
+          fwrite(segment.image(i), segment[i].size, 1, file);
+          fclose(file);
+        }
+      } break;
+
+      // parameters: width, height (even, default 640x480), iterations
+      case command::bench_color: {
+        int const width = splitLine.size() > 2 ? std::stoi(splitLine[1]) : 640;
+        int const height = splitLine.size() > 2 ? std::stoi(splitLine[2]) : 480;
+        int const iterations = splitLine.size() > 3 ? std::stoi(splitLine[3]) : 200;
+        if (width > 0 && height > 0 && width % 2 == 0 && height % 2 == 0 && iterations > 0)
+          bench_color(width, height, iterations);
+      } break;
+
+      // parameter: segment file of a stream recording
+      case command::bench_jpeg: {
+        if (splitLine.size() > 1) bench_jpeg(splitLine[1].c_str());
+      } break;
+
+      // wait times of the session command queue by priority
+      case command::queue_stats: {
+        print(session.queue_stats());
       } break;
 
       default: { log(LOG_ERROR, string_format("Unreconized command: %s", line.c_str())); }
     }
   }
 
-  if (imageStreamThread.joinable()) {
-    imageStreamFlag = false;
-    imageStreamThread.join();
+  if (timelapseThread.joinable()) {
+    timelapse->stop();
+    timelapseThread.join();
   }
 
-#ifdef WITH_OPENCV
-  if (imageStreamCVThread.joinable()) {
-    imageStreamFlag = false;
-    imageStreamCVThread.join();
+  if (scheduledThread.joinable()) {
+    scheduled->cancel();
+    scheduledThread.join();
   }
+
+  imageStreamFlag = false;
+  imageStreamThread.join();
+#ifdef WITH_OPENCV
+  imageStreamCVThread.join();
 #endif
 
-  terminate_control_connection(sockfd);
+  session.disconnect();
 
   return 0;
 }